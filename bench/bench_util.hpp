@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+using std::size_t;
+using std::string;
+using std::string_view;
+using std::vector;
+
+/**
+ * Shared pieces of the benchmark suite.
+ *
+ * The library is parameterized by a hash backend H, a template such that
+ * H<T>{}(x) hashes an x of type T. The benchmarks sweep two backends:
+ *
+ *     std::hash  the default backend of make_trapdoor
+ *     fnv1a      FNV-1a over the bytes of the value, a simple portable
+ *                backend whose hashes do not depend on the standard library
+ */
+
+template <typename T>
+struct fnv1a
+{
+    size_t operator()(T const & x) const
+    {
+        if constexpr (std::is_convertible_v<T const &, string_view>)
+            return bytes(string_view(x));
+        else
+        {
+            static_assert(std::is_trivially_copyable_v<T>,
+                "fnv1a hashes strings and trivially copyable values");
+            return bytes(string_view((char const *)&x, sizeof(x)));
+        }
+    }
+
+    static size_t bytes(string_view s)
+    {
+        std::uint64_t h = 0xcbf29ce484222325ull;
+        for (unsigned char c : s)
+        {
+            h ^= c;
+            h *= 0x100000001b3ull;
+        }
+        return (size_t)h;
+    }
+};
+
+/**
+ * n random strings of the given length over a printable alphabet.
+ */
+inline vector<string> random_strings(size_t n, size_t length, unsigned seed = 1)
+{
+    std::mt19937_64 g(seed);
+    std::uniform_int_distribution<int> c('!', '~');
+    vector<string> xs(n);
+    for (auto & x : xs)
+    {
+        x.resize(length);
+        for (auto & ch : x)
+            ch = (char)c(g);
+    }
+    return xs;
+}
+
+inline string const & bench_secret()
+{
+    static string const s = "benchmark secret";
+    return s;
+}
@@ -0,0 +1,118 @@
+/**
+ * interleaved_probe_bench: contains on a k-DHS, probed one trapdoor at a
+ * time against interleaved probing (interleaved_probe.hpp) with a sweep of
+ * widths.
+ *
+ * The sets are sized from cache-resident to many times the last-level
+ * cache, where each probe of the plain loop misses. For each set size and
+ * width, one JSON object is written per line to stdout with the nanoseconds
+ * per probe and the speedup over the plain loop. Every interleaved result
+ * is checked against the plain loop.
+ *
+ * The k-DHS is filled with random seeds and hashes rather than built, since
+ * the probe cost does not depend on how the seeds were found.
+ *
+ * Usage:
+ *     interleaved_probe_bench [--probes N] [--max-bins-log2 B]
+ *
+ * Build:
+ *     c++ -std=c++20 -O2 -Iinclude bench/interleaved_probe_bench.cpp \
+ *         -o interleaved_probe_bench
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include "cipher_trapdoor_sets/interleaved_probe.hpp"
+#include "cipher_trapdoor_sets/singular_hash_set.hpp"
+#include "cipher_trapdoor_sets/trapdoor.hpp"
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace
+{
+    struct options
+    {
+        size_t probes = size_t(1) << 22;
+        size_t max_bins_log2 = 26;
+    };
+
+    template <typename F>
+    double ns_per_probe(size_t n, F f)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        f();
+        return std::chrono::duration<double,std::nano>(
+            std::chrono::steady_clock::now() - start).count() / n;
+    }
+
+    void run(size_t bins_log2, options const & opts, std::mt19937_64 & g)
+    {
+        disjoint_hash_set<size_t> xs;
+        xs.r = 4;
+        xs.key_hash = 1;
+        xs.seeds.resize(size_t(1) << bins_log2);
+        xs.hashes.resize(xs.seeds.size());
+        for (size_t b = 0; b < xs.seeds.size(); ++b)
+        {
+            xs.seeds[b] = g() & 0xff;
+            xs.hashes[b] = g() & 0xf;
+        }
+
+        vector<trapdoor<size_t>> qs(opts.probes);
+        for (auto & q : qs)
+            q = trapdoor<size_t>{(size_t)g(), 1};
+
+        vector<char> plain(qs.size()), interleaved(qs.size());
+        auto const base = ns_per_probe(qs.size(), [&]
+        {
+            for (size_t i = 0; i < qs.size(); ++i)
+                plain[i] = (bool)contains(qs[i], xs).value;
+        });
+
+        for (size_t width : {1u, 4u, 8u, 16u, 32u, 64u})
+        {
+            auto const t = ns_per_probe(qs.size(), [&]
+            {
+                interleave_probes(qs.size(),
+                    [&](size_t i) { return contains_probe(qs[i], xs); },
+                    [&](size_t i, auto const & r) { interleaved[i] = (bool)r.value; },
+                    width);
+            });
+            std::printf("{\"bins\":%zu,\"bytes\":%zu,\"width\":%zu,"
+                "\"plain_ns\":%.2f,\"interleaved_ns\":%.2f,\"speedup\":%.3f,"
+                "\"agrees\":%s}\n",
+                xs.seeds.size(), 2 * xs.seeds.size() * sizeof(size_t), width,
+                base, t, base / t, plain == interleaved ? "true" : "false");
+        }
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    options opts;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string const arg = argv[i];
+        auto const value = std::strtoull(argv[i+1], nullptr, 10);
+        if (arg == "--probes")
+            opts.probes = value;
+        else if (arg == "--max-bins-log2")
+            opts.max_bins_log2 = value;
+        else
+        {
+            std::fprintf(stderr, "usage: interleaved_probe_bench [--probes N] "
+                "[--max-bins-log2 B]\n");
+            return 2;
+        }
+    }
+
+    std::mt19937_64 g(20240101);
+    for (size_t b = 10; b <= opts.max_bins_log2; b += 4)
+        run(b, opts, g);
+    return 0;
+}
@@ -0,0 +1,271 @@
+/**
+ * shs_construction_bench: validates the seed search of the singular hash set
+ * (SHS) and the k-disjoint hash set (k-DHS) against the geometric model of
+ * paper/sections/shs.tex.
+ *
+ * For each point (m, eps = 2^-r, k) of the sweep, the harness builds reps
+ * sets over fresh random elements and records, per construction, the number
+ * of trials, the wall time and the encoded bit length. These are compared
+ * against the model:
+ *
+ *     Q ~ Geom(p), p = eps^(m-1)
+ *         E[Q] = 1/p, Var[Q] = (1-p)/p^2
+ *
+ *     N = floor(log2 Q), the bit length of the seed, with
+ *         P[N = n] = (1-p)^(2^n - 1) - (1-p)^(2^(n+1) - 1)
+ *
+ *     BL = r + N, with the closed-form approximation of shs.tex
+ *         BL ~ -m log2 eps + (1 - eps^(m-1))/2 log2 e
+ *
+ * The distribution of N is compared by the total variation distance between
+ * its empirical and model probability mass functions. For the k-DHS, the
+ * model is evaluated per bin from the realized bin sizes and summed.
+ *
+ * Points (or, for the k-DHS, realized instances) whose expected number of
+ * trials exceeds a quarter of the trial budget are skipped, so reps counts
+ * the constructions that were actually run.
+ *
+ * The time per trial separates implementation overhead (hashing and the
+ * early-exit compare) from the number of trials the math predicts, and
+ * trials * time-per-trial gives a construction budget for a given (m, eps).
+ *
+ * One JSON object is written per line to stdout.
+ *
+ * Usage:
+ *     shs_construction_bench [--reps N] [--budget TRIALS] [--max-m M]
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -Iinclude bench/shs_construction_bench.cpp \
+ *         -o shs_construction_bench
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "cipher_trapdoor_sets/singular_hash_set.hpp"
+#include "cipher_trapdoor_sets/trapdoor.hpp"
+using std::map;
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace
+{
+    struct options
+    {
+        size_t reps = 200;
+        size_t budget = size_t(1) << 26;
+        size_t max_m = 12;
+    };
+
+    struct summary
+    {
+        double mean = 0;
+        double var = 0;
+    };
+
+    summary summarize(vector<double> const & xs)
+    {
+        summary s;
+        for (auto x : xs)
+            s.mean += x;
+        s.mean /= xs.size();
+        for (auto x : xs)
+            s.var += (x - s.mean) * (x - s.mean);
+        s.var /= xs.size() > 1 ? xs.size() - 1 : 1;
+        return s;
+    }
+
+    // P[N = n] for the seed bit length N = floor(log2 Q), Q ~ Geom(p).
+    double seed_bit_length_pmf(unsigned n, double p)
+    {
+        auto const lq = std::log1p(-p);
+        return std::exp((std::ldexp(1., n) - 1) * lq) -
+               std::exp((std::ldexp(1., n + 1) - 1) * lq);
+    }
+
+    double expected_seed_bit_length(double p)
+    {
+        double e = 0;
+        for (unsigned n = 1; n < 128; ++n)
+            e += n * seed_bit_length_pmf(n, p);
+        return e;
+    }
+
+    vector<trapdoor<size_t>> random_trapdoors(size_t m, std::mt19937_64 & g)
+    {
+        vector<trapdoor<size_t>> xs(m);
+        for (auto & x : xs)
+            x = trapdoor<size_t>{(size_t)g(), 1};
+        return xs;
+    }
+
+    void run_shs(size_t m, unsigned r, options const & opts, std::mt19937_64 & g)
+    {
+        auto const eps = std::ldexp(1., -(int)r);
+        auto const p = std::pow(eps, (double)(m - 1));
+        if (4 / p > opts.budget)
+            return;
+
+        vector<double> trials, seconds, bits;
+        map<unsigned,size_t> seed_bits;
+        size_t failures = 0;
+        for (size_t i = 0; i < opts.reps; ++i)
+        {
+            auto const xs = random_trapdoors(m, g);
+            shs_construction_stats s;
+            auto const start = std::chrono::steady_clock::now();
+            auto shs = make_singular_hash_set(xs.begin(), xs.end(), r, opts.budget, &s);
+            auto const t = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            if (!shs)
+            {
+                ++failures;
+                continue;
+            }
+            trials.push_back((double)s.trials);
+            seconds.push_back(t);
+            bits.push_back((double)s.bit_length);
+            ++seed_bits[s.bit_length - r];
+        }
+        if (trials.empty())
+            return;
+
+        auto const q = summarize(trials);
+        auto const w = summarize(seconds);
+        auto const b = summarize(bits);
+
+        double tv = 0;
+        for (unsigned n = 0; n < 64; ++n)
+        {
+            auto it = seed_bits.find(n);
+            auto const empirical = it == seed_bits.end() ? 0. :
+                (double)it->second / trials.size();
+            tv += std::fabs(empirical - seed_bit_length_pmf(n, p));
+        }
+        tv /= 2;
+
+        std::printf("{\"kind\":\"shs\",\"m\":%zu,\"r\":%u,\"eps\":%g,\"reps\":%zu,"
+            "\"failures\":%zu,"
+            "\"trials_mean\":%g,\"trials_model\":%g,"
+            "\"trials_var\":%g,\"trials_var_model\":%g,"
+            "\"bits_mean\":%g,\"bits_model\":%g,\"bits_paper\":%g,"
+            "\"bits_per_element\":%g,\"bits_per_element_bound\":%g,"
+            "\"seed_bits_tv\":%g,"
+            "\"seconds_mean\":%g,\"ns_per_trial\":%g}\n",
+            m, r, eps, opts.reps, failures,
+            q.mean, 1 / p,
+            q.var, (1 - p) / (p * p),
+            b.mean, r + expected_seed_bit_length(p),
+            -(double)m * std::log2(eps) + (1 - p) / 2 * std::log2(std::exp(1.)),
+            b.mean / m, -std::log2(eps),
+            tv,
+            w.mean, 1e9 * w.mean / q.mean);
+    }
+
+    void run_dhs(size_t m, size_t k, unsigned r, options const & opts, std::mt19937_64 & g)
+    {
+        auto const eps = std::ldexp(1., -(int)r);
+
+        vector<double> trials, trials_model, seconds, bits, bits_model;
+        size_t failures = 0;
+        for (size_t i = 0; i < opts.reps; ++i)
+        {
+            auto const xs = random_trapdoors(m, g);
+            vector<shs_construction_stats> stats;
+
+            // the model is evaluated on the realized bin sizes.
+            auto const bins = (m + k - 1) / k;
+            vector<size_t> sizes(bins);
+            for (auto const & x : xs)
+                ++sizes[dhs_bin(x.value_hash, bins)];
+            double tm = 0, bm = 0;
+            for (auto c : sizes)
+            {
+                auto const p = c == 0 ? 1. : std::pow(eps, (double)(c - 1));
+                tm += c == 0 ? 0. : 1 / p;
+                bm += r + expected_seed_bit_length(p);
+            }
+            if (4 * tm > opts.budget)
+                continue;
+
+            auto const start = std::chrono::steady_clock::now();
+            auto dhs = make_disjoint_hash_set(xs.begin(), xs.end(), k, r,
+                opts.budget, &stats);
+            auto const t = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            if (!dhs)
+            {
+                ++failures;
+                continue;
+            }
+
+            double total = 0;
+            for (auto const & s : stats)
+                total += (double)s.trials;
+            trials.push_back(total);
+            trials_model.push_back(tm);
+            seconds.push_back(t);
+            bits.push_back((double)bit_length(*dhs));
+            bits_model.push_back(bm);
+        }
+        if (trials.empty())
+            return;
+
+        auto const q = summarize(trials);
+        auto const qm = summarize(trials_model);
+        auto const w = summarize(seconds);
+        auto const b = summarize(bits);
+        auto const bm = summarize(bits_model);
+
+        std::printf("{\"kind\":\"dhs\",\"m\":%zu,\"k\":%zu,\"r\":%u,\"eps\":%g,"
+            "\"reps\":%zu,\"failures\":%zu,"
+            "\"trials_mean\":%g,\"trials_model\":%g,"
+            "\"bits_mean\":%g,\"bits_model\":%g,"
+            "\"bits_per_element\":%g,\"bits_per_element_bound\":%g,"
+            "\"seconds_mean\":%g,\"ns_per_trial\":%g}\n",
+            m, k, r, eps, trials.size(), failures,
+            q.mean, qm.mean,
+            b.mean, bm.mean,
+            b.mean / m, -std::log2(eps),
+            w.mean, 1e9 * w.mean / q.mean);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    options opts;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string const arg = argv[i];
+        auto const value = std::strtoull(argv[i+1], nullptr, 10);
+        if (arg == "--reps")
+            opts.reps = value;
+        else if (arg == "--budget")
+            opts.budget = value;
+        else if (arg == "--max-m")
+            opts.max_m = value;
+        else
+        {
+            std::fprintf(stderr, "usage: shs_construction_bench [--reps N] "
+                "[--budget TRIALS] [--max-m M]\n");
+            return 2;
+        }
+    }
+
+    std::mt19937_64 g(20240101);
+    for (unsigned r : {1u, 2u, 4u, 8u})
+    {
+        for (size_t m = 2; m <= opts.max_m; ++m)
+            run_shs(m, r, opts, g);
+        for (size_t k : {2u, 4u, 8u})
+            for (size_t m : {64u, 1024u})
+                run_dhs(m, k, r, opts, g);
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+/**
+ * trapdoor_bench: throughput and latency of the trapdoor operations.
+ *
+ * Covers make_trapdoor, the batch paths, the key cache, key filtering and
+ * == on trapdoor<X>. The set algebras (trapdoor_boolean_algebra.hpp,
+ * trapdoor_symmetric_difference_group.hpp, trapdoor_seq.hpp) and
+ * random_trapdoor.hpp do not compile as they stand, so they have no
+ * benchmarks here.
+ *
+ * Each benchmark reports items per second (and bytes per second where the
+ * input is a string), and sweeps input sizes and batch sizes. Hash-based
+ * benchmarks are instantiated for each hash backend in bench_util.hpp.
+ *
+ * Build and run, writing JSON results:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude bench/trapdoor_bench.cpp \
+ *         -lbenchmark_main -lbenchmark -o trapdoor_bench
+ *     ./trapdoor_bench --benchmark_out=trapdoor_bench.json \
+ *         --benchmark_out_format=json
+ */
+
+#include <benchmark/benchmark.h>
+#include <numeric>
+#include <string>
+#include <vector>
+#include "bench_util.hpp"
+#include "cipher_trapdoor_sets/trapdoor.hpp"
+#include "cipher_trapdoor_sets/trapdoor_batch.hpp"
+#include "cipher_trapdoor_sets/trapdoor_key.hpp"
+#include "cipher_trapdoor_sets/trapdoor_key_cache.hpp"
+#include "cipher_trapdoor_sets/trapdoor_key_filter.hpp"
+
+template <template <typename> typename H>
+static void BM_make_trapdoor(benchmark::State & state)
+{
+    auto const xs = random_strings(1024, (size_t)state.range(0));
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(make_trapdoor<string,H>(xs[i++ % xs.size()],
+            bench_secret()));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_make_trapdoor, std::hash)->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK_TEMPLATE(BM_make_trapdoor, fnv1a)->RangeMultiplier(8)->Range(8, 4096);
+
+template <template <typename> typename H>
+static void BM_make_trapdoor_expanded_key(benchmark::State & state)
+{
+    auto const xs = random_strings(1024, (size_t)state.range(0));
+    auto const key = make_trapdoor_key<H>(bench_secret());
+    size_t i = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(make_trapdoor(xs[i++ % xs.size()], key));
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_make_trapdoor_expanded_key, std::hash)->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK_TEMPLATE(BM_make_trapdoor_expanded_key, fnv1a)->RangeMultiplier(8)->Range(8, 4096);
+
+template <template <typename> typename H>
+static void BM_make_trapdoor_key(benchmark::State & state)
+{
+    for (auto _ : state)
+        benchmark::DoNotOptimize(make_trapdoor_key<H>(bench_secret()));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_make_trapdoor_key, std::hash);
+BENCHMARK_TEMPLATE(BM_make_trapdoor_key, fnv1a);
+
+template <template <typename> typename H>
+static void BM_make_trapdoors(benchmark::State & state)
+{
+    auto const n = (size_t)state.range(0);
+    auto const xs = random_strings(n, 16);
+    vector<trapdoor<string>> out(n);
+    for (auto _ : state)
+    {
+        make_trapdoors<H>(xs.begin(), xs.end(), bench_secret(), out.begin());
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK_TEMPLATE(BM_make_trapdoors, std::hash)->RangeMultiplier(8)->Range(64, 1 << 18);
+BENCHMARK_TEMPLATE(BM_make_trapdoors, fnv1a)->RangeMultiplier(8)->Range(64, 1 << 18);
+
+/**
+ * Multi-key batch path over a batch of 2^16 rows with range(0) distinct
+ * keys, assigned to rows at random.
+ */
+template <template <typename> typename H>
+static void BM_make_trapdoors_multi_key(benchmark::State & state)
+{
+    auto const n = size_t(1) << 16;
+    auto const keys = (size_t)state.range(0);
+    auto const xs = random_strings(n, 16);
+    auto const secrets = random_strings(keys, 32, 2);
+
+    vector<size_t> key_hashes(keys);
+    for (size_t j = 0; j < keys; ++j)
+        key_hashes[j] = make_trapdoor_key<H>(secrets[j]).key_hash;
+
+    std::mt19937_64 g(3);
+    vector<size_t> ids(n);
+    for (auto & id : ids)
+        id = key_hashes[g() % keys];
+
+    auto resolve = [&](size_t key_hash) -> string_view
+    {
+        for (size_t j = 0; j < keys; ++j)
+            if (key_hashes[j] == key_hash)
+                return secrets[j];
+        return {};
+    };
+
+    vector<trapdoor<string>> out(n);
+    for (auto _ : state)
+    {
+        make_trapdoors<H>(xs.begin(), xs.end(), ids.begin(), resolve, out.begin());
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK_TEMPLATE(BM_make_trapdoors_multi_key, std::hash)->RangeMultiplier(4)->Range(1, 256);
+BENCHMARK_TEMPLATE(BM_make_trapdoors_multi_key, fnv1a)->RangeMultiplier(4)->Range(1, 256);
+
+static void BM_cached_trapdoor_key(benchmark::State & state)
+{
+    auto const key_hash = make_trapdoor_key(bench_secret()).key_hash;
+    auto resolve = [](size_t) { return string_view(bench_secret()); };
+    for (auto _ : state)
+        benchmark::DoNotOptimize(cached_trapdoor_key(key_hash, resolve));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_cached_trapdoor_key);
+
+/**
+ * Key filtering of range(0) trapdoors against range(1) accepted keys, where
+ * half of the rows are rejected.
+ */
+static void BM_filter_by_key(benchmark::State & state)
+{
+    auto const n = (size_t)state.range(0);
+    auto const m = (size_t)state.range(1);
+
+    vector<size_t> keys(m);
+    std::iota(keys.begin(), keys.end(), size_t(100));
+
+    std::mt19937_64 g(4);
+    vector<trapdoor<string>> xs(n);
+    for (auto & x : xs)
+        x = trapdoor<string>{(size_t)g(), g() % 2 ? keys[g() % m] : size_t(1)};
+
+    vector<trapdoor<string>> out(n);
+    vector<std::uint64_t> rejects(reject_bitmap_words(n));
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(filter_by_key(xs.data(), n, keys.data(), m,
+            out.data(), rejects.data()));
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+    state.SetBytesProcessed(state.iterations() * n * sizeof(trapdoor<string>));
+}
+BENCHMARK(BM_filter_by_key)->ArgsProduct({{1 << 10, 1 << 14, 1 << 18}, {1, 4, 16}});
+
+static void BM_trapdoor_equal(benchmark::State & state)
+{
+    auto const xs = random_strings(1024, 16);
+    auto const key = make_trapdoor_key(bench_secret());
+    vector<trapdoor<string>> ts(xs.size());
+    make_trapdoors(xs.begin(), xs.end(), key, ts.begin());
+
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        auto const & a = ts[i % ts.size()];
+        auto const & b = ts[(i * 7 + 1) % ts.size()];
+        benchmark::DoNotOptimize(a == b);
+        ++i;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_trapdoor_equal);
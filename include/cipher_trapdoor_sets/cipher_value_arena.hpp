@@ -0,0 +1,471 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "trapdoor.hpp"
+#include "trapdoor_io.hpp"
+#include "type_fingerprint.hpp"
+using std::invalid_argument;
+using std::runtime_error;
+using std::size_t;
+using std::uint32_t;
+using std::uint64_t;
+using std::uint8_t;
+
+/**
+ * A flat, offset-based encoding of composite cipher values.
+ *
+ * A composite cipher value, e.g., a cipher<cipher<bool>> or a tagged
+ * composition trapdoor(T) + trapdoor(U) (trapdoor_tag.hpp), is a tree whose
+ * leaves are trapdoors and whose inner nodes are compositions. Built from
+ * pointer-linked nodes, each traversal and comparison chases pointers
+ * across the heap. A cipher_value_arena instead holds the nodes of any
+ * number of values in preorder, in parallel arrays indexed by node offset:
+ *
+ *     kind       : CIPHER_LEAF or CIPHER_COMPOSITE
+ *     extent     : the number of nodes in the node's subtree (1 for a leaf)
+ *     tag        : the node's trapdoor tag, e.g., make_trapdoor_tag<T>(k)
+ *     value_hash : a leaf's trapdoor; a composite's digest of its children
+ *     key_hash   : the key hash shared by the node's leaves
+ *
+ * A node's first child is at offset + 1 and each child's next sibling is at
+ * child + extent[child], so a value is the contiguous range
+ * [root, root + extent[root]) of every array and is traversed, compared and
+ * copied by linear scans. Extents are relative, so a value's range means
+ * the same at any offset, in any arena and in a serialized buffer.
+ *
+ *     cipher_value_arena a;
+ *     auto v = a.begin_composite(tags.get<pair_tag>().value);
+ *     a.leaf(tags.get<bool>().value, x);
+ *     a.leaf(tags.get<int>().value, y);
+ *     a.end_composite();
+ *
+ * Every node's hash covers its tag: a leaf's is its trapdoor's value hash
+ * keyed by its tag (cipher_leaf_hash), and a composite's is its value hash,
+ * an ordered digest of its tag and its children's hashes. So hash(value)
+ * of a composite is one load, and two values with different hashes are
+ * unequal without a scan. A value is the element of a set through
+ * make_trapdoor(value). Equality is representational and, as for
+ * trapdoor<X>, approximate: for uniform leaf value hashes, values that
+ * differ anywhere, in a leaf's tag included, collide with probability
+ * about 2^-64 per compared hash.
+ *
+ * The arrays use a polymorphic allocator, so an arena may live in a
+ * request_arena (request_arena.hpp). write_cipher_value serializes a value
+ * as its array slices and read_cipher_value validates the extents and
+ * appends the value to an arena; neither follows a pointer.
+ */
+
+enum cipher_node_kind : uint8_t
+{
+    CIPHER_LEAF = 1,
+    CIPHER_COMPOSITE = 2
+};
+
+constexpr char CIPHER_VALUE_MAGIC[8] = {'C','I','P','H','V','A','L','1'};
+constexpr size_t CIPHER_VALUE_HEADER_BYTES = 12;
+constexpr size_t CIPHER_VALUE_NODE_BYTES = 1 + 4 + 8 + 8 + 8;
+
+/**
+ * The hash of a leaf: its trapdoor's value hash keyed by its tag, so leaves
+ * that differ only in their tags hash apart.
+ */
+constexpr uint64_t cipher_leaf_hash(uint64_t tag, uint64_t value_hash)
+{
+    return keyed_fingerprint(tag, value_hash);
+}
+
+/**
+ * The digest of a composite, folded over the hashes of its children in
+ * order.
+ */
+constexpr uint64_t cipher_composite_seed(uint64_t tag)
+{
+    return keyed_fingerprint(tag, 0x636f6d706f736974ull);
+}
+
+constexpr uint64_t cipher_composite_step(uint64_t digest, uint64_t child_hash)
+{
+    return keyed_fingerprint(digest, child_hash);
+}
+
+class cipher_value_arena
+{
+public:
+    template <typename T>
+    using pmr_vector = std::vector<T,std::pmr::polymorphic_allocator<T>>;
+
+    explicit cipher_value_arena(
+        std::pmr::memory_resource * mr = std::pmr::get_default_resource()) :
+        kinds(mr),
+        extents(mr),
+        tags(mr),
+        value_hashes(mr),
+        key_hashes(mr),
+        open(mr) {}
+
+    /**
+     * Appends a leaf and returns its offset.
+     */
+    uint32_t leaf(uint64_t tag, uint64_t value_hash, uint64_t key_hash)
+    {
+        if (!open.empty())
+            check_child_key(open.size() - 1, CIPHER_LEAF, key_hash);
+        auto const i = push(CIPHER_LEAF, tag, value_hash, key_hash);
+        if (!open.empty())
+            add_child(i);
+        return i;
+    }
+
+    template <typename X>
+    uint32_t leaf(uint64_t tag, trapdoor<X> const & x)
+    {
+        return leaf(tag, (uint64_t)x.value_hash, (uint64_t)x.key_hash);
+    }
+
+    /**
+     * Opens a composite and returns its offset; the nodes appended until
+     * the matching end_composite() are its subtree.
+     */
+    uint32_t begin_composite(uint64_t tag)
+    {
+        auto const i = push(CIPHER_COMPOSITE, tag, cipher_composite_seed(tag), 0);
+        open.push_back(open_composite{i, false});
+        return i;
+    }
+
+    void end_composite()
+    {
+        if (open.empty())
+            throw runtime_error("no open composite");
+        auto const c = open.back();
+        if (open.size() > 1)
+            check_child_key(open.size() - 2, CIPHER_COMPOSITE, key_hashes[c.offset]);
+        open.pop_back();
+        extents[c.offset] = (uint32_t)(size() - c.offset);
+        if (!open.empty())
+            add_child(c.offset);
+    }
+
+    /**
+     * Copies the value at root of src (which may be this arena) to the end
+     * of this arena and returns its offset.
+     */
+    uint32_t append(cipher_value_arena const & src, uint32_t root)
+    {
+        if (src.is_open(root))
+            throw runtime_error("value has an open composite");
+        if (!open.empty())
+            check_child_key(open.size() - 1, src.kinds[root], src.key_hashes[root]);
+        auto const n = src.extent(root);
+        auto const i = reserve_nodes(n);
+        std::memcpy(kinds.data() + i, src.kinds.data() + root, n);
+        std::memcpy(extents.data() + i, src.extents.data() + root, n * 4);
+        std::memcpy(tags.data() + i, src.tags.data() + root, n * 8);
+        std::memcpy(value_hashes.data() + i, src.value_hashes.data() + root, n * 8);
+        std::memcpy(key_hashes.data() + i, src.key_hashes.data() + root, n * 8);
+        if (!open.empty())
+            add_child(i);
+        return i;
+    }
+
+    size_t size() const { return kinds.size(); }
+
+    /**
+     * True if node i is a composite begun and not yet ended, whose extent
+     * does not yet cover its subtree.
+     */
+    bool is_open(uint32_t i) const
+    {
+        for (auto const & c : open)
+        {
+            if (c.offset == i)
+                return true;
+        }
+        return false;
+    }
+
+    cipher_node_kind kind(uint32_t i) const { return (cipher_node_kind)kinds[i]; }
+    uint32_t extent(uint32_t i) const { return extents[i]; }
+    uint64_t tag(uint32_t i) const { return tags[i]; }
+    uint64_t value_hash(uint32_t i) const { return value_hashes[i]; }
+    uint64_t key_hash(uint32_t i) const { return key_hashes[i]; }
+
+    /**
+     * The hash of node i: cipher_leaf_hash for a leaf, the digest for a
+     * composite.
+     */
+    uint64_t node_hash(uint32_t i) const
+    {
+        return kinds[i] == CIPHER_LEAF ? cipher_leaf_hash(tags[i], value_hashes[i]) : value_hashes[i];
+    }
+
+    /**
+     * Calls f(child) on the children of node i, in order.
+     */
+    template <typename F>
+    void for_each_child(uint32_t i, F && f) const
+    {
+        auto const end = i + extents[i];
+        for (auto c = i + 1; c < end; c += extents[c])
+            f(c);
+    }
+
+    size_t arity(uint32_t i) const
+    {
+        size_t n = 0;
+        for_each_child(i, [&](uint32_t) { ++n; });
+        return n;
+    }
+
+    /**
+     * Representational equality of the value at i and the value at j of
+     * other.
+     */
+    bool equal(uint32_t i, cipher_value_arena const & other, uint32_t j) const
+    {
+        auto const n = extents[i];
+        return value_hashes[i] == other.value_hashes[j] &&
+            n == other.extents[j] &&
+            std::memcmp(kinds.data() + i, other.kinds.data() + j, n) == 0 &&
+            std::memcmp(extents.data() + i, other.extents.data() + j, n * 4) == 0 &&
+            std::memcmp(tags.data() + i, other.tags.data() + j, n * 8) == 0 &&
+            std::memcmp(value_hashes.data() + i, other.value_hashes.data() + j, n * 8) == 0 &&
+            std::memcmp(key_hashes.data() + i, other.key_hashes.data() + j, n * 8) == 0;
+    }
+
+    /**
+     * Releases every value; the arrays keep their capacity.
+     */
+    void clear()
+    {
+        kinds.clear();
+        extents.clear();
+        tags.clear();
+        value_hashes.clear();
+        key_hashes.clear();
+        open.clear();
+    }
+
+private:
+    struct open_composite
+    {
+        uint32_t offset;
+        bool keyed;                             // has a child with a key
+    };
+
+    uint32_t reserve_nodes(size_t n)
+    {
+        auto const i = size();
+        if (i + n > UINT32_MAX)
+            throw runtime_error("cipher value arena full");
+        kinds.resize(i + n);
+        extents.resize(i + n);
+        tags.resize(i + n);
+        value_hashes.resize(i + n);
+        key_hashes.resize(i + n);
+        return (uint32_t)i;
+    }
+
+    uint32_t push(cipher_node_kind k, uint64_t tag, uint64_t value_hash, uint64_t key_hash)
+    {
+        auto const i = reserve_nodes(1);
+        kinds[i] = k;
+        extents[i] = 1;
+        tags[i] = tag;
+        value_hashes[i] = value_hash;
+        key_hashes[i] = key_hash;
+        return i;
+    }
+
+    /**
+     * Throws if a child of the given kind and key may not join the open
+     * composite at depth d; a composite without leaves has no key (0) and
+     * joins any. Checked before the arena changes, so a throw leaves it as
+     * it was.
+     */
+    void check_child_key(size_t d, uint8_t kind, uint64_t key_hash) const
+    {
+        auto const & p = open[d];
+        if ((kind == CIPHER_LEAF || key_hash != 0) && p.keyed &&
+            key_hashes[p.offset] != key_hash)
+            throw invalid_argument("secret key mismatch");
+    }
+
+    /**
+     * Folds the completed child c into the innermost open composite.
+     */
+    void add_child(uint32_t c)
+    {
+        auto & p = open.back();
+        if (kinds[c] == CIPHER_LEAF || key_hashes[c] != 0)
+        {
+            key_hashes[p.offset] = key_hashes[c];
+            p.keyed = true;
+        }
+        value_hashes[p.offset] = cipher_composite_step(value_hashes[p.offset], node_hash(c));
+    }
+
+    pmr_vector<uint8_t> kinds;
+    pmr_vector<uint32_t> extents;
+    pmr_vector<uint64_t> tags;
+    pmr_vector<uint64_t> value_hashes;
+    pmr_vector<uint64_t> key_hashes;
+    pmr_vector<open_composite> open;
+};
+
+/**
+ * A value in an arena.
+ */
+struct cipher_value
+{
+    cipher_value_arena const * arena;
+    uint32_t root;
+};
+
+inline bool operator==(cipher_value const & x, cipher_value const & y)
+{
+    return x.arena->equal(x.root, *y.arena, y.root);
+}
+
+inline bool operator!=(cipher_value const & x, cipher_value const & y)
+{
+    return !(x == y);
+}
+
+inline uint64_t hash(cipher_value const & x)
+{
+    return x.arena->node_hash(x.root);
+}
+
+/**
+ * The value as an element of a set of composite values.
+ */
+inline auto make_trapdoor(cipher_value const & x)
+{
+    return trapdoor<cipher_value>{(size_t)hash(x), (size_t)x.arena->key_hash(x.root)};
+}
+
+/**
+ * Appends the serialized value to out: CIPHER_VALUE_MAGIC, the node count
+ * (uint32) and then each array's slice in turn, little-endian. Throws
+ * runtime_error, as append does, if the value is a composite not yet ended.
+ */
+template <typename A>
+void write_cipher_value(std::vector<uint8_t,A> & out, cipher_value const & x)
+{
+    auto const & a = *x.arena;
+    if (a.is_open(x.root))
+        throw runtime_error("value has an open composite");
+    auto const n = a.extent(x.root);
+    auto p = out.size();
+    out.resize(p + CIPHER_VALUE_HEADER_BYTES + (size_t)n * CIPHER_VALUE_NODE_BYTES);
+    auto b = out.data() + p;
+    std::memcpy(b, CIPHER_VALUE_MAGIC, 8);
+    store_le32(b + 8, n);
+    b += CIPHER_VALUE_HEADER_BYTES;
+    for (uint32_t i = 0; i < n; ++i)
+        *b++ = (uint8_t)a.kind(x.root + i);
+    for (uint32_t i = 0; i < n; ++i, b += 4)
+        store_le32(b, a.extent(x.root + i));
+    for (uint32_t i = 0; i < n; ++i, b += 8)
+        store_le64(b, a.tag(x.root + i));
+    for (uint32_t i = 0; i < n; ++i, b += 8)
+        store_le64(b, a.value_hash(x.root + i));
+    for (uint32_t i = 0; i < n; ++i, b += 8)
+        store_le64(b, a.key_hash(x.root + i));
+}
+
+/**
+ * Reads a value serialized by write_cipher_value from [p, p + bytes),
+ * appends it to the arena and returns it with the number of bytes read.
+ * Throws runtime_error if the buffer is truncated, its extents do not
+ * form a tree or its hashes do not match its leaves, leaves under
+ * different keys in one composite included.
+ */
+inline std::pair<cipher_value,size_t> read_cipher_value(
+    cipher_value_arena & arena,
+    uint8_t const * p,
+    size_t bytes)
+{
+    if (bytes < CIPHER_VALUE_HEADER_BYTES ||
+        std::memcmp(p, CIPHER_VALUE_MAGIC, 8) != 0)
+        throw runtime_error("not a cipher value");
+    auto const n = load_le32(p + 8);
+    if (n == 0 || (bytes - CIPHER_VALUE_HEADER_BYTES) / CIPHER_VALUE_NODE_BYTES < n)
+        throw runtime_error("truncated cipher value");
+
+    auto const kinds = p + CIPHER_VALUE_HEADER_BYTES;
+    auto const extents = kinds + n;
+    auto const tags = extents + (size_t)n * 4;
+    auto const value_hashes = tags + (size_t)n * 8;
+    auto const key_hashes = value_hashes + (size_t)n * 8;
+
+    // each node's subtree must end within its parent's, and a leaf has
+    // extent 1; the root spans all n nodes.
+    std::vector<uint32_t> ends{n};
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        while (ends.back() == i)
+            ends.pop_back();
+        auto const k = kinds[i];
+        auto const e = load_le32(extents + (size_t)i * 4);
+        if ((k != CIPHER_LEAF && k != CIPHER_COMPOSITE) || e == 0 ||
+            (k == CIPHER_LEAF && e != 1) || e > ends.back() - i ||
+            (i == 0 && e != n))
+            throw runtime_error("malformed cipher value");
+        if (k == CIPHER_COMPOSITE)
+            ends.push_back(i + e);
+    }
+
+    // the rebuild refuses a child whose key differs from its siblings'
+    // with invalid_argument, which for a buffer means it is malformed.
+    cipher_value_arena staged;
+    try
+    {
+        std::vector<uint32_t> open_ends;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            while (!open_ends.empty() && open_ends.back() == i)
+            {
+                staged.end_composite();
+                open_ends.pop_back();
+            }
+            auto const tag = load_le64(tags + (size_t)i * 8);
+            if (kinds[i] == CIPHER_LEAF)
+            {
+                staged.leaf(tag, load_le64(value_hashes + (size_t)i * 8),
+                    load_le64(key_hashes + (size_t)i * 8));
+                continue;
+            }
+            staged.begin_composite(tag);
+            open_ends.push_back(i + load_le32(extents + (size_t)i * 4));
+        }
+        while (!open_ends.empty())
+        {
+            staged.end_composite();
+            open_ends.pop_back();
+        }
+    }
+    catch (invalid_argument const &)
+    {
+        throw runtime_error("malformed cipher value");
+    }
+
+    // the digests and keys are recomputed by the rebuild, so a buffer
+    // whose stored hashes disagree with its leaves is rejected.
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        if (staged.value_hash(i) != load_le64(value_hashes + (size_t)i * 8) ||
+            staged.key_hash(i) != load_le64(key_hashes + (size_t)i * 8))
+            throw runtime_error("malformed cipher value");
+    }
+
+    auto const root = arena.append(staged, 0);
+    return {cipher_value{&arena, root},
+        CIPHER_VALUE_HEADER_BYTES + (size_t)n * CIPHER_VALUE_NODE_BYTES};
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "task_scheduler.hpp"
+using std::size_t;
+using std::string;
+using std::vector;
+
+/**
+ * Monte-Carlo validation of advertised error rates.
+ *
+ * Every predicate on an approximate set returns, along with its realized
+ * value, the error rates it claims: a false positive rate
+ *     fpr = P[realized = true | truth = false]
+ * and a false negative rate
+ *     fnr = P[realized = false | truth = true].
+ * The validator estimates both by running many randomized probes, where a
+ * probe draws a random instance of the question (e.g., a set and a value
+ * that is or is not a member of it), knows the true answer by construction,
+ * and records the realized answer of the predicate under test.
+ *
+ * If n probes have truth = false and e of them are realized as true, the
+ * point estimate of the fpr is e/n, and its confidence interval is the
+ * Wilson score interval
+ *     (p + z^2/2n -+ z sqrt(p(1-p)/n + z^2/4n^2)) / (1 + z^2/n),
+ * where p = e/n and z is the standard normal quantile of the confidence
+ * level. Unlike the normal approximation, it stays inside [0,1] and is
+ * informative when e = 0, in which case the upper bound is about z^2/n. The
+ * fnr is estimated the same way over the probes with truth = true.
+ *
+ * An advertised rate is *consistent* if it lies in its confidence interval
+ * and is a probability. An advertised rate that is smaller than the upper
+ * bound of an interval with e = 0 (e.g., fpr = 2^-64) cannot be
+ * distinguished from 0 by any feasible number of probes and is consistent.
+ *
+ * Probes run in chunks of a fixed size, in parallel on the library's
+ * scheduler (task_scheduler.hpp). Each chunk has its own random number
+ * generator, seeded from the seed and the chunk's index, and makes its own
+ * probe function with it (so it may build its own instance and hold
+ * scratch state). Counts are accumulated per chunk and summed in chunk
+ * order, so the chunks share nothing in the probe loop, and the estimates
+ * depend only on the seed, the number of probes and the chunk size, not on
+ * the number of workers or how the chunks were scheduled.
+ */
+
+/**
+ * SplitMix64, a small and fast generator that is good enough for drawing
+ * probes.
+ */
+struct probe_rng
+{
+    using result_type = std::uint64_t;
+
+    std::uint64_t state;
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type(0); }
+
+    result_type operator()()
+    {
+        auto z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+};
+
+/**
+ * The generator of chunk c of the probes drawn from seed.
+ */
+inline probe_rng chunk_rng(std::uint64_t seed, size_t c)
+{
+    probe_rng g{seed};
+    return probe_rng{g() ^ probe_rng{c * 0xd1b54a32d192ed03ull}()};
+}
+
+/**
+ * The outcome of a probe: the true answer and the realized answer.
+ */
+struct probe_outcome
+{
+    bool truth;
+    bool realized;
+};
+
+struct error_rates
+{
+    double fpr;
+    double fnr;
+};
+
+struct rate_estimate
+{
+    size_t trials;
+    size_t errors;
+    double rate;
+    double lower;
+    double upper;
+};
+
+/**
+ * The Wilson score interval of errors out of trials at the standard normal
+ * quantile z. With no trials, the interval is [0,1].
+ */
+inline rate_estimate wilson_interval(size_t errors, size_t trials, double z)
+{
+    if (trials == 0)
+        return rate_estimate{0, 0, 0., 0., 1.};
+
+    auto const n = (double)trials;
+    auto const p = (double)errors / n;
+    auto const z2 = z * z;
+    auto const center = (p + z2 / (2 * n)) / (1 + z2 / n);
+    auto const half = z * std::sqrt(p * (1 - p) / n + z2 / (4 * n * n)) /
+        (1 + z2 / n);
+    return rate_estimate{trials, errors, p,
+        std::max(0., center - half), std::min(1., center + half)};
+}
+
+/**
+ * The standard normal quantile z such that P[|Z| <= z] = confidence, by
+ * bisection on erfc.
+ */
+inline double normal_quantile(double confidence)
+{
+    double lo = 0, hi = 40;
+    for (int i = 0; i < 200; ++i)
+    {
+        auto const mid = (lo + hi) / 2;
+        if (std::erfc(mid / std::sqrt(2.)) > 1 - confidence)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return (lo + hi) / 2;
+}
+
+/**
+ * Whether an advertised rate is a probability in the confidence interval of
+ * its estimate.
+ */
+inline bool consistent(double advertised, rate_estimate const & e)
+{
+    return advertised >= 0 && advertised <= 1 &&
+        advertised >= e.lower && advertised <= e.upper;
+}
+
+struct validator_options
+{
+    size_t probes = size_t(1) << 26;
+    double confidence = .999;
+    std::uint64_t seed = 1;
+    size_t chunk = size_t(1) << 20;     // probes per generator and probe function
+};
+
+struct validation_result
+{
+    string name;
+    error_rates advertised;
+    rate_estimate fpr;
+    rate_estimate fnr;
+    double seconds;
+
+    bool fpr_ok() const { return consistent(advertised.fpr, fpr); }
+    bool fnr_ok() const { return consistent(advertised.fnr, fnr); }
+    bool ok() const { return fpr_ok() && fnr_ok(); }
+};
+
+/**
+ * Estimates the error rates of a predicate and compares them against the
+ * advertised rates.
+ *
+ * make_probe is called once per chunk with the chunk's generator and
+ * returns a probe function, which is called with the same generator and
+ * returns a probe_outcome. An exception thrown by either is rethrown in
+ * the calling thread.
+ */
+template <typename F>
+validation_result validate_error_rates(
+    string name,
+    error_rates advertised,
+    F make_probe,
+    validator_options const & opts = validator_options{})
+{
+    struct counts
+    {
+        size_t negatives = 0;
+        size_t false_positives = 0;
+        size_t positives = 0;
+        size_t false_negatives = 0;
+    };
+
+    auto const chunk = std::max<size_t>(1, opts.chunk);
+    auto const chunks = (opts.probes + chunk - 1) / chunk;
+    vector<counts> partial(chunks);
+
+    auto const start = std::chrono::steady_clock::now();
+    parallel_for(0, chunks, 1, [&](size_t lo, size_t hi)
+    {
+        for (auto k = lo; k < hi; ++k)
+        {
+            auto g = chunk_rng(opts.seed, k);
+            auto probe = make_probe(g);
+            auto const end = std::min(opts.probes, (k + 1) * chunk);
+            counts c;
+            for (auto i = k * chunk; i < end; ++i)
+            {
+                probe_outcome const o = probe(g);
+                if (o.truth)
+                {
+                    ++c.positives;
+                    c.false_negatives += !o.realized;
+                }
+                else
+                {
+                    ++c.negatives;
+                    c.false_positives += o.realized;
+                }
+            }
+            partial[k] = c;
+        }
+    });
+    auto const seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    counts total;
+    for (auto const & c : partial)
+    {
+        total.negatives += c.negatives;
+        total.false_positives += c.false_positives;
+        total.positives += c.positives;
+        total.false_negatives += c.false_negatives;
+    }
+
+    auto const z = normal_quantile(opts.confidence);
+    return validation_result{
+        std::move(name),
+        advertised,
+        wilson_interval(total.false_positives, total.negatives, z),
+        wilson_interval(total.false_negatives, total.positives, z),
+        seconds};
+}
+
+/**
+ * A named validation, for collecting the cases of a harness.
+ */
+struct error_rate_case
+{
+    string name;
+    std::function<validation_result(validator_options const &)> run;
+};
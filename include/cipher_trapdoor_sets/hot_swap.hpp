@@ -0,0 +1,304 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "trapdoor.hpp"
+using std::size_t;
+using std::uint64_t;
+using std::unique_ptr;
+using std::vector;
+
+/**
+ * Hot swap of live sets with epoch-based reclamation.
+ *
+ * A service that replaces a set (e.g., a rebuilt singular hash set or k-DHS)
+ * while queries run must not free the old set under a reader, and a lock
+ * around every query serializes the readers on its cache line and stalls
+ * them behind the writer. A hot_swap<T> holds the current version behind an
+ * atomic pointer:
+ *
+ *     hot_swap<disjoint_hash_set<string>> live(std::move(initial));
+ *
+ *     // readers, on any thread
+ *     auto hit = contains(x, live);                 // or live.read(f)
+ *
+ *     // a writer, when a rebuild is ready
+ *     live.publish(std::move(rebuilt));
+ *
+ * Readers take no lock and never wait: a read announces the global epoch in
+ * the calling thread's own record (a cache line no other thread writes),
+ * loads the pointer, runs the query and clears the record. publish swaps
+ * the pointer, advances the epoch and retires the old version, which is
+ * freed once every record is either idle or announces an epoch at least
+ * that of its retirement, i.e., once every reader that could have loaded
+ * the old pointer has left:
+ *
+ *     publish:  old := current.exchange(next)
+ *               retire (old, ++epoch)
+ *     free:     (p, e) once min { announced epochs } >= e
+ *
+ * Retired versions are freed by the writers (on publish, reclaim() or
+ * synchronize()), never by readers, so a reload does not add latency to
+ * queries. A read can nest (e.g., a query over two hot-swapped sets); the
+ * outermost one announces the epoch.
+ *
+ * All hot_swap objects share one epoch domain, which lives for the whole
+ * process, so a thread's record is claimed on its first read and returned
+ * when the thread exits. A hot_swap must outlive its readers.
+ */
+
+/**
+ * The epoch domain of the hot-swapped sets.
+ */
+class epoch_domain
+{
+public:
+    struct alignas(64) record
+    {
+        std::atomic<uint64_t> epoch{0};         // 0 when idle
+        std::atomic<bool> claimed{false};
+    };
+
+    /**
+     * The calling thread's record, claimed on first use.
+     */
+    record & local()
+    {
+        struct holder
+        {
+            record * r = nullptr;
+
+            ~holder()
+            {
+                if (r)
+                {
+                    r->epoch.store(0, std::memory_order_release);
+                    r->claimed.store(false, std::memory_order_release);
+                }
+            }
+        };
+
+        thread_local holder h;
+        if (!h.r)
+            h.r = claim();
+        return *h.r;
+    }
+
+    uint64_t enter()
+    {
+        auto & r = local();
+        auto const e = epoch.load(std::memory_order_seq_cst);
+        r.epoch.store(e, std::memory_order_seq_cst);
+        return e;
+    }
+
+    void leave()
+    {
+        local().epoch.store(0, std::memory_order_release);
+    }
+
+    /**
+     * Advances the epoch and retires p, to be deleted with del(p) once no
+     * reader can hold it.
+     */
+    void retire(void * p, void (*del)(void *))
+    {
+        auto const e = epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+        {
+            std::lock_guard<std::mutex> g(lock);
+            retired.push_back(retired_pointer{p, del, e});
+        }
+        reclaim();
+    }
+
+    /**
+     * Frees the retired pointers that no reader can hold and returns the
+     * number still retired.
+     */
+    size_t reclaim()
+    {
+        vector<retired_pointer> ready;
+        size_t pending;
+        {
+            std::lock_guard<std::mutex> g(lock);
+            auto const safe = min_announced();
+            size_t kept = 0;
+            for (auto & r : retired)
+            {
+                if (r.epoch <= safe)
+                    ready.push_back(r);
+                else
+                    retired[kept++] = r;
+            }
+            retired.resize(kept);
+            pending = kept;
+        }
+        for (auto & r : ready)
+            r.del(r.p);
+        return pending;
+    }
+
+    /**
+     * Waits until every retired pointer has been freed. Must not be called
+     * inside a read.
+     */
+    void synchronize()
+    {
+        while (reclaim() > 0)
+            std::this_thread::yield();
+    }
+
+private:
+    struct retired_pointer
+    {
+        void * p;
+        void (*del)(void *);
+        uint64_t epoch;
+    };
+
+    record * claim()
+    {
+        std::lock_guard<std::mutex> g(lock);
+        for (auto & r : records)
+        {
+            bool expected = false;
+            if (r->claimed.compare_exchange_strong(expected, true))
+                return r.get();
+        }
+        records.emplace_back(new record);
+        records.back()->claimed.store(true);
+        return records.back().get();
+    }
+
+    /**
+     * The least announced epoch, or the current epoch if no reader is
+     * active. Called with lock held, which keeps records stable.
+     */
+    uint64_t min_announced()
+    {
+        auto m = epoch.load(std::memory_order_seq_cst);
+        for (auto & r : records)
+        {
+            auto const e = r->epoch.load(std::memory_order_seq_cst);
+            if (e != 0 && e < m)
+                m = e;
+        }
+        return m;
+    }
+
+    alignas(64) std::atomic<uint64_t> epoch{1};
+    std::mutex lock;
+    vector<unique_ptr<record>> records;
+    vector<retired_pointer> retired;
+};
+
+/**
+ * The process's epoch domain; never destroyed, so thread records can be
+ * returned at any thread exit.
+ */
+inline epoch_domain & global_epoch_domain()
+{
+    static auto * d = new epoch_domain;
+    return *d;
+}
+
+/**
+ * Announces the epoch for the lifetime of the guard; nested guards on a
+ * thread are free.
+ */
+class epoch_guard
+{
+public:
+    epoch_guard()
+    {
+        if (depth()++ == 0)
+            global_epoch_domain().enter();
+    }
+
+    epoch_guard(epoch_guard const &) = delete;
+    epoch_guard & operator=(epoch_guard const &) = delete;
+
+    ~epoch_guard()
+    {
+        if (--depth() == 0)
+            global_epoch_domain().leave();
+    }
+
+private:
+    static unsigned & depth()
+    {
+        thread_local unsigned d = 0;
+        return d;
+    }
+};
+
+template <typename T>
+class hot_swap
+{
+public:
+    explicit hot_swap(unique_ptr<T> initial) :
+        current(initial.release()) {}
+
+    explicit hot_swap(T initial) :
+        current(new T(std::move(initial))) {}
+
+    hot_swap(hot_swap const &) = delete;
+    hot_swap & operator=(hot_swap const &) = delete;
+
+    ~hot_swap()
+    {
+        delete current.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns f(T const &) on the current version.
+     */
+    template <typename F>
+    decltype(auto) read(F && f) const
+    {
+        epoch_guard g;
+        return std::forward<F>(f)(*current.load(std::memory_order_seq_cst));
+    }
+
+    /**
+     * Makes next the current version and retires the previous one.
+     */
+    void publish(unique_ptr<T> next)
+    {
+        auto const old = current.exchange(next.release(), std::memory_order_seq_cst);
+        versions.fetch_add(1, std::memory_order_relaxed);
+        if (old)
+            global_epoch_domain().retire(old, [](void * p) { delete (T *)p; });
+    }
+
+    void publish(T next)
+    {
+        publish(unique_ptr<T>(new T(std::move(next))));
+    }
+
+    /**
+     * The number of versions published since construction.
+     */
+    uint64_t version() const
+    {
+        return versions.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<T *> current;
+    std::atomic<uint64_t> versions{0};
+};
+
+template <typename X, typename T>
+auto contains(
+    trapdoor<X> const & x,
+    hot_swap<T> const & xs)
+{
+    return xs.read([&](T const & s) { return contains(x, s); });
+}
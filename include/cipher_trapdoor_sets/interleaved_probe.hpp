@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "singular_hash_set.hpp"
+#if !defined(__cpp_impl_coroutine)
+#error "interleaved_probe.hpp requires C++20 coroutines (-std=c++20)"
+#endif
+#include <coroutine>
+using std::size_t;
+using std::vector;
+
+/**
+ * Interleaved probing of large sets to hide memory latency.
+ *
+ * A lookup in a large structure, e.g., contains(x, xs) on a k-DHS whose seed
+ * and hash vectors do not fit in the cache, is a cache miss whose address
+ * depends on the probe, so a loop of lookups waits out one miss after
+ * another. Following asynchronous memory access chaining (AMAC; Kocberber et
+ * al., "Asynchronous memory access chaining") and its coroutine form
+ * (Psaropoulos et al., "Interleaving with coroutines"), a lookup is written
+ * as a coroutine that computes its address, prefetches it and suspends:
+ *
+ *     probe_task<bool> probe(...)
+ *     {
+ *         auto const b = dhs_bin(...);
+ *         co_await prefetched(&seeds[b], &hashes[b]);
+ *         co_return ...;  // the lines are (likely) resident
+ *     }
+ *
+ * and interleave_probes keeps width probes in flight on the calling thread,
+ * resuming them round-robin. While one probe's miss is outstanding, the
+ * others compute their addresses and issue theirs, so up to width misses
+ * overlap. When a probe completes, its slot starts the next one.
+ *
+ * contains_probe(x, xs) is the probe of a membership test. What it
+ * prefetches is a per-structure hook: probe_prefetch(x, xs), found by
+ * argument-dependent lookup, prefetches the lines that contains(x, xs)
+ * loads first and returns the awaitable, e.g., for a k-DHS the bin's seed
+ * and hash:
+ *
+ *     template <typename X, template <typename> typename H, typename A>
+ *     std::suspend_always probe_prefetch(trapdoor<X> const & x,
+ *         disjoint_hash_set<X,H,A> const & xs)
+ *     {
+ *         auto const b = dhs_bin(x.value_hash, xs.seeds.size());
+ *         return prefetched(xs.seeds.data() + b, xs.hashes.data() + b);
+ *     }
+ *
+ * A set without the hook is probed through its own bytes, which only helps
+ * if its data lives inside the object (e.g., a singular hash set, or a
+ * trapdoor_boolean_algebra in a large column of sets); such a set must be
+ * trivially copyable, and a set that points to its data (a vector, a
+ * mapping, a hot_swap) does not compile without a hook. contains_batch
+ * probes a range of trapdoors against one set. The result of each probe is
+ * exactly that of contains(x, xs), including its exceptions, which
+ * propagate out of interleave_probes.
+ *
+ * The width should cover the miss latency with the work of the other
+ * probes, bounded by the number of outstanding misses a core supports (10
+ * to 20 line fill buffers on current x86 cores); 8 to 32 is typical, and
+ * DEFAULT_PROBE_WIDTH is a reasonable start. For a set that fits in the
+ * cache, interleaving only adds the overhead of the coroutines, and the
+ * plain loop is faster.
+ *
+ * Coroutine frames come from a per-thread free list, so a probe does not
+ * touch the heap once the first width frames exist.
+ *
+ * Requires C++20.
+ */
+
+constexpr size_t DEFAULT_PROBE_WIDTH = 16;
+
+namespace detail
+{
+    constexpr size_t PROBE_FRAME_BYTES = 256;
+    constexpr size_t CACHE_LINE_BYTES = 64;
+
+    /**
+     * The free list of the coroutine frames of a thread's probes, linked
+     * through the frames. The head is trivially destructible, so taking a
+     * frame needs no thread_local guard; the reaper, touched only when a
+     * new frame is made, frees the list when the thread exits. Frames larger
+     * than PROBE_FRAME_BYTES bypass the list.
+     */
+    inline thread_local void * probe_frame_head = nullptr;
+
+    struct probe_frame_reaper
+    {
+        ~probe_frame_reaper()
+        {
+            while (auto p = probe_frame_head)
+            {
+                probe_frame_head = *(void **)p;
+                ::operator delete(p);
+            }
+        }
+    };
+
+    inline void * allocate_probe_frame(size_t bytes)
+    {
+        if (bytes > PROBE_FRAME_BYTES)
+            return ::operator new(bytes);
+        if (auto p = probe_frame_head)
+        {
+            probe_frame_head = *(void **)p;
+            return p;
+        }
+        thread_local probe_frame_reaper reaper;
+        (void)reaper;
+        return ::operator new(PROBE_FRAME_BYTES);
+    }
+
+    inline void deallocate_probe_frame(void * p, size_t bytes)
+    {
+        if (bytes > PROBE_FRAME_BYTES)
+            return ::operator delete(p);
+        *(void **)p = probe_frame_head;
+        probe_frame_head = p;
+    }
+}
+
+/**
+ * A lazily started probe returning a T. resume() runs it to its next
+ * prefetch; once done(), get() returns the result or rethrows.
+ */
+template <typename T>
+class probe_task
+{
+public:
+    struct promise_type
+    {
+        std::optional<T> value;
+        std::exception_ptr error;
+
+        probe_task get_return_object()
+        {
+            return probe_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(T v) { value.emplace(std::move(v)); }
+        void unhandled_exception() { error = std::current_exception(); }
+
+        static void * operator new(size_t bytes)
+        {
+            return detail::allocate_probe_frame(bytes);
+        }
+
+        static void operator delete(void * p, size_t bytes)
+        {
+            detail::deallocate_probe_frame(p, bytes);
+        }
+    };
+
+    probe_task() = default;
+
+    probe_task(probe_task && other) noexcept :
+        h(std::exchange(other.h, nullptr)) {}
+
+    probe_task & operator=(probe_task && other) noexcept
+    {
+        if (this != &other)
+        {
+            if (h)
+                h.destroy();
+            h = std::exchange(other.h, nullptr);
+        }
+        return *this;
+    }
+
+    ~probe_task()
+    {
+        if (h)
+            h.destroy();
+    }
+
+    explicit operator bool() const { return (bool)h; }
+    bool done() const { return h.done(); }
+    void resume() { h.resume(); }
+
+    T get()
+    {
+        auto & p = h.promise();
+        if (p.error)
+            std::rethrow_exception(p.error);
+        return std::move(*p.value);
+    }
+
+    /**
+     * Runs the probe to completion without interleaving.
+     */
+    T run()
+    {
+        while (!h.done())
+            h.resume();
+        return get();
+    }
+
+private:
+    explicit probe_task(std::coroutine_handle<promise_type> h) : h(h) {}
+
+    std::coroutine_handle<promise_type> h;
+};
+
+/**
+ * Prefetches the lines of the given addresses; co_await the result to
+ * suspend until the probe is resumed.
+ */
+template <typename... P>
+std::suspend_always prefetched(P const *... p)
+{
+    (__builtin_prefetch(p), ...);
+    return {};
+}
+
+/**
+ * Prefetches every line of [p, p + bytes).
+ */
+inline std::suspend_always prefetched_bytes(void const * p, size_t bytes)
+{
+    auto const first = (std::uintptr_t)p & ~(std::uintptr_t)(detail::CACHE_LINE_BYTES - 1);
+    auto const last = (std::uintptr_t)p + std::max<size_t>(1, bytes);
+    for (auto a = first; a < last; a += detail::CACHE_LINE_BYTES)
+        __builtin_prefetch((void const *)a);
+    return {};
+}
+
+/**
+ * Runs the probes make_probe(0),...,make_probe(n-1) with up to width of
+ * them in flight, and calls sink(i, result) as probe i completes (in
+ * completion order, not index order).
+ */
+template <typename M, typename S>
+void interleave_probes(size_t n, M make_probe, S sink, size_t width = DEFAULT_PROBE_WIDTH)
+{
+    using task = decltype(make_probe(size_t(0)));
+    if (n == 0)
+        return;
+
+    width = std::max<size_t>(1, std::min(width, n));
+    vector<task> slots(width);
+    vector<size_t> index(width);
+
+    size_t next = 0;
+    size_t active = 0;
+    for (; next < width; ++next, ++active)
+    {
+        slots[next] = make_probe(next);
+        index[next] = next;
+        slots[next].resume();
+    }
+
+    while (active > 0)
+    {
+        for (size_t s = 0; s < width; ++s)
+        {
+            auto & t = slots[s];
+            if (!t)
+                continue;
+            if (!t.done())
+                t.resume();
+            if (!t.done())
+                continue;
+
+            sink(index[s], t.get());
+            if (next < n)
+            {
+                t = make_probe(next);
+                index[s] = next++;
+                t.resume();
+            }
+            else
+            {
+                t = task();
+                --active;
+            }
+        }
+    }
+}
+
+/**
+ * The probe hook of a k-DHS: the bin's seed and hash.
+ */
+template <typename X, template <typename> typename H, typename A>
+std::suspend_always probe_prefetch(trapdoor<X> const & x, disjoint_hash_set<X,H,A> const & xs)
+{
+    if (xs.seeds.empty())
+        return {};
+    auto const b = dhs_bin(x.value_hash, xs.seeds.size());
+    return prefetched(xs.seeds.data() + b, xs.hashes.data() + b);
+}
+
+namespace detail
+{
+    template <typename T, typename S, typename = void>
+    struct has_probe_prefetch : std::false_type {};
+
+    template <typename T, typename S>
+    struct has_probe_prefetch<T, S, std::void_t<decltype(
+        probe_prefetch(std::declval<T const &>(), std::declval<S const &>()))>> :
+        std::true_type {};
+}
+
+/**
+ * The probe of contains(x, xs): the lines given by the set's
+ * probe_prefetch hook, or else the set's own bytes, are prefetched before
+ * the test.
+ */
+template <typename T, typename S>
+auto contains_probe(T const & x, S const & xs) -> probe_task<decltype(contains(x, xs))>
+{
+    if constexpr (detail::has_probe_prefetch<T,S>::value)
+        co_await probe_prefetch(x, xs);
+    else
+    {
+        static_assert(std::is_trivially_copyable_v<S>,
+            "contains_probe: a set whose data is not inside the object needs a probe_prefetch hook");
+        co_await prefetched_bytes(&xs, sizeof(xs));
+    }
+    co_return contains(x, xs);
+}
+
+/**
+ * Writes contains(first[i], xs) to out[i] for each trapdoor of
+ * [first,last), with up to width probes in flight. Returns the end of the
+ * output.
+ */
+template <typename I, typename S, typename O>
+O contains_batch(I first, I last, S const & xs, O out, size_t width = DEFAULT_PROBE_WIDTH)
+{
+    auto const n = (size_t)std::distance(first, last);
+    interleave_probes(n,
+        [&](size_t i) { return contains_probe(first[i], xs); },
+        [&](size_t i, auto && result) { out[i] = std::forward<decltype(result)>(result); },
+        width);
+    return out + n;
+}
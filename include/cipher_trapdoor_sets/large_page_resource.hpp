@@ -0,0 +1,401 @@
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+using std::size_t;
+using std::string;
+using std::vector;
+
+/**
+ * Huge-page and NUMA-aware placement of large structures.
+ *
+ * A large column of trapdoors, or the seed and hash vectors of a large
+ * k-DHS, is probed at random. With 4 KiB pages, nearly every probe of a
+ * multi-gigabyte structure misses the TLB, and on a multi-socket machine
+ * the pages may sit on the other socket. large_page_resource is a
+ * std::pmr::memory_resource (so it plugs into the allocators of
+ * singular_hash_set.hpp and request_arena.hpp) that maps each allocation
+ * directly with mmap under a placement policy:
+ *
+ *     page_policy
+ *         PAGES_DEFAULT       base pages
+ *         PAGES_TRANSPARENT   base pages with madvise(MADV_HUGEPAGE), so the
+ *                             kernel backs them with 2 MiB transparent huge
+ *                             pages when it can (the default)
+ *         PAGES_HUGE_2MB      explicit 2 MiB pages (MAP_HUGETLB)
+ *         PAGES_HUGE_1GB      explicit 1 GiB pages (MAP_HUGETLB)
+ *
+ *     numa_policy
+ *         NUMA_DEFAULT        the thread's policy (first touch)
+ *         NUMA_INTERLEAVE     pages are interleaved over the nodes in the
+ *                             mask, for structures probed from every node
+ *         NUMA_BIND           pages are bound to the nodes in the mask
+ *         NUMA_LOCAL          pages are placed on the node of the thread
+ *                             that first touches them, regardless of the
+ *                             thread's policy, for per-thread partial
+ *                             structures
+ *
+ * Explicit huge pages must be reserved by the administrator (vm.nr_hugepages
+ * or hugetlbfs); if a MAP_HUGETLB mapping fails, the resource falls back to
+ * PAGES_TRANSPARENT and counts the fallback. A NUMA policy that the kernel
+ * rejects (e.g., in a container without the permission, or a node that is
+ * not online) is ignored and counted the same way, so a policy is a
+ * performance hint and never a correctness requirement.
+ *
+ * Allocations smaller than min_bytes are forwarded to the upstream
+ * resource, since a whole mapping per small allocation wastes memory and
+ * system calls.
+ *
+ * To schedule work onto the data, node_of(p) returns the node that holds
+ * the page of p, and a node_affinity_scope pins the calling thread to the
+ * CPUs of a node for its lifetime, so a build or probe loop over a
+ * partition can run on the partition's node. run_on_nodes runs one task per
+ * node, each pinned to its node, e.g., to build per-node partial structures
+ * in thread_local_node_resource().
+ *
+ * Linux only. The system calls are made directly, so no libnuma is needed.
+ */
+
+enum page_policy
+{
+    PAGES_DEFAULT,
+    PAGES_TRANSPARENT,
+    PAGES_HUGE_2MB,
+    PAGES_HUGE_1GB
+};
+
+enum numa_policy
+{
+    NUMA_DEFAULT,
+    NUMA_INTERLEAVE,
+    NUMA_BIND,
+    NUMA_LOCAL
+};
+
+namespace detail
+{
+    // the modes and flags of mbind and get_mempolicy (linux/mempolicy.h).
+    constexpr int MEMPOLICY_BIND = 2;
+    constexpr int MEMPOLICY_INTERLEAVE = 3;
+    constexpr int MEMPOLICY_LOCAL = 4;
+    constexpr unsigned long MEMPOLICY_F_NODE = 1;
+    constexpr unsigned long MEMPOLICY_F_ADDR = 2;
+    constexpr int MAP_HUGE_SHIFT_BITS = 26;
+
+    constexpr size_t NODE_MASK_WORDS = 16;
+
+    /**
+     * Parses a Linux cpu or node list, e.g., "0-3,8,10-11".
+     */
+    inline vector<unsigned> parse_id_list(string const & s)
+    {
+        vector<unsigned> ids;
+        char const * p = s.c_str();
+        while (*p)
+        {
+            char * end;
+            auto const lo = std::strtoul(p, &end, 10);
+            if (end == p)
+                break;
+            auto hi = lo;
+            p = end;
+            if (*p == '-')
+            {
+                hi = std::strtoul(p + 1, &end, 10);
+                p = end;
+            }
+            for (auto id = lo; id <= hi; ++id)
+                ids.push_back((unsigned)id);
+            if (*p != ',')
+                break;
+            ++p;
+        }
+        return ids;
+    }
+
+    inline string read_sysfs(string const & path)
+    {
+        std::ifstream in(path);
+        string s;
+        std::getline(in, s);
+        return s;
+    }
+}
+
+/**
+ * The online NUMA nodes; a machine without NUMA support has node 0 only.
+ */
+inline vector<unsigned> numa_nodes()
+{
+    auto nodes = detail::parse_id_list(
+        detail::read_sysfs("/sys/devices/system/node/online"));
+    if (nodes.empty())
+        nodes.push_back(0);
+    return nodes;
+}
+
+/**
+ * The CPUs of a node.
+ */
+inline vector<unsigned> numa_node_cpus(unsigned node)
+{
+    return detail::parse_id_list(detail::read_sysfs(
+        "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+}
+
+/**
+ * The node of the CPU the calling thread runs on.
+ */
+inline unsigned current_numa_node()
+{
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+        return 0;
+    return node;
+}
+
+/**
+ * The node that holds the page of p, or -1 if the page is not yet
+ * populated or the kernel does not report it.
+ */
+inline int node_of(void const * p)
+{
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, p,
+        detail::MEMPOLICY_F_NODE | detail::MEMPOLICY_F_ADDR) != 0)
+        return -1;
+    return node;
+}
+
+/**
+ * Pins the calling thread to the CPUs of a node and restores its previous
+ * affinity on destruction. If the node has no CPUs or the affinity cannot
+ * be set, the thread is left where it is.
+ */
+class node_affinity_scope
+{
+public:
+    explicit node_affinity_scope(unsigned node)
+    {
+        CPU_ZERO(&previous);
+        if (sched_getaffinity(0, sizeof(previous), &previous) != 0)
+            return;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : numa_node_cpus(node))
+            if (cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        pinned = CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+
+    node_affinity_scope(node_affinity_scope const &) = delete;
+    node_affinity_scope & operator=(node_affinity_scope const &) = delete;
+
+    ~node_affinity_scope()
+    {
+        if (pinned)
+            sched_setaffinity(0, sizeof(previous), &previous);
+    }
+
+    bool active() const { return pinned; }
+
+private:
+    cpu_set_t previous;
+    bool pinned = false;
+};
+
+struct large_page_stats
+{
+    size_t mappings = 0;
+    size_t mapped_bytes = 0;
+    size_t page_fallbacks = 0;
+    size_t numa_fallbacks = 0;
+};
+
+/**
+ * A memory resource that maps allocations of at least min_bytes with the
+ * given page and NUMA policies. nodes is the node mask of NUMA_INTERLEAVE
+ * and NUMA_BIND; if empty, every online node.
+ *
+ * The statistics are not synchronized, so a resource is used by one thread
+ * at a time, like the other resources of a request.
+ */
+class large_page_resource : public std::pmr::memory_resource
+{
+public:
+    explicit large_page_resource(
+        page_policy pages = PAGES_TRANSPARENT,
+        numa_policy numa = NUMA_DEFAULT,
+        vector<unsigned> nodes = {},
+        size_t min_bytes = size_t(1) << 20,
+        std::pmr::memory_resource * upstream = std::pmr::get_default_resource()) :
+        pages(pages),
+        numa(numa),
+        nodes(nodes.empty() ? numa_nodes() : std::move(nodes)),
+        min_bytes(min_bytes),
+        upstream(upstream) {}
+
+    large_page_stats const & stats() const { return counts; }
+
+    /**
+     * The size of the pages of a mapping under the policy.
+     */
+    size_t page_size() const
+    {
+        switch (pages)
+        {
+        case PAGES_HUGE_1GB: return size_t(1) << 30;
+        case PAGES_HUGE_2MB:
+        case PAGES_TRANSPARENT: return size_t(1) << 21;
+        default: return (size_t)sysconf(_SC_PAGESIZE);
+        }
+    }
+
+private:
+    size_t mapping_bytes(size_t bytes) const
+    {
+        auto const page = page_size();
+        return (bytes + page - 1) / page * page;
+    }
+
+    void * do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (bytes < min_bytes)
+            return upstream->allocate(bytes, alignment);
+
+        auto const length = mapping_bytes(bytes);
+        auto flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        if (pages == PAGES_HUGE_2MB)
+            flags |= MAP_HUGETLB | (21 << detail::MAP_HUGE_SHIFT_BITS);
+        else if (pages == PAGES_HUGE_1GB)
+            flags |= MAP_HUGETLB | (30 << detail::MAP_HUGE_SHIFT_BITS);
+
+        auto p = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p == MAP_FAILED && (flags & MAP_HUGETLB))
+        {
+            ++counts.page_fallbacks;
+            p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED)
+                madvise(p, length, MADV_HUGEPAGE);
+        }
+        else if (p != MAP_FAILED && pages == PAGES_TRANSPARENT)
+            madvise(p, length, MADV_HUGEPAGE);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+
+        if (numa != NUMA_DEFAULT && !bind(p, length))
+            ++counts.numa_fallbacks;
+
+        ++counts.mappings;
+        counts.mapped_bytes += length;
+        return p;
+    }
+
+    void do_deallocate(void * p, size_t bytes, size_t alignment) override
+    {
+        if (bytes < min_bytes)
+            return upstream->deallocate(p, bytes, alignment);
+
+        auto const length = mapping_bytes(bytes);
+        munmap(p, length);
+        --counts.mappings;
+        counts.mapped_bytes -= length;
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const & other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    bool bind(void * p, size_t length) const
+    {
+        unsigned long mask[detail::NODE_MASK_WORDS] = {};
+        auto const bits = CHAR_BIT * sizeof(unsigned long);
+        int mode = detail::MEMPOLICY_LOCAL;
+        if (numa != NUMA_LOCAL)
+        {
+            mode = numa == NUMA_INTERLEAVE ? detail::MEMPOLICY_INTERLEAVE :
+                detail::MEMPOLICY_BIND;
+            for (auto n : nodes)
+                if (n < detail::NODE_MASK_WORDS * bits)
+                    mask[n / bits] |= 1ul << (n % bits);
+        }
+        return syscall(SYS_mbind, p, length, mode,
+            numa == NUMA_LOCAL ? nullptr : mask,
+            numa == NUMA_LOCAL ? 0 : detail::NODE_MASK_WORDS * bits + 1, 0) == 0;
+    }
+
+    page_policy pages;
+    numa_policy numa;
+    vector<unsigned> nodes;
+    size_t min_bytes;
+    std::pmr::memory_resource * upstream;
+    large_page_stats counts;
+};
+
+/**
+ * The calling thread's resource for per-thread partial structures: pages
+ * on the thread's own node, with transparent huge pages.
+ */
+inline large_page_resource & thread_local_node_resource()
+{
+    thread_local large_page_resource r(PAGES_TRANSPARENT, NUMA_LOCAL);
+    return r;
+}
+
+/**
+ * Runs f(node) for every online node, each on its own thread pinned to the
+ * node, and waits for all of them. An exception thrown on a node's thread
+ * (by f or by the pinning) is kept until every thread has finished, and
+ * then the first node's in node order is rethrown.
+ */
+template <typename F>
+void run_on_nodes(F f)
+{
+    auto const nodes = numa_nodes();
+    vector<std::exception_ptr> errors(nodes.size());
+    vector<std::thread> threads;
+    try
+    {
+        for (size_t i = 0; i < nodes.size(); ++i)
+            threads.emplace_back([&f, &errors, i, node = nodes[i]]
+            {
+                try
+                {
+                    node_affinity_scope pin(node);
+                    f(node);
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            });
+    }
+    catch (...)
+    {
+        for (auto & t : threads)
+            t.join();
+        throw;
+    }
+    for (auto & t : threads)
+        t.join();
+    for (auto const & e : errors)
+    {
+        if (e)
+            std::rethrow_exception(e);
+    }
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+#include "trapdoor.hpp"
+using std::size_t;
+using std::vector;
+
+/**
+ * Memory accounting of the trapdoor types and containers.
+ *
+ * Every type that holds trapdoors (or data derived from them) has a free
+ * function
+ *     memory_usage : T -> memory_footprint
+ * defined next to it, where
+ *
+ *     bytes         is the in-memory size, sizeof(T) plus the heap memory
+ *                   the value owns (by capacity, not by size),
+ *     heap_bytes    is the heap memory alone, and
+ *     encoded_bits  is the length of the value's encoding, e.g., the bit
+ *                   length of the seed and singular hashes of a hash set,
+ *                   or 0 if the type has no encoding distinct from its
+ *                   in-memory representation.
+ *
+ * For an approximate set of m elements with false positive rate eps, the
+ * information-theoretic lower bound is -log2 eps bits per element, and
+ *     bits_per_element(f, m)
+ * compares against it: it is encoded_bits/m if the type has an encoding and
+ * 8 bytes/m otherwise. space_efficiency(f, m, eps) is the ratio of the bound
+ * to bits_per_element, which is 1 for a set that meets the bound.
+ *
+ * Containers that allocate through an allocator may be given a
+ * counting_allocator, which records live and peak bytes and the number of
+ * allocations in an allocation_stats shared by every container that uses
+ * it. counting_memory_resource does the same for a std::pmr resource, e.g.,
+ * as the upstream of a request_arena (request_arena.hpp).
+ */
+
+struct memory_footprint
+{
+    size_t bytes;
+    size_t heap_bytes;
+    size_t encoded_bits;
+
+    memory_footprint & operator+=(memory_footprint const & rhs)
+    {
+        bytes += rhs.bytes;
+        heap_bytes += rhs.heap_bytes;
+        encoded_bits += rhs.encoded_bits;
+        return *this;
+    }
+};
+
+inline memory_footprint operator+(memory_footprint lhs, memory_footprint const & rhs)
+{
+    return lhs += rhs;
+}
+
+template <typename T, typename A>
+size_t heap_bytes(vector<T,A> const & xs)
+{
+    return xs.capacity() * sizeof(T);
+}
+
+/**
+ * A vector of trivially copyable elements, e.g., a column of trapdoors.
+ */
+template <typename T, typename A>
+memory_footprint memory_usage(vector<T,A> const & xs)
+{
+    return memory_footprint{sizeof(xs) + heap_bytes(xs), heap_bytes(xs), 0};
+}
+
+template <typename X>
+memory_footprint memory_usage(trapdoor<X> const &)
+{
+    return memory_footprint{sizeof(trapdoor<X>), 0, CHAR_BIT * sizeof(trapdoor<X>)};
+}
+
+inline double bits_per_element(memory_footprint const & f, size_t m)
+{
+    auto const bits = f.encoded_bits != 0 ? (double)f.encoded_bits :
+        (double)(CHAR_BIT * f.bytes);
+    return m == 0 ? 0. : bits / m;
+}
+
+/**
+ * The lower bound of bits per element of an approximate set with false
+ * positive rate eps.
+ */
+inline double bits_per_element_bound(double eps)
+{
+    return -std::log2(eps);
+}
+
+inline double space_efficiency(memory_footprint const & f, size_t m, double eps)
+{
+    auto const b = bits_per_element(f, m);
+    return b == 0 ? 0. : bits_per_element_bound(eps) / b;
+}
+
+struct allocation_stats
+{
+    std::atomic<size_t> live_bytes{0};
+    std::atomic<size_t> peak_bytes{0};
+    std::atomic<size_t> allocations{0};
+    std::atomic<size_t> deallocations{0};
+
+    void on_allocate(size_t bytes)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        auto const live = live_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        auto peak = peak_bytes.load(std::memory_order_relaxed);
+        while (live > peak && !peak_bytes.compare_exchange_weak(peak, live,
+            std::memory_order_relaxed))
+            ;
+    }
+
+    void on_deallocate(size_t bytes)
+    {
+        deallocations.fetch_add(1, std::memory_order_relaxed);
+        live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * A std::allocator that records its allocations in an allocation_stats.
+ * Copies (and rebinds) share the stats, and allocators compare equal if
+ * they share the stats.
+ */
+template <typename T>
+struct counting_allocator
+{
+    using value_type = T;
+
+    explicit counting_allocator(allocation_stats & stats) : stats(&stats) {}
+
+    template <typename U>
+    counting_allocator(counting_allocator<U> const & other) : stats(other.stats) {}
+
+    T * allocate(size_t n)
+    {
+        auto p = std::allocator<T>{}.allocate(n);
+        stats->on_allocate(n * sizeof(T));
+        return p;
+    }
+
+    void deallocate(T * p, size_t n)
+    {
+        stats->on_deallocate(n * sizeof(T));
+        std::allocator<T>{}.deallocate(p, n);
+    }
+
+    allocation_stats * stats;
+};
+
+template <typename T, typename U>
+bool operator==(counting_allocator<T> const & a, counting_allocator<U> const & b)
+{
+    return a.stats == b.stats;
+}
+
+template <typename T, typename U>
+bool operator!=(counting_allocator<T> const & a, counting_allocator<U> const & b)
+{
+    return !(a == b);
+}
+
+/**
+ * A std::pmr::memory_resource that records the allocations it forwards to
+ * upstream in an allocation_stats.
+ */
+struct counting_memory_resource : std::pmr::memory_resource
+{
+    explicit counting_memory_resource(
+        allocation_stats & stats,
+        std::pmr::memory_resource * upstream = std::pmr::get_default_resource()) :
+        stats(&stats),
+        upstream(upstream) {}
+
+    allocation_stats * stats;
+    std::pmr::memory_resource * upstream;
+
+private:
+    void * do_allocate(size_t bytes, size_t alignment) override
+    {
+        auto p = upstream->allocate(bytes, alignment);
+        stats->on_allocate(bytes);
+        return p;
+    }
+
+    void do_deallocate(void * p, size_t bytes, size_t alignment) override
+    {
+        stats->on_deallocate(bytes);
+        upstream->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const & other) const noexcept override
+    {
+        return this == &other;
+    }
+};
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+#include "operation_metrics.hpp"
+#include "singular_hash_set.hpp"
+#include "task_scheduler.hpp"
+#include "trapdoor.hpp"
+#include "type_fingerprint.hpp"
+using std::invalid_argument;
+using std::size_t;
+using std::vector;
+
+/**
+ * Sets of sets of trapdoors, i.e., cipher_set<cipher_set<X>>.
+ *
+ * trapdoor.hpp describes a set whose elements are sets: each inner set is
+ * hashed to a value and the values are the elements of the outer set. The
+ * digest of an inner set A of trapdoor<X> values under the key hash k is
+ * its XOR-group digest (trapdoor_symmetric_difference_group.hpp) with the
+ * key and the type mixed in, as in hash(trapdoor_boolean_algebra<X,N>):
+ *
+ *     digest(A) := (xor of a.value_hash for a in A) ^ k ^ fingerprint(X)
+ *
+ * which does not depend on the order of A, and the inner set becomes the
+ * element trapdoor<nested_set<X>>{digest(A), k}. An outer set over these,
+ * e.g., a k-DHS, answers whether a set of X is one of its elements:
+ *
+ *     auto outer = make_nested_disjoint_hash_set(sets.begin(), sets.end(),
+ *         k, r, max_trials);
+ *     bool hit = contains(nested_trapdoor(q.begin(), q.end()), *outer);
+ *
+ * The builder takes the inner sets as ranges of trapdoors and digests them
+ * in parallel on the current executor (task_scheduler.hpp), writing each
+ * element straight into the outer set's input, so neither an inner set
+ * object nor an intermediate vector of digests is built.
+ *
+ * An inner set holds distinct trapdoors: the XOR-group digest of a multiset
+ * cancels pairs of equal elements. All trapdoors must share one key hash;
+ * an empty inner set takes the key of the others.
+ */
+
+/**
+ * The type of a set of X as an element of another set.
+ */
+template <typename X>
+struct nested_set
+{
+    using value_type = X;
+};
+
+namespace detail
+{
+    /**
+     * The XOR of the value hashes of an inner set and its key hash, if not
+     * empty.
+     */
+    struct inner_digest
+    {
+        size_t xor_hash = 0;
+        std::optional<size_t> key_hash;
+    };
+
+    template <typename R>
+    inner_digest digest_inner_set(R const & xs)
+    {
+        inner_digest d;
+        for (auto const & x : xs)
+        {
+            if (d.key_hash && *d.key_hash != x.key_hash)
+            {
+                CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+                throw invalid_argument("secret key mismatch");
+            }
+            d.key_hash = x.key_hash;
+            d.xor_hash ^= x.value_hash;
+        }
+        return d;
+    }
+
+    /**
+     * The key hashes of some inner sets: the one key of the non-empty
+     * sets, if any, and whether any set was empty.
+     */
+    struct nested_keys
+    {
+        std::optional<size_t> key_hash;
+        bool empty_sets = false;
+    };
+
+    inline nested_keys combine_nested_keys(nested_keys a, nested_keys const & b)
+    {
+        if (a.key_hash && b.key_hash && *a.key_hash != *b.key_hash)
+        {
+            CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+            throw invalid_argument("secret key mismatch");
+        }
+        if (!a.key_hash)
+            a.key_hash = b.key_hash;
+        a.empty_sets = a.empty_sets || b.empty_sets;
+        return a;
+    }
+}
+
+/**
+ * The element of the inner set [begin,end) of trapdoor<X> values under the
+ * key hash key_hash.
+ */
+template <typename I>
+auto nested_trapdoor(I begin, I end, size_t key_hash)
+{
+    using X = typename std::iterator_traits<I>::value_type::value_type;
+    size_t h = 0;
+    for (; begin != end; ++begin)
+    {
+        if (begin->key_hash != key_hash)
+        {
+            CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+            throw invalid_argument("secret key mismatch");
+        }
+        h ^= begin->value_hash;
+    }
+    return trapdoor<nested_set<X>>{h ^ key_hash ^ type_fingerprint<X>(), key_hash};
+}
+
+/**
+ * The element of the non-empty inner set [begin,end), under its own key.
+ */
+template <typename I>
+auto nested_trapdoor(I begin, I end)
+{
+    if (begin == end)
+        throw invalid_argument("nested trapdoor of the empty set needs a key hash");
+    return nested_trapdoor(begin, end, begin->key_hash);
+}
+
+/**
+ * Writes the elements of the inner sets [first,last) to out, in order, and
+ * returns its end. *first is a range of trapdoor<X> values; first and out
+ * are random access. The inner sets are digested in parallel with the given
+ * grain (0 picks one), each element written to out as its set is digested,
+ * and the keys are checked in the same pass by a reduction.
+ */
+template <typename I, typename O>
+O nested_trapdoors(I first, I last, O out, size_t grain = 0)
+{
+    using R = typename std::iterator_traits<I>::value_type;
+    using T = typename std::iterator_traits<decltype(std::begin(std::declval<R const &>()))>::value_type;
+    using X = typename T::value_type;
+    using E = trapdoor<nested_set<X>>;
+
+    constexpr auto fingerprint = type_fingerprint<X>();
+    auto const n = (size_t)(last - first);
+    auto const keys = parallel_reduce(0, n, grain, detail::nested_keys{},
+        [&](size_t lo, size_t hi)
+        {
+            detail::nested_keys ks;
+            for (auto i = lo; i < hi; ++i)
+            {
+                auto const d = detail::digest_inner_set(first[i]);
+                if (d.key_hash)
+                    out[i] = E{d.xor_hash ^ *d.key_hash ^ fingerprint, *d.key_hash};
+                ks = detail::combine_nested_keys(ks, detail::nested_keys{d.key_hash, !d.key_hash});
+            }
+            return ks;
+        },
+        detail::combine_nested_keys);
+    if (n > 0 && !keys.key_hash)
+        throw invalid_argument("nested set of empty sets needs a key hash");
+
+    // an empty inner set takes the key of the others, known only now.
+    if (keys.empty_sets)
+    {
+        auto const k = *keys.key_hash;
+        parallel_for(0, n, grain, [&](size_t lo, size_t hi)
+        {
+            for (auto i = lo; i < hi; ++i)
+                if (std::begin(first[i]) == std::end(first[i]))
+                    out[i] = E{k ^ fingerprint, k};
+        });
+    }
+    return out + n;
+}
+
+/**
+ * Builds the k-DHS whose elements are the inner sets [first,last); see
+ * make_disjoint_hash_set for k, r, max_trials and stats.
+ */
+template <
+    template <typename> typename H = std::hash,
+    typename I
+>
+auto make_nested_disjoint_hash_set(
+    I first,
+    I last,
+    size_t k,
+    unsigned r,
+    size_t max_trials,
+    vector<shs_construction_stats> * stats = nullptr)
+{
+    using R = typename std::iterator_traits<I>::value_type;
+    using T = typename std::iterator_traits<decltype(std::begin(std::declval<R const &>()))>::value_type;
+    using X = typename T::value_type;
+
+    vector<trapdoor<nested_set<X>>> elements((size_t)(last - first));
+    nested_trapdoors(first, last, elements.begin());
+    return make_disjoint_hash_set<H>(elements.begin(), elements.end(), k, r,
+        max_trials, stats);
+}
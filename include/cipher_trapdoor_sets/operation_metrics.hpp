@@ -0,0 +1,404 @@
+#pragma once
+
+/**
+ * Latency histograms and operation counters for production use.
+ *
+ * The hot paths are annotated with
+ *     CIPHER_TRAPDOOR_SETS_TIMED(METRIC_CONTAINS);
+ *     CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+ * which, when compiled with CIPHER_TRAPDOOR_SETS_METRICS, record the
+ * latency of the enclosing scope and increment a counter, and otherwise
+ * expand to nothing.
+ *
+ * Every thread records into its own table, so the hot path takes no locks
+ * and performs no atomic read-modify-write: each cell has a single writer,
+ * which updates it with a relaxed load and store, and readers merge the
+ * tables of all threads on demand. Tables outlive their threads, so the
+ * counts of finished threads are still reported. Counters are exact; call
+ * counts are exact up to one sampling period per thread.
+ *
+ * A latency histogram has HDR-style log-linear buckets. A latency of v
+ * nanoseconds with v < 2^b falls in bucket v, and otherwise in a bucket
+ * determined by floor(log2 v) and the b bits following the leading one, so
+ * that every bucket spans at most a 2^-b fraction of its lower bound. With
+ * b = 4, quantiles are within about 6% of the true value, over the whole
+ * range of 64-bit latencies, in 1024 buckets.
+ *
+ * Reading the clock costs more than a probe of a small set, so latency is
+ * sampled: one call in 2^metric_sample_shift (per thread and operation) is
+ * timed, and the quantiles are those of the sampled calls. An unsampled
+ * call loads, decrements and stores a thread-local countdown, and the
+ * timer adds two stack stores and a check on exit; the sampled path is out
+ * of line. Each call's countdown load waits on the previous call's store,
+ * so the cost is a fixed few nanoseconds per annotated call. Measured with
+ * interleaved_probe_bench (plain loop, k-DHS of 2^10 and 2^14 bins, -O2,
+ * best of 9 runs), a single contains takes 9.5 ns instrumented against
+ * 6.5 ns without, about 3 ns or 45% more; contains is not inlined into the
+ * loop in either build. So the 2% target holds only for calls of about
+ * 150 ns or more, e.g., batch calls, not for single probes of a small set.
+ *
+ * The pull API is snapshot_metrics(), and write_metrics() writes a
+ * snapshot as text, one "name value" line per metric. A metrics_dumper
+ * writes a snapshot periodically from a background thread.
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using std::size_t;
+using std::uint64_t;
+using std::vector;
+
+enum metric_operation
+{
+    METRIC_CONTAINS,
+    METRIC_SET_OP,
+    METRIC_MAKE_TRAPDOORS,
+    METRIC_OPERATIONS
+};
+
+enum metric_counter
+{
+    METRIC_KEY_MISMATCH,
+    METRIC_EMPTY_RESULT,
+    METRIC_COUNTERS
+};
+
+inline char const * metric_name(metric_operation op)
+{
+    static char const * const names[METRIC_OPERATIONS] = {
+        "contains", "set_op", "make_trapdoors"};
+    return names[op];
+}
+
+inline char const * metric_name(metric_counter c)
+{
+    static char const * const names[METRIC_COUNTERS] = {
+        "key_mismatch", "empty_result"};
+    return names[c];
+}
+
+constexpr unsigned LATENCY_SUB_BUCKET_BITS = 4;
+constexpr size_t LATENCY_SUB_BUCKETS = size_t(1) << LATENCY_SUB_BUCKET_BITS;
+constexpr size_t LATENCY_BUCKETS = 64 * LATENCY_SUB_BUCKETS;
+
+/**
+ * The bucket of a latency of v nanoseconds.
+ */
+inline size_t latency_bucket(uint64_t v)
+{
+    if (v < LATENCY_SUB_BUCKETS)
+        return (size_t)v;
+    auto const e = 63 - (unsigned)__builtin_clzll(v);
+    auto const m = (size_t)(v >> (e - LATENCY_SUB_BUCKET_BITS));
+    return (e - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+        m - LATENCY_SUB_BUCKETS;
+}
+
+/**
+ * The smallest latency in bucket i.
+ */
+inline uint64_t latency_bucket_lower(size_t i)
+{
+    if (i < LATENCY_SUB_BUCKETS)
+        return i;
+    auto const e = (unsigned)(i / LATENCY_SUB_BUCKETS) +
+        LATENCY_SUB_BUCKET_BITS - 1;
+    auto const m = (uint64_t)(i % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS);
+    return m << (e - LATENCY_SUB_BUCKET_BITS);
+}
+
+/**
+ * One call in 2^metric_sample_shift is timed (the shift is clamped to 31).
+ * The default is one in 64.
+ */
+inline std::atomic<unsigned> metric_sample_shift{6};
+
+struct latency_histogram
+{
+    uint64_t calls = 0;
+    uint64_t samples = 0;
+    uint64_t total_ns = 0;
+    std::array<uint64_t, LATENCY_BUCKETS> buckets{};
+
+    /**
+     * The q-quantile of the sampled latencies, as the lower bound of the
+     * bucket it falls in, or 0 if there are no samples.
+     */
+    uint64_t quantile(double q) const
+    {
+        if (samples == 0)
+            return 0;
+        auto const rank = (uint64_t)std::max(1., std::ceil(q * samples));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+        {
+            seen += buckets[i];
+            if (seen >= rank)
+                return latency_bucket_lower(i);
+        }
+        return latency_bucket_lower(LATENCY_BUCKETS - 1);
+    }
+
+    double mean() const
+    {
+        return samples == 0 ? 0. : (double)total_ns / samples;
+    }
+};
+
+struct metrics_snapshot
+{
+    std::array<latency_histogram, METRIC_OPERATIONS> operations{};
+    std::array<uint64_t, METRIC_COUNTERS> counters{};
+};
+
+/**
+ * The table of one thread. Only the owning thread writes to it.
+ */
+struct thread_metrics
+{
+    struct operation_cells
+    {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> samples{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> buckets[LATENCY_BUCKETS] = {};
+    };
+
+    operation_cells operations[METRIC_OPERATIONS];
+    std::atomic<uint64_t> counters[METRIC_COUNTERS] = {};
+};
+
+/**
+ * Increments a cell that only the calling thread writes to.
+ */
+inline void bump(std::atomic<uint64_t> & cell, uint64_t d = 1)
+{
+    cell.store(cell.load(std::memory_order_relaxed) + d,
+        std::memory_order_relaxed);
+}
+
+struct metrics_registry
+{
+    std::mutex lock;
+    vector<std::shared_ptr<thread_metrics>> tables;
+};
+
+inline metrics_registry & global_metrics_registry()
+{
+    static metrics_registry r;
+    return r;
+}
+
+inline thread_metrics * register_thread_metrics()
+{
+    auto p = std::make_shared<thread_metrics>();
+    auto & r = global_metrics_registry();
+    std::lock_guard<std::mutex> g(r.lock);
+    r.tables.push_back(p);
+    return p.get();
+}
+
+/**
+ * The calling thread's table. The pointer is constant-initialized, so the
+ * fast path is a plain thread-local load with no initialization guard; the
+ * registry owns the table.
+ */
+inline thread_metrics & this_thread_metrics()
+{
+    thread_local thread_metrics * t = nullptr;
+    if (__builtin_expect(t == nullptr, 0))
+        t = register_thread_metrics();
+    return *t;
+}
+
+inline void count_metric(metric_counter c, uint64_t d = 1)
+{
+    bump(this_thread_metrics().counters[c], d);
+}
+
+/**
+ * The number of calls of each operation the calling thread makes before its
+ * next sampled call. It is constant-initialized, so the unsampled path is a
+ * decrement of a thread-local and a branch.
+ */
+inline thread_local unsigned metric_countdown[METRIC_OPERATIONS] = {};
+
+/**
+ * Times the scope if the call is sampled. A sampled call accounts for the
+ * 2^metric_sample_shift calls up to and including the next sampled call, so
+ * call counts are exact up to one sampling period per thread.
+ */
+class timed_operation
+{
+public:
+    explicit timed_operation(metric_operation op)
+    {
+        if (__builtin_expect(metric_countdown[op] != 0, 1))
+        {
+            --metric_countdown[op];
+            cells = nullptr;
+        }
+        else
+            begin_sample(op);
+    }
+
+    timed_operation(timed_operation const &) = delete;
+    timed_operation & operator=(timed_operation const &) = delete;
+
+    ~timed_operation()
+    {
+        if (__builtin_expect(cells != nullptr, 0))
+            end_sample();
+    }
+
+private:
+    // the sampled path is kept out of line so that the clock reads and the
+    // table lookup stay off the unsampled path.
+    [[gnu::noinline, gnu::cold]] void begin_sample(metric_operation op)
+    {
+        auto const period = uint64_t(1) << std::min(31u,
+            metric_sample_shift.load(std::memory_order_relaxed));
+        metric_countdown[op] = (unsigned)(period - 1);
+        cells = &this_thread_metrics().operations[op];
+        bump(cells->calls, period);
+        start = std::chrono::steady_clock::now();
+    }
+
+    [[gnu::noinline, gnu::cold]] void end_sample()
+    {
+        auto const ns = (uint64_t)std::chrono::duration_cast<
+            std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        bump(cells->samples);
+        bump(cells->total_ns, ns);
+        bump(cells->buckets[latency_bucket(ns)]);
+    }
+
+    thread_metrics::operation_cells * cells;
+    std::chrono::steady_clock::time_point start;
+};
+
+/**
+ * Merges the tables of all threads. The snapshot is not atomic across
+ * cells: calls made while it is taken may be partially reflected.
+ */
+inline metrics_snapshot snapshot_metrics()
+{
+    metrics_snapshot s;
+    auto & r = global_metrics_registry();
+    std::lock_guard<std::mutex> g(r.lock);
+    for (auto const & t : r.tables)
+    {
+        for (size_t op = 0; op < METRIC_OPERATIONS; ++op)
+        {
+            auto const & c = t->operations[op];
+            auto & h = s.operations[op];
+            h.calls += c.calls.load(std::memory_order_relaxed);
+            h.samples += c.samples.load(std::memory_order_relaxed);
+            h.total_ns += c.total_ns.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+                h.buckets[i] += c.buckets[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < METRIC_COUNTERS; ++i)
+            s.counters[i] += t->counters[i].load(std::memory_order_relaxed);
+    }
+    return s;
+}
+
+/**
+ * Writes a snapshot as text, e.g.,
+ *     cipher_trapdoor_sets_contains_calls 1048576
+ *     cipher_trapdoor_sets_contains_latency_ns{quantile="0.99"} 88
+ *     cipher_trapdoor_sets_key_mismatch_total 3
+ */
+inline void write_metrics(std::FILE * out, metrics_snapshot const & s)
+{
+    static double const quantiles[] = {.5, .9, .99, .999};
+    for (size_t op = 0; op < METRIC_OPERATIONS; ++op)
+    {
+        auto const name = metric_name((metric_operation)op);
+        auto const & h = s.operations[op];
+        std::fprintf(out, "cipher_trapdoor_sets_%s_calls %llu\n", name,
+            (unsigned long long)h.calls);
+        std::fprintf(out, "cipher_trapdoor_sets_%s_sampled %llu\n", name,
+            (unsigned long long)h.samples);
+        std::fprintf(out, "cipher_trapdoor_sets_%s_latency_ns_mean %.1f\n",
+            name, h.mean());
+        for (auto q : quantiles)
+        {
+            std::fprintf(out,
+                "cipher_trapdoor_sets_%s_latency_ns{quantile=\"%g\"} %llu\n",
+                name, q, (unsigned long long)h.quantile(q));
+        }
+    }
+    for (size_t c = 0; c < METRIC_COUNTERS; ++c)
+    {
+        std::fprintf(out, "cipher_trapdoor_sets_%s_total %llu\n",
+            metric_name((metric_counter)c), (unsigned long long)s.counters[c]);
+    }
+    std::fflush(out);
+}
+
+inline void write_metrics(std::FILE * out)
+{
+    write_metrics(out, snapshot_metrics());
+}
+
+/**
+ * Writes a snapshot to out every period until destroyed.
+ */
+class metrics_dumper
+{
+public:
+    metrics_dumper(std::FILE * out, std::chrono::milliseconds period) :
+        worker([this, out, period]
+        {
+            std::unique_lock<std::mutex> g(lock);
+            while (!wake.wait_for(g, period, [this] { return stopped; }))
+                write_metrics(out);
+        }) {}
+
+    metrics_dumper(metrics_dumper const &) = delete;
+    metrics_dumper & operator=(metrics_dumper const &) = delete;
+
+    ~metrics_dumper()
+    {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            stopped = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopped = false;
+    std::thread worker;
+};
+
+#if defined(CIPHER_TRAPDOOR_SETS_METRICS)
+
+#define CIPHER_TRAPDOOR_SETS_METRIC_CONCAT2(a, b) a##b
+#define CIPHER_TRAPDOOR_SETS_METRIC_CONCAT(a, b) CIPHER_TRAPDOOR_SETS_METRIC_CONCAT2(a, b)
+#define CIPHER_TRAPDOOR_SETS_TIMED(op) \
+    timed_operation CIPHER_TRAPDOOR_SETS_METRIC_CONCAT(timed_operation_, __LINE__)(op)
+#define CIPHER_TRAPDOOR_SETS_COUNT(c) count_metric(c)
+
+#else
+
+#define CIPHER_TRAPDOOR_SETS_TIMED(op) ((void)0)
+#define CIPHER_TRAPDOOR_SETS_COUNT(c) ((void)0)
+
+#endif
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+#include "shs_distributions.hpp"
+#include "singular_hash_set.hpp"
+using std::invalid_argument;
+using std::nullopt;
+using std::optional;
+using std::size_t;
+using std::vector;
+
+/**
+ * A planner that chooses a set backend and its parameters from the
+ * closed-form cost models of the backends.
+ *
+ * Given m elements, an upper bound on the false positive and false
+ * negative rates of membership, and budgets on the expected construction
+ * time and the query time, every backend is evaluated at the parameters
+ * that meet the error bounds, and the feasible plan that is best for the
+ * objective (by default, the fewest encoded bits) is recommended. The
+ * backends and their models are:
+ *
+ *     singular hash set (r), eps = 2^-r, no false negatives. The seed
+ *     search takes Q ~ Geom(p) trials with p = eps^(m-1), and a trial
+ *     hashes
+ *         1 + (1 - eps^(m-1)) / (1 - eps)
+ *     elements in expectation, since it stops at the first element that
+ *     does not collide. The encoding has r + floor(log2 Q) bits.
+ *
+ *     k-disjoint hash set (k,r), b = ceil(m/k) bins. A bin holds
+ *     C ~ Bin(m, 1/b) elements; the expected trials and bit length over
+ *     the distribution of C are those of shs_distributions.hpp. A trial
+ *     hashes at most 1 + 1/(1 - eps) elements in expectation, which is
+ *     used as the per-trial cost.
+ *
+ *     Boolean algebra (N), the N-byte homomorphic image of
+ *     trapdoor_boolean_algebra.hpp. An element maps to N pseudo-random
+ *     bytes and a set is the bitwise or of the images of its elements, so
+ *     x is a false positive if every bit set in its image is set in the
+ *     set, i.e.,
+ *         fpr = (1 - 2^-(m+1))^(8N),
+ *     and there are no false negatives. The planner reports the least such
+ *     N (a template argument, so it is instantiated by the caller).
+ *
+ * Times are the models' operation counts multiplied by cost_coefficients,
+ * which default to typical figures for a current x86-64 core and may be
+ * measured on the target machine with calibrate_cost_coefficients.
+ *
+ * Every model is a closed form or a short log-space sum, so a plan over
+ * all backends and parameters takes about a millisecond.
+ */
+
+/**
+ * The cost of the primitive operations of the models, in nanoseconds.
+ *
+ *     hash_ns        one singular hash, h_r(a,n)
+ *     bin_ns         binning an element of a k-DHS (a probe computes the
+ *                    bin, construction also appends the element to it)
+ *     byte_ns        one byte of a Boolean algebra image (and + compare)
+ *     miss_ns        a cache miss, charged to a k-DHS probe whose seeds
+ *                    and hashes do not fit in cache_bytes
+ *     cache_bytes    the cache a probe is assumed to hit in
+ */
+struct cost_coefficients
+{
+    double hash_ns = 2.5;
+    double bin_ns = 1.;
+    double byte_ns = .1;
+    double miss_ns = 80.;
+    size_t cache_bytes = size_t(1) << 21;
+};
+
+enum set_backend
+{
+    BACKEND_SINGULAR_HASH_SET,
+    BACKEND_DISJOINT_HASH_SET,
+    BACKEND_BOOLEAN_ALGEBRA
+};
+
+inline char const * backend_name(set_backend b)
+{
+    switch (b)
+    {
+    case BACKEND_SINGULAR_HASH_SET: return "singular_hash_set";
+    case BACKEND_DISJOINT_HASH_SET: return "disjoint_hash_set";
+    case BACKEND_BOOLEAN_ALGEBRA: return "trapdoor_boolean_algebra";
+    }
+    return "unknown";
+}
+
+enum plan_objective
+{
+    PLAN_MIN_SPACE,
+    PLAN_MIN_QUERY_TIME,
+    PLAN_MIN_CONSTRUCTION_TIME
+};
+
+/**
+ * The requirements of a set of m elements. The budgets are on the
+ * expected construction time of the whole set and the time of one
+ * membership query.
+ */
+struct plan_request
+{
+    size_t m;
+    double max_fpr;
+    double max_fnr = 0.;
+    double construction_ns = 1e9;
+    double query_ns = std::numeric_limits<double>::infinity();
+    plan_objective objective = PLAN_MIN_SPACE;
+};
+
+/**
+ * A backend with its parameters and the predictions of its model.
+ *
+ *     r, k, n_bytes       the parameters the backend uses (r and k for the
+ *                         hash sets, n_bytes = N for the Boolean algebra)
+ *     expected_trials     the expected number of seed search trials, or
+ *                         +infinity past the range of a double
+ *     log2_expected_trials
+ *                         its log2, which is always finite
+ *     bits                the expected encoded bit length
+ *     memory_bytes        the in-memory size (see memory_usage.hpp)
+ */
+struct set_plan
+{
+    set_backend backend;
+    unsigned r = 0;
+    size_t k = 0;
+    size_t n_bytes = 0;
+    double fpr = 0;
+    double fnr = 0;
+    double expected_trials = 0;
+    double log2_expected_trials = 0;
+    double construction_ns = 0;
+    double query_ns = 0;
+    double bits = 0;
+    double bits_per_element = 0;
+    double memory_bytes = 0;
+};
+
+namespace detail
+{
+    /**
+     * 2^log2_trials trials at ns_per_trial each: +infinity when that is
+     * past the range of a double, and never NaN, even for a free trial.
+     */
+    inline double scaled_trials(double log2_trials, double ns_per_trial)
+    {
+        if (ns_per_trial <= 0)
+            return 0.;
+        return std::exp2(log2_trials + std::log2(ns_per_trial));
+    }
+}
+
+/**
+ * The cost model of a singular hash set of m elements with r-bit hashes.
+ */
+inline set_plan singular_hash_set_plan(size_t m, unsigned r, cost_coefficients const & c = {})
+{
+    if (m == 0 || r == 0 || r > 64)
+        throw invalid_argument("singular hash set plan needs m > 0 and r in [1,64]");
+
+    auto const eps = singular_hash_fpr(r);
+    auto const log2_trials = (double)r * (m - 1);
+    auto const hashes = m == 1 ? 1. : 1 + (1 - std::exp2(-log2_trials)) / (1 - eps);
+
+    set_plan s{BACKEND_SINGULAR_HASH_SET};
+    s.r = r;
+    s.fpr = eps;
+    s.log2_expected_trials = log2_trials;
+    s.expected_trials = std::exp2(log2_trials);
+    s.construction_ns = detail::scaled_trials(log2_trials, hashes * c.hash_ns);
+    s.query_ns = c.hash_ns;
+    s.bits = expected_shs_bits(m, r);
+    s.bits_per_element = s.bits / m;
+    s.memory_bytes = sizeof(singular_hash_set<size_t>);
+    return s;
+}
+
+/**
+ * The cost model of a k-disjoint hash set of m elements with r-bit hashes.
+ */
+inline set_plan disjoint_hash_set_plan(size_t m, size_t k, unsigned r, cost_coefficients const & c = {})
+{
+    if (m == 0 || k == 0 || r == 0 || r > 64)
+        throw invalid_argument("k-disjoint hash set plan needs m, k > 0 and r in [1,64]");
+
+    auto const eps = singular_hash_fpr(r);
+    auto const b = (double)((m + k - 1) / k);
+    if (b == 1)
+    {
+        // one bin holds every element.
+        auto s = singular_hash_set_plan(m, r, c);
+        s.backend = BACKEND_DISJOINT_HASH_SET;
+        s.k = k;
+        s.construction_ns += m * c.bin_ns;
+        s.query_ns += c.bin_ns;
+        s.memory_bytes = sizeof(disjoint_hash_set<size_t>) + 2 * sizeof(size_t);
+        return s;
+    }
+
+    auto const log2_trials = log2_expected_dhs_trials(m, k, r);
+
+    set_plan s{BACKEND_DISJOINT_HASH_SET};
+    s.r = r;
+    s.k = k;
+    s.fpr = eps;
+    s.log2_expected_trials = log2_trials;
+    s.expected_trials = std::exp2(log2_trials);
+    s.construction_ns = detail::scaled_trials(log2_trials, (1 + 1 / (1 - eps)) * c.hash_ns) +
+        m * c.bin_ns;
+    s.bits = expected_dhs_bits(m, k, r);
+    s.bits_per_element = s.bits / m;
+    s.memory_bytes = sizeof(disjoint_hash_set<size_t>) + 2 * b * sizeof(size_t);
+    s.query_ns = c.bin_ns + c.hash_ns +
+        (s.memory_bytes > c.cache_bytes ? c.miss_ns : 0.);
+    return s;
+}
+
+/**
+ * The cost model of the N-byte Boolean algebra image of m elements.
+ */
+inline set_plan boolean_algebra_plan(size_t m, size_t n_bytes, cost_coefficients const & c = {})
+{
+    if (m == 0 || n_bytes == 0)
+        throw invalid_argument("Boolean algebra plan needs m > 0 and N > 0");
+
+    set_plan s{BACKEND_BOOLEAN_ALGEBRA};
+    s.n_bytes = n_bytes;
+    s.fpr = std::exp(CHAR_BIT * (double)n_bytes * std::log1p(-std::exp2(-(double)m - 1)));
+    s.construction_ns = m * (c.hash_ns + n_bytes * c.byte_ns);
+    s.query_ns = n_bytes * c.byte_ns;
+    s.bits = CHAR_BIT * (n_bytes + 4.);
+    s.bits_per_element = s.bits / m;
+    s.memory_bytes = n_bytes + 4.;
+    return s;
+}
+
+/**
+ * The least N such that the N-byte Boolean algebra image of m elements
+ * has a false positive rate of at most max_fpr, or 0 if it exceeds
+ * max_bytes.
+ */
+inline size_t boolean_algebra_bytes(size_t m, double max_fpr, size_t max_bytes = size_t(1) << 20)
+{
+    auto const per_byte = CHAR_BIT * std::log1p(-std::exp2(-(double)m - 1));
+    auto const n = std::ceil(std::log(max_fpr) / per_byte);
+    return n < 1 ? 1 : n > max_bytes ? 0 : (size_t)n;
+}
+
+/**
+ * True if s meets the error bounds and budgets of req. A construction too
+ * long to represent (+infinity) meets no budget, an unbounded one included.
+ */
+inline bool meets(set_plan const & s, plan_request const & req)
+{
+    return s.fpr <= req.max_fpr && s.fnr <= req.max_fnr &&
+        std::isfinite(s.construction_ns) &&
+        s.construction_ns <= req.construction_ns && s.query_ns <= req.query_ns;
+}
+
+/**
+ * Every backend at the parameters that meet the error bounds of req,
+ * whether or not it meets the time budgets.
+ *
+ * The hash sets use the least r with 2^-r <= max_fpr, since a wider hash
+ * only adds bits and trials. The k-DHS is evaluated for every k up to
+ * max_k.
+ */
+inline vector<set_plan> candidate_plans(plan_request const & req, cost_coefficients const & c = {},
+    size_t max_k = 64)
+{
+    if (req.m == 0)
+        throw invalid_argument("plan of the empty set");
+    if (!(req.max_fpr > 0 && req.max_fpr < 1) || !(req.max_fnr >= 0))
+        throw invalid_argument("error rates must be in (0,1)");
+
+    vector<set_plan> plans;
+    auto const r = (unsigned)std::max(1., std::ceil(-std::log2(req.max_fpr)));
+    if (r <= 64)
+    {
+        plans.push_back(singular_hash_set_plan(req.m, r, c));
+        for (size_t k = 1; k <= std::min(max_k, req.m); ++k)
+            plans.push_back(disjoint_hash_set_plan(req.m, k, r, c));
+    }
+    if (auto n = boolean_algebra_bytes(req.m, req.max_fpr))
+        plans.push_back(boolean_algebra_plan(req.m, n, c));
+    return plans;
+}
+
+/**
+ * The feasible plan that is best for the objective of req (ties are broken
+ * by bits, then query time), or nullopt if no plan meets req.
+ */
+inline optional<set_plan> recommend_set_plan(plan_request const & req, cost_coefficients const & c = {})
+{
+    auto const key = [&](set_plan const & s)
+    {
+        switch (req.objective)
+        {
+        case PLAN_MIN_QUERY_TIME: return s.query_ns;
+        case PLAN_MIN_CONSTRUCTION_TIME: return s.construction_ns;
+        default: return s.bits;
+        }
+    };
+
+    optional<set_plan> best;
+    for (auto const & s : candidate_plans(req, c))
+    {
+        if (!meets(s, req))
+            continue;
+        if (!best || std::make_tuple(key(s), s.bits, s.query_ns) <
+            std::make_tuple(key(*best), best->bits, best->query_ns))
+            best = s;
+    }
+    return best;
+}
+
+/**
+ * Measures the cost coefficients on the calling thread by timing each
+ * primitive over n iterations. The cache coefficients are left at their
+ * defaults.
+ */
+template <template <typename> typename H = std::hash>
+cost_coefficients calibrate_cost_coefficients(size_t n = size_t(1) << 20)
+{
+    using clock = std::chrono::steady_clock;
+    auto const ns_per = [n](auto start)
+    {
+        return std::chrono::duration<double, std::nano>(clock::now() - start).count() / n;
+    };
+
+    cost_coefficients c;
+    volatile size_t sink = 0;
+
+    auto start = clock::now();
+    size_t h = 0;
+    for (size_t i = 0; i < n; ++i)
+        h ^= singular_hash<H>(h + i, i, 8);
+    c.hash_ns = ns_per(start);
+    sink = h;
+
+    start = clock::now();
+    for (size_t i = 0; i < n; ++i)
+        h += dhs_bin(h * 0x9e3779b97f4a7c15ull + i, 1021);
+    c.bin_ns = ns_per(start);
+    sink = h;
+
+    vector<unsigned char> image(4096, 0x5a), set(4096, 0x7b);
+    size_t hits = 0;
+    start = clock::now();
+    for (size_t i = 0; i < n / 64; ++i)
+    {
+        image[i % image.size()] ^= (unsigned char)i;
+        bool in = true;
+        for (size_t j = 0; j < image.size(); ++j)
+            in &= (image[j] & set[j]) == image[j];
+        hits += in;
+    }
+    c.byte_ns = ns_per(start) * 64 / image.size();
+    sink = hits;
+    (void)sink;
+    return c;
+}
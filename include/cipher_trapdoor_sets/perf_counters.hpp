@@ -0,0 +1,364 @@
+#pragma once
+
+/**
+ * Hardware performance-counter instrumentation of the trapdoor kernels.
+ *
+ * A kernel entry point (e.g., the batch paths of make_trapdoors, key
+ * filtering, the seed search of the hash sets) opens a scope with
+ *     CIPHER_TRAPDOOR_SETS_PERF_SCOPE("kernel name", n);
+ * where n is the number of items the call processes. When compiled with
+ * CIPHER_TRAPDOOR_SETS_PERF_COUNTERS, the scope reads a group of hardware
+ * counters of the calling thread on entry and on exit,
+ *     cycles, instructions, cache misses, branch misses,
+ * through perf_event_open, along with the wall time, and adds the
+ * difference to the statistics of (kernel, size class), where the size
+ * class of n is floor(log2 n) (and 0 for n = 0). Otherwise, the macro
+ * expands to nothing and this header declares nothing else, so disabled
+ * instrumentation has no cost at all.
+ *
+ * The counters are only read at scope boundaries, which costs a system call
+ * each (on the order of a microsecond), so scopes belong around calls that
+ * process a batch, not around a single probe. Probes are measured through
+ * their batch forms (e.g., select_by_key).
+ *
+ * Each thread opens its own counter group on its first scope and keeps its
+ * own table of statistics, so scopes do not contend. perf_kernel_report
+ * merges the tables of all threads. If perf_event_open is not permitted
+ * (e.g., kernel.perf_event_paranoid is too high, or in a container without
+ * CAP_PERFMON), scopes still count calls, items and wall time, and the
+ * counter columns of the report are zero and perf_counters_available()
+ * is false.
+ *
+ * Scopes may nest; an inner scope's events are also counted by its
+ * enclosing scope.
+ */
+
+#if defined(CIPHER_TRAPDOOR_SETS_PERF_COUNTERS)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+constexpr size_t PERF_COUNTER_EVENTS = 4;
+
+/**
+ * A sample of the counter group and the wall clock, in nanoseconds.
+ */
+struct perf_sample
+{
+    uint64_t events[PERF_COUNTER_EVENTS];
+    uint64_t ns;
+};
+
+/**
+ * The counter group of the calling thread: cycles (the group leader),
+ * instructions, cache misses and branch misses, counted in user space only.
+ */
+struct perf_counter_group
+{
+    perf_counter_group()
+    {
+        static uint64_t const configs[PERF_COUNTER_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES};
+
+        for (size_t i = 0; i < PERF_COUNTER_EVENTS; ++i)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+
+            auto const fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1,
+                i == 0 ? -1 : fds[0], 0);
+            if (fd < 0)
+            {
+                close_all();
+                return;
+            }
+            fds[i] = fd;
+        }
+
+        ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    perf_counter_group(perf_counter_group const &) = delete;
+    perf_counter_group & operator=(perf_counter_group const &) = delete;
+
+    ~perf_counter_group()
+    {
+        close_all();
+    }
+
+    bool available() const
+    {
+        return fds[0] >= 0;
+    }
+
+    perf_sample sample() const
+    {
+        perf_sample s{};
+        if (available())
+        {
+            // PERF_FORMAT_GROUP: { nr, values[nr] }
+            uint64_t buf[1 + PERF_COUNTER_EVENTS];
+            if (read(fds[0], buf, sizeof(buf)) == (ssize_t)sizeof(buf))
+                std::copy(buf + 1, buf + 1 + PERF_COUNTER_EVENTS, s.events);
+        }
+        s.ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        return s;
+    }
+
+private:
+    void close_all()
+    {
+        for (auto & fd : fds)
+        {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+    }
+
+    int fds[PERF_COUNTER_EVENTS] = {-1, -1, -1, -1};
+};
+
+struct perf_kernel_stats
+{
+    uint64_t calls = 0;
+    uint64_t items = 0;
+    uint64_t ns = 0;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cache_misses = 0;
+    uint64_t branch_misses = 0;
+
+    perf_kernel_stats & operator+=(perf_kernel_stats const & rhs)
+    {
+        calls += rhs.calls;
+        items += rhs.items;
+        ns += rhs.ns;
+        cycles += rhs.cycles;
+        instructions += rhs.instructions;
+        cache_misses += rhs.cache_misses;
+        branch_misses += rhs.branch_misses;
+        return *this;
+    }
+};
+
+/**
+ * The number of items in [begin,end) if I is a forward iterator, and 0
+ * otherwise (an input range cannot be measured without consuming it).
+ */
+template <typename I>
+size_t perf_item_count(I begin, I end)
+{
+    using category = typename std::iterator_traits<I>::iterator_category;
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, category>)
+        return (size_t)std::distance(begin, end);
+    else
+        return 0;
+}
+
+inline unsigned perf_size_class(size_t n)
+{
+    unsigned c = 0;
+    for (; n > 1; n >>= 1)
+        ++c;
+    return c;
+}
+
+/**
+ * The per-thread statistics, keyed by (kernel, size class). Kernel names
+ * are string literals, so they are keyed by address and compared by
+ * content only when the report is merged.
+ */
+struct perf_thread_table
+{
+    std::mutex lock;
+    std::map<std::pair<char const *, unsigned>, perf_kernel_stats> stats;
+};
+
+struct perf_registry
+{
+    std::mutex lock;
+    vector<std::shared_ptr<perf_thread_table>> tables;
+};
+
+inline perf_registry & global_perf_registry()
+{
+    static perf_registry r;
+    return r;
+}
+
+/**
+ * The calling thread's counter group and table. The table is registered on
+ * first use, and the registry keeps it alive after the thread exits so that
+ * its statistics are still reported; the counter group is closed with the
+ * thread.
+ */
+struct perf_thread_state
+{
+    perf_thread_state() : table(std::make_shared<perf_thread_table>())
+    {
+        auto & r = global_perf_registry();
+        std::lock_guard<std::mutex> g(r.lock);
+        r.tables.push_back(table);
+    }
+
+    std::shared_ptr<perf_thread_table> table;
+    perf_counter_group counters;
+};
+
+inline perf_thread_state & thread_perf_state()
+{
+    thread_local perf_thread_state s;
+    return s;
+}
+
+class perf_scope
+{
+public:
+    perf_scope(char const * kernel, size_t n) :
+        state(thread_perf_state()),
+        kernel(kernel),
+        n(n),
+        start(state.counters.sample()) {}
+
+    perf_scope(perf_scope const &) = delete;
+    perf_scope & operator=(perf_scope const &) = delete;
+
+    ~perf_scope()
+    {
+        auto const end = state.counters.sample();
+        perf_kernel_stats d;
+        d.calls = 1;
+        d.items = n;
+        d.ns = end.ns - start.ns;
+        d.cycles = end.events[0] - start.events[0];
+        d.instructions = end.events[1] - start.events[1];
+        d.cache_misses = end.events[2] - start.events[2];
+        d.branch_misses = end.events[3] - start.events[3];
+
+        std::lock_guard<std::mutex> g(state.table->lock);
+        state.table->stats[{kernel, perf_size_class(n)}] += d;
+    }
+
+private:
+    perf_thread_state & state;
+    char const * kernel;
+    size_t n;
+    perf_sample start;
+};
+
+struct perf_kernel_row
+{
+    string kernel;
+    unsigned size_class;
+    perf_kernel_stats stats;
+};
+
+/**
+ * Whether the calling thread could open its counter group.
+ */
+inline bool perf_counters_available()
+{
+    return thread_perf_state().counters.available();
+}
+
+/**
+ * The statistics of all threads, merged by (kernel, size class) and sorted
+ * by kernel name and then size class.
+ */
+inline vector<perf_kernel_row> perf_kernel_report()
+{
+    std::map<std::pair<string, unsigned>, perf_kernel_stats> merged;
+    auto & r = global_perf_registry();
+    std::lock_guard<std::mutex> g(r.lock);
+    for (auto const & t : r.tables)
+    {
+        std::lock_guard<std::mutex> h(t->lock);
+        for (auto const & [k, s] : t->stats)
+            merged[{string(k.first), k.second}] += s;
+    }
+
+    vector<perf_kernel_row> rows;
+    for (auto const & [k, s] : merged)
+        rows.push_back(perf_kernel_row{k.first, k.second, s});
+    return rows;
+}
+
+/**
+ * Clears the statistics of all threads.
+ */
+inline void reset_perf_kernel_stats()
+{
+    auto & r = global_perf_registry();
+    std::lock_guard<std::mutex> g(r.lock);
+    for (auto const & t : r.tables)
+    {
+        std::lock_guard<std::mutex> h(t->lock);
+        t->stats.clear();
+    }
+}
+
+/**
+ * Writes the report as a table with per-item and per-instruction ratios,
+ * e.g., to print at exit from a benchmark or tool.
+ */
+inline void print_perf_kernel_report(std::FILE * out)
+{
+    std::fprintf(out, "%-28s %5s %10s %12s %9s %9s %6s %9s %9s\n",
+        "kernel", "2^k", "calls", "items", "ns/item", "cyc/item", "IPC",
+        "miss/item", "brm/item");
+    for (auto const & row : perf_kernel_report())
+    {
+        auto const & s = row.stats;
+        auto const items = (double)std::max<uint64_t>(1, s.items);
+        std::fprintf(out, "%-28s %5u %10llu %12llu %9.2f %9.2f %6.2f %9.4f %9.4f\n",
+            row.kernel.c_str(), row.size_class,
+            (unsigned long long)s.calls, (unsigned long long)s.items,
+            s.ns / items, s.cycles / items,
+            s.cycles ? (double)s.instructions / s.cycles : 0.,
+            s.cache_misses / items, s.branch_misses / items);
+    }
+}
+
+#define CIPHER_TRAPDOOR_SETS_PERF_CONCAT2(a, b) a##b
+#define CIPHER_TRAPDOOR_SETS_PERF_CONCAT(a, b) CIPHER_TRAPDOOR_SETS_PERF_CONCAT2(a, b)
+#define CIPHER_TRAPDOOR_SETS_PERF_SCOPE(kernel, n) \
+    perf_scope CIPHER_TRAPDOOR_SETS_PERF_CONCAT(perf_scope_, __LINE__)(kernel, (size_t)(n))
+
+#else
+
+#define CIPHER_TRAPDOOR_SETS_PERF_SCOPE(kernel, n) ((void)0)
+
+#endif
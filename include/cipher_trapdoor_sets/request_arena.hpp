@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+using std::size_t;
+
+/**
+ * A monotonic arena for the temporaries of one request.
+ *
+ * A request (e.g., a query that builds k-disjoint hash sets, filters a batch
+ * by key and maps its rows to trapdoors) allocates and frees many short-lived
+ * buffers. Through the general heap, each of them is a malloc and a free. The
+ * containers and batch paths of this library instead accept a
+ * std::pmr::memory_resource (or a std::pmr::polymorphic_allocator), and a
+ * request_arena provides one whose allocation is a pointer bump and whose
+ * deallocation is a no-op:
+ *
+ *     request_arena arena;
+ *     for (auto const & q : queries)
+ *     {
+ *         auto dhs = make_disjoint_hash_set(arena.resource(), ...);
+ *         ...
+ *         arena.reset();
+ *     }
+ *
+ * reset() releases every allocation of the request at once and rewinds to
+ * the arena's initial block, which is kept, so a request whose temporaries
+ * fit in the initial block never touches the upstream resource. A request
+ * that outgrows it takes further blocks (of geometrically growing size)
+ * from upstream, and reset() returns them.
+ *
+ * Values allocated in the arena must not outlive the next reset(). A
+ * request_arena is not thread-safe; each thread serving requests keeps its
+ * own.
+ */
+class request_arena
+{
+public:
+    explicit request_arena(
+        size_t initial_bytes = size_t(1) << 16,
+        std::pmr::memory_resource * upstream = std::pmr::get_default_resource()) :
+        initial_bytes(initial_bytes),
+        initial(new std::byte[initial_bytes]),
+        arena(initial.get(), initial_bytes, upstream) {}
+
+    request_arena(request_arena const &) = delete;
+    request_arena & operator=(request_arena const &) = delete;
+
+    std::pmr::memory_resource * resource() { return &arena; }
+
+    template <typename T = std::byte>
+    std::pmr::polymorphic_allocator<T> allocator() { return &arena; }
+
+    /**
+     * Releases every allocation made since the last reset.
+     */
+    void reset() { arena.release(); }
+
+    size_t initial_size() const { return initial_bytes; }
+
+private:
+    size_t initial_bytes;
+    std::unique_ptr<std::byte[]> initial;
+    std::pmr::monotonic_buffer_resource arena;
+};
+
+/**
+ * Resets an arena on scope exit, so the temporaries of a request are
+ * released however the request ends.
+ */
+class request_arena_scope
+{
+public:
+    explicit request_arena_scope(request_arena & arena) : arena(arena) {}
+
+    request_arena_scope(request_arena_scope const &) = delete;
+    request_arena_scope & operator=(request_arena_scope const &) = delete;
+
+    ~request_arena_scope() { arena.reset(); }
+
+    std::pmr::memory_resource * resource() { return arena.resource(); }
+
+private:
+    request_arena & arena;
+};
+
+/**
+ * The calling thread's request arena.
+ */
+inline request_arena & thread_request_arena()
+{
+    thread_local request_arena arena;
+    return arena;
+}
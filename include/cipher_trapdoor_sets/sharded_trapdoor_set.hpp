@@ -0,0 +1,396 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "trapdoor_client.hpp"
+using std::invalid_argument;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint32_t;
+using std::uint64_t;
+using std::unique_ptr;
+using std::vector;
+
+/**
+ * A trapdoor set partitioned across local worker processes.
+ *
+ * A set too large for the memory budget of one process is split into
+ * shards by the high bits of the value hash, which is uniform by
+ * construction, so the shards are of near equal size without a directory:
+ *
+ *     shard(x) = ((x.value_hash >> 32) * shards) >> 32
+ *
+ * Each shard is a trapdoor file (trapdoor_io.hpp) in a directory and is
+ * served by its own worker process, an instance of tools/trapdoor_server
+ * spawned on one end of a socket pair (trapdoor_server -F), which answers
+ * the requests of trapdoor_protocol.hpp, so a shard's index lives in its
+ * worker's address space:
+ *
+ *     sharded_trapdoor_set s("/var/lib/trapdoors", 8, xs.begin(), xs.end());
+ *     vector<bool> member = s.contains(qs.begin(), qs.end());
+ *
+ * The workers are started with posix_spawn, not fork, so the set may be
+ * built and rebuilt while the process runs other threads. The server
+ * binary is looked up on PATH unless a path is given.
+ *
+ * A batch probe is scattered: the queries are grouped by shard and each
+ * shard gets one OP_CONTAINS request, all sent before any response is read,
+ * so the workers probe their shards in parallel. The responses are then
+ * gathered back into the order of the queries. A worker reads a request
+ * whole before it answers, so sending every request first cannot deadlock.
+ *
+ * rebuild_shard(i, ...) replaces one shard: it writes the shard's new file,
+ * starts a worker on it and only then switches over and retires the old
+ * worker, so the other shards are untouched and the set is never without
+ * shard i. The trapdoors given must all fall in shard i.
+ *
+ * The set checks the key hash of every query before it is scattered, so a
+ * trapdoor under another key throws invalid_argument("secret key mismatch")
+ * as for the other sets. Each response is matched to its request by id. A
+ * probe that fails once its requests are sent (a worker died, a connection
+ * broke, a response came out of step) throws runtime_error, and the shards
+ * whose responses it left unread get new workers, so no stale response is
+ * ever taken for the answer to a later probe; a shard whose worker cannot
+ * be restarted then is retried by its next probe. A sharded_trapdoor_set is
+ * used by one thread at a time.
+ */
+
+inline uint32_t shard_of(uint64_t value_hash, uint32_t shards)
+{
+    return (uint32_t)(((value_hash >> 32) * shards) >> 32);
+}
+
+class sharded_trapdoor_set
+{
+public:
+    /**
+     * Partitions the trapdoors [begin,end) into shard files in dir and
+     * starts a worker for each, running the trapdoor_server binary server.
+     */
+    template <typename I>
+    sharded_trapdoor_set(string dir, uint32_t shards, I begin, I end,
+        string server = "trapdoor_server") :
+        dir(std::move(dir)), server(std::move(server))
+    {
+        if (shards == 0)
+            throw invalid_argument("no shards");
+
+        vector<vector<trapdoor_record>> parts(shards);
+        for (; begin != end; ++begin)
+        {
+            auto const r = record_of(*begin);
+            adopt_key(r.key_hash);
+            parts[shard_of(r.value_hash, shards)].push_back(r);
+        }
+
+        workers.resize(shards);
+        try
+        {
+            for (uint32_t i = 0; i < shards; ++i)
+            {
+                write_shard(i, parts[i]);
+                workers[i] = start_worker(i);
+            }
+        }
+        catch (...)
+        {
+            stop_workers();
+            throw;
+        }
+    }
+
+    sharded_trapdoor_set(sharded_trapdoor_set const &) = delete;
+    sharded_trapdoor_set & operator=(sharded_trapdoor_set const &) = delete;
+
+    ~sharded_trapdoor_set() { stop_workers(); }
+
+    uint32_t shards() const { return (uint32_t)workers.size(); }
+
+    /**
+     * The path of shard i's trapdoor file.
+     */
+    string shard_path(uint32_t i) const
+    {
+        return dir + "/shard-" + std::to_string(i) + ".trapdoors";
+    }
+
+    pid_t shard_pid(uint32_t i) const { return workers.at(i).pid; }
+
+    /**
+     * The membership of the trapdoors [begin,end), in order.
+     */
+    template <typename I>
+    vector<bool> contains(I begin, I end)
+    {
+        auto const n = (size_t)std::distance(begin, end);
+        vector<vector<size_t>> positions(workers.size());
+        vector<vector<trapdoor_record>> records(workers.size());
+        size_t pos = 0;
+        for (auto it = begin; it != end; ++it, ++pos)
+        {
+            auto const r = record_of(*it);
+            check_key(r.key_hash);
+            auto const i = shard_of(r.value_hash, shards());
+            positions[i].push_back(pos);
+            records[i].push_back(r);
+        }
+
+        // shards left without a worker by an earlier failure get one
+        // before anything is sent.
+        for (uint32_t i = 0; i < shards(); ++i)
+            if (!positions[i].empty() && !workers[i].client)
+                workers[i] = start_worker(i);
+
+        // a shard is pending from the moment its request is queued until
+        // its response is read whole; a pending shard's connection is out
+        // of step if the probe fails.
+        vector<uint32_t> pending;
+        vector<uint32_t> ids(workers.size());
+        size_t gathered = 0;
+        vector<bool> member(n);
+        try
+        {
+            // scatter
+            for (uint32_t i = 0; i < shards(); ++i)
+            {
+                if (positions[i].empty())
+                    continue;
+                auto & c = *workers[i].client;
+                pending.push_back(i);
+                ids[i] = c.send_contains(0, records[i].begin(), records[i].end());
+                c.flush();
+            }
+
+            // gather
+            for (auto const i : pending)
+            {
+                auto const response = workers[i].client->receive();
+                if (response.id != ids[i])
+                    throw runtime_error("shard " + std::to_string(i) + " answered request " +
+                        std::to_string(response.id) + ", not " + std::to_string(ids[i]));
+                // a response read whole leaves its connection in step,
+                // however it decodes.
+                ++gathered;
+                auto const bits = decode_membership_response(response.reader());
+                if (bits.size() != positions[i].size())
+                    throw runtime_error("malformed shard response");
+                for (size_t j = 0; j < bits.size(); ++j)
+                    member[positions[i][j]] = bits[j];
+            }
+        }
+        catch (...)
+        {
+            for (auto p = gathered; p < pending.size(); ++p)
+                restart_worker(pending[p]);
+            throw;
+        }
+        return member;
+    }
+
+    template <typename X>
+    bool contains(trapdoor<X> const & x)
+    {
+        return contains(&x, &x + 1)[0];
+    }
+
+    /**
+     * Replaces the contents of shard i with the trapdoors [begin,end),
+     * leaving the other shards untouched.
+     */
+    template <typename I>
+    void rebuild_shard(uint32_t i, I begin, I end)
+    {
+        if (i >= shards())
+            throw invalid_argument("no shard " + std::to_string(i));
+
+        vector<trapdoor_record> part;
+        for (; begin != end; ++begin)
+        {
+            auto const r = record_of(*begin);
+            adopt_key(r.key_hash);
+            if (shard_of(r.value_hash, shards()) != i)
+                throw invalid_argument("trapdoor outside shard " + std::to_string(i));
+            part.push_back(r);
+        }
+
+        // the new file is written aside and renamed, so the old worker,
+        // which maps the old file, keeps serving until the switch.
+        auto const path = shard_path(i);
+        write_file(path + ".new", part);
+        if (std::rename((path + ".new").c_str(), path.c_str()) != 0)
+            throw runtime_error("cannot replace " + path);
+
+        auto next = start_worker(i);
+        std::swap(workers[i], next);
+        stop_worker(next);
+    }
+
+private:
+    /**
+     * The hashes of a trapdoor<X> of any X.
+     */
+    struct trapdoor_record
+    {
+        uint64_t value_hash;
+        uint64_t key_hash;
+    };
+
+    template <typename T>
+    static trapdoor_record record_of(T const & x)
+    {
+        return trapdoor_record{(uint64_t)x.value_hash, (uint64_t)x.key_hash};
+    }
+
+    struct worker
+    {
+        pid_t pid = -1;
+        unique_ptr<trapdoor_client> client;
+    };
+
+    /**
+     * The key hash is that of the first trapdoor added; an empty set has
+     * no key and contains nothing.
+     */
+    void check_key(uint64_t k) const
+    {
+        if (keyed && k != key_hash)
+            throw invalid_argument("secret key mismatch");
+    }
+
+    void adopt_key(uint64_t k)
+    {
+        check_key(k);
+        key_hash = k;
+        keyed = true;
+    }
+
+    void write_shard(uint32_t i, vector<trapdoor_record> const & part) const
+    {
+        write_file(shard_path(i), part);
+    }
+
+    static void write_file(string const & path, vector<trapdoor_record> const & part)
+    {
+        vector<uint8_t> bytes(part.size() * TRAPDOOR_RECORD_BYTES);
+        encode_trapdoors(part.begin(), part.end(), bytes.data());
+
+        auto f = std::fopen(path.c_str(), "wb");
+        if (!f)
+            throw runtime_error("cannot create " + path);
+        bool ok = true;
+        try
+        {
+            write_trapdoor_file_header(f, 1);
+        }
+        catch (...)
+        {
+            ok = false;
+        }
+        ok = ok && (bytes.empty() || std::fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size());
+        ok = std::fclose(f) == 0 && ok;
+        if (!ok)
+            throw runtime_error("failed to write " + path);
+    }
+
+    /**
+     * Spawns a worker serving shard i's file on one end of a socket pair.
+     */
+    worker start_worker(uint32_t i) const
+    {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+            throw runtime_error("cannot create socket pair");
+
+        // the worker's end becomes its descriptor WORKER_FD; every other
+        // descriptor, the other workers' ends among them, is close-on-exec,
+        // so each worker sees its connection close when the set closes it.
+        // dup2 onto itself would keep close-on-exec, so it is cleared here.
+        if (fds[0] == WORKER_FD)
+            ::fcntl(fds[0], F_SETFD, 0);
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[0], WORKER_FD);
+
+        auto const fd_arg = std::to_string(WORKER_FD);
+        auto const set_arg = "shard=" + shard_path(i);
+        char * argv[] = {
+            const_cast<char *>(server.c_str()),
+            const_cast<char *>("-q"),
+            const_cast<char *>("-F"),
+            const_cast<char *>(fd_arg.c_str()),
+            const_cast<char *>(set_arg.c_str()),
+            nullptr};
+        pid_t pid;
+        auto const err = ::posix_spawnp(&pid, server.c_str(), &actions, nullptr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        ::close(fds[0]);
+        if (err != 0)
+        {
+            ::close(fds[1]);
+            throw runtime_error("cannot start shard worker " + server);
+        }
+
+        worker w;
+        w.pid = pid;
+        w.client.reset(new trapdoor_client(fds[1]));
+        return w;
+    }
+
+    /**
+     * Replaces the worker of shard i, whose connection a failed probe left
+     * out of step. If no new worker starts, the shard is left without one.
+     */
+    void restart_worker(uint32_t i) noexcept
+    {
+        try
+        {
+            auto next = start_worker(i);
+            std::swap(workers[i], next);
+            stop_worker(next);
+        }
+        catch (...)
+        {
+            stop_worker(workers[i]);
+        }
+    }
+
+    /**
+     * Closes a worker's connection, which ends it, and reaps it.
+     */
+    static void stop_worker(worker & w)
+    {
+        if (w.pid < 0)
+            return;
+        w.client.reset();
+        int status;
+        while (::waitpid(w.pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        w.pid = -1;
+    }
+
+    void stop_workers()
+    {
+        for (auto & w : workers)
+            stop_worker(w);
+    }
+
+    static constexpr int WORKER_FD = 3;     // the socket's descriptor in a worker
+
+    string dir;
+    string server;                          // the trapdoor_server binary
+    uint64_t key_hash = 0;
+    bool keyed = false;
+    vector<worker> workers;
+};
@@ -0,0 +1,550 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "singular_hash_set.hpp"
+#include "type_fingerprint.hpp"
+using std::invalid_argument;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint32_t;
+using std::uint64_t;
+
+/**
+ * Zero-copy sharing of immutable set versions between processes.
+ *
+ * A shared_set_segment is a POSIX shared memory object holding a control
+ * block and slot_count version slots of slot_bytes each. One writer at a
+ * time publishes a new version of a set into a free slot and makes it
+ * current with one atomic store; readers in any process that maps the
+ * segment probe the current version in place, e.g., a
+ * trapdoor_boolean_algebra<X,N> (any trivially copyable set) or the flat
+ * form of a k-DHS (shared_dhs_view):
+ *
+ *     auto seg = shared_set_segment::open("/trapdoor-sets");
+ *     shared_set_reader reader(seg);
+ *     bool hit = reader.read([&](shared_version const & v)
+ *     {
+ *         return contains(x, shared_dhs_view(v)).value;
+ *     });
+ *
+ * A read costs no system call: the reader announces the current epoch in
+ * its own reader slot (a cache line of the control block that no other
+ * reader writes), loads the current version, runs the probe and clears
+ * its slot. This is epoch-based reclamation across processes:
+ *
+ *     publish:  copy the version into a free slot s
+ *               current := s
+ *               retired[old] := ++epoch
+ *     free:     slot s is free once every reader slot is either idle (0)
+ *               or holds an epoch >= retired[s]
+ *
+ * A reader that announced an epoch before a version was retired may still
+ * be probing it, so the writer does not reuse its slot until such readers
+ * have left. With slot_count >= 3 a publish does not wait for a reader in
+ * the common case. A publish that finds no free slot waits, and reader
+ * slots whose process has exited (checked with kill(pid, 0)) are cleared,
+ * so a crashed reader does not block the writer forever.
+ *
+ * Versions are immutable once published and are copied with memcpy, so a
+ * version is a trivially copyable value or a flat encoding; a version
+ * records its byte length and a type tag, which read_as checks before
+ * reinterpreting the bytes. The tag of a value of type T is
+ * shared_value_tag_v<T>, a mix of its type fingerprint (type_fingerprint.hpp)
+ * and sizeof(T), so two types of one size do not pass for each other; the
+ * processes must agree on the canonical name of T, as they do when built by
+ * the same compiler.
+ *
+ * Reads must not nest on one reader, and a reader is used by one thread at
+ * a time; each thread of a process opens its own. Linux only.
+ */
+
+/**
+ * The type tag of a shared version holding a T.
+ */
+template <typename T>
+constexpr uint64_t shared_value_tag_v = keyed_fingerprint(sizeof(T), type_fingerprint_v<T>);
+
+constexpr uint64_t SHARED_SET_MAGIC = 0x54445345474d4e54ull;
+constexpr uint32_t SHARED_SET_LAYOUT_VERSION = 1;
+constexpr uint32_t SHARED_SET_NO_SLOT = ~uint32_t(0);
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+    "shared sets need lock-free 64-bit atomics");
+
+namespace detail
+{
+    struct alignas(64) shared_reader_slot
+    {
+        std::atomic<uint64_t> epoch;        // 0 when idle
+        std::atomic<int> pid;               // 0 when unclaimed
+    };
+
+    struct alignas(64) shared_version_header
+    {
+        uint64_t version;
+        uint64_t bytes;
+        uint64_t tag;
+    };
+
+    struct alignas(64) shared_set_control
+    {
+        std::atomic<uint64_t> magic;
+        uint32_t layout_version;
+        uint32_t slot_count;
+        uint64_t slot_bytes;
+        uint32_t reader_count;
+        std::atomic<int> writer_pid;
+
+        alignas(64) std::atomic<uint64_t> epoch;
+        std::atomic<uint32_t> current;
+        uint64_t published;
+
+        // followed by slot_count retired epochs, reader_count reader
+        // slots, and the version slots
+    };
+
+    constexpr size_t align64(size_t n) { return (n + 63) / 64 * 64; }
+
+    inline size_t retired_offset() { return sizeof(shared_set_control); }
+
+    inline size_t readers_offset(uint32_t slots)
+    {
+        return align64(retired_offset() + slots * sizeof(std::atomic<uint64_t>));
+    }
+
+    inline size_t slots_offset(uint32_t slots, uint32_t readers)
+    {
+        return readers_offset(slots) + readers * sizeof(shared_reader_slot);
+    }
+
+    inline bool process_alive(int pid)
+    {
+        return pid > 0 && (::kill(pid, 0) == 0 || errno == EPERM);
+    }
+}
+
+/**
+ * A published version: its bytes, in place in the segment.
+ */
+struct shared_version
+{
+    uint64_t version;
+    uint64_t tag;
+    size_t bytes;
+    void const * data;
+};
+
+class shared_set_segment
+{
+public:
+    /**
+     * Creates (or replaces) the segment name, e.g., "/trapdoor-sets", with
+     * slot_count slots of up to slot_bytes and room for reader_count
+     * concurrent readers.
+     */
+    static shared_set_segment create(
+        string const & name,
+        size_t slot_bytes,
+        uint32_t slot_count = 3,
+        uint32_t reader_count = 256)
+    {
+        if (slot_count < 2)
+            throw invalid_argument("a shared set segment needs at least 2 slots");
+
+        auto const slot_size = detail::align64(sizeof(detail::shared_version_header) + slot_bytes);
+        auto const bytes = detail::slots_offset(slot_count, reader_count) + slot_count * slot_size;
+
+        ::shm_unlink(name.c_str());
+        int const fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            throw runtime_error("cannot create shared memory " + name);
+        if (::ftruncate(fd, (off_t)bytes) != 0)
+        {
+            ::close(fd);
+            ::shm_unlink(name.c_str());
+            throw runtime_error("cannot size shared memory " + name);
+        }
+
+        shared_set_segment s(fd, bytes, name);
+        auto c = s.control();
+        c->layout_version = SHARED_SET_LAYOUT_VERSION;
+        c->slot_count = slot_count;
+        c->slot_bytes = slot_size - sizeof(detail::shared_version_header);
+        c->reader_count = reader_count;
+        c->current.store(SHARED_SET_NO_SLOT, std::memory_order_relaxed);
+        c->epoch.store(1, std::memory_order_relaxed);
+        // a fresh object is zero-filled, so the retired epochs and the
+        // reader slots start out idle.
+        c->magic.store(SHARED_SET_MAGIC, std::memory_order_release);
+        return s;
+    }
+
+    /**
+     * Maps an existing segment.
+     */
+    static shared_set_segment open(string const & name)
+    {
+        int const fd = ::shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            throw runtime_error("cannot open shared memory " + name);
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(detail::shared_set_control))
+        {
+            ::close(fd);
+            throw runtime_error(name + ": not a shared set segment");
+        }
+
+        shared_set_segment s(fd, (size_t)st.st_size, name);
+        auto c = s.control();
+        if (c->magic.load(std::memory_order_acquire) != SHARED_SET_MAGIC ||
+            c->layout_version != SHARED_SET_LAYOUT_VERSION ||
+            detail::slots_offset(c->slot_count, c->reader_count) +
+                c->slot_count * (sizeof(detail::shared_version_header) + c->slot_bytes) > s.bytes)
+            throw runtime_error(name + ": not a shared set segment");
+        return s;
+    }
+
+    /**
+     * Removes the name; mappings stay valid until they are closed.
+     */
+    static void remove(string const & name)
+    {
+        ::shm_unlink(name.c_str());
+    }
+
+    shared_set_segment(shared_set_segment && other) noexcept :
+        base(std::exchange(other.base, nullptr)),
+        bytes(other.bytes),
+        segment_name(std::move(other.segment_name)) {}
+
+    shared_set_segment(shared_set_segment const &) = delete;
+    shared_set_segment & operator=(shared_set_segment const &) = delete;
+    shared_set_segment & operator=(shared_set_segment &&) = delete;
+
+    ~shared_set_segment()
+    {
+        if (base)
+            ::munmap(base, bytes);
+    }
+
+    string const & name() const { return segment_name; }
+    size_t slot_bytes() const { return control()->slot_bytes; }
+    uint32_t slot_count() const { return control()->slot_count; }
+    uint32_t reader_count() const { return control()->reader_count; }
+
+    detail::shared_set_control * control() const
+    {
+        return (detail::shared_set_control *)base;
+    }
+
+    std::atomic<uint64_t> & retired(uint32_t slot) const
+    {
+        return ((std::atomic<uint64_t> *)(base + detail::retired_offset()))[slot];
+    }
+
+    detail::shared_reader_slot & reader(uint32_t i) const
+    {
+        return ((detail::shared_reader_slot *)
+            (base + detail::readers_offset(control()->slot_count)))[i];
+    }
+
+    detail::shared_version_header * slot(uint32_t i) const
+    {
+        auto const c = control();
+        return (detail::shared_version_header *)(base +
+            detail::slots_offset(c->slot_count, c->reader_count) +
+            i * (sizeof(detail::shared_version_header) + c->slot_bytes));
+    }
+
+private:
+    shared_set_segment(int fd, size_t bytes, string name) :
+        bytes(bytes),
+        segment_name(std::move(name))
+    {
+        auto p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            throw runtime_error("cannot map shared memory " + segment_name);
+        base = (uint8_t *)p;
+    }
+
+    uint8_t * base;
+    size_t bytes;
+    string segment_name;
+};
+
+/**
+ * The writer of a segment; at most one exists at a time across processes.
+ */
+class shared_set_writer
+{
+public:
+    explicit shared_set_writer(shared_set_segment & segment) : segment(segment)
+    {
+        auto & owner = segment.control()->writer_pid;
+        int expected = owner.load();
+        while (expected == 0 || !detail::process_alive(expected))
+        {
+            if (owner.compare_exchange_weak(expected, ::getpid()))
+                return;
+        }
+        throw runtime_error(segment.name() + " already has a writer");
+    }
+
+    shared_set_writer(shared_set_writer const &) = delete;
+    shared_set_writer & operator=(shared_set_writer const &) = delete;
+
+    ~shared_set_writer()
+    {
+        segment.control()->writer_pid.store(0);
+    }
+
+    /**
+     * Publishes bytes as the current version and returns its number.
+     */
+    uint64_t publish_bytes(void const * data, size_t bytes, uint64_t tag)
+    {
+        auto const c = segment.control();
+        if (bytes > c->slot_bytes)
+            throw invalid_argument("version larger than the segment's slots");
+
+        auto const s = free_slot();
+        auto h = segment.slot(s);
+        h->version = c->published + 1;
+        h->bytes = bytes;
+        h->tag = tag;
+        std::memcpy(h + 1, data, bytes);
+
+        auto const old = c->current.exchange(s, std::memory_order_seq_cst);
+        auto const e = c->epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+        if (old != SHARED_SET_NO_SLOT)
+            segment.retired(old).store(e, std::memory_order_release);
+        return ++c->published;
+    }
+
+    /**
+     * Publishes a trivially copyable set, e.g., a trapdoor_boolean_algebra.
+     */
+    template <typename T>
+    uint64_t publish(T const & value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>,
+            "publish a trivially copyable value or a flat encoding");
+        return publish_bytes(&value, sizeof(value), shared_value_tag_v<T>);
+    }
+
+private:
+    bool slot_free(uint32_t s)
+    {
+        auto const retired = segment.retired(s).load(std::memory_order_acquire);
+        if (retired == 0)
+            return true;
+        for (uint32_t i = 0; i < segment.reader_count(); ++i)
+        {
+            auto & r = segment.reader(i);
+            auto const e = r.epoch.load(std::memory_order_seq_cst);
+            if (e != 0 && e < retired)
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * Clears the reader slots of processes that have exited.
+     */
+    void reap_readers()
+    {
+        for (uint32_t i = 0; i < segment.reader_count(); ++i)
+        {
+            auto & r = segment.reader(i);
+            auto pid = r.pid.load();
+            if (pid != 0 && !detail::process_alive(pid))
+            {
+                r.epoch.store(0);
+                r.pid.compare_exchange_strong(pid, 0);
+            }
+        }
+    }
+
+    uint32_t free_slot()
+    {
+        auto const c = segment.control();
+        for (size_t round = 0;; ++round)
+        {
+            auto const current = c->current.load(std::memory_order_relaxed);
+            for (uint32_t s = 0; s < c->slot_count; ++s)
+                if (s != current && slot_free(s))
+                    return s;
+            if (round % 1024 == 1023)
+                reap_readers();
+            std::this_thread::yield();
+        }
+    }
+
+    shared_set_segment & segment;
+};
+
+/**
+ * A reader of a segment, holding one reader slot.
+ */
+class shared_set_reader
+{
+public:
+    explicit shared_set_reader(shared_set_segment const & segment) : segment(segment)
+    {
+        auto const pid = ::getpid();
+        for (uint32_t i = 0; i < segment.reader_count(); ++i)
+        {
+            int expected = 0;
+            if (segment.reader(i).pid.compare_exchange_strong(expected, pid))
+            {
+                slot = &segment.reader(i);
+                return;
+            }
+        }
+        throw runtime_error(segment.name() + " has no free reader slot");
+    }
+
+    shared_set_reader(shared_set_reader const &) = delete;
+    shared_set_reader & operator=(shared_set_reader const &) = delete;
+
+    ~shared_set_reader()
+    {
+        slot->epoch.store(0, std::memory_order_release);
+        slot->pid.store(0, std::memory_order_release);
+    }
+
+    /**
+     * Calls f(shared_version const &) on the current version and returns
+     * its result. Throws if nothing has been published.
+     */
+    template <typename F>
+    auto read(F f)
+    {
+        auto const c = segment.control();
+        slot->epoch.store(c->epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+        struct leave
+        {
+            detail::shared_reader_slot * slot;
+            ~leave() { slot->epoch.store(0, std::memory_order_release); }
+        } guard{slot};
+
+        auto const s = c->current.load(std::memory_order_seq_cst);
+        if (s == SHARED_SET_NO_SLOT)
+            throw runtime_error(segment.name() + " has no published version");
+        auto const h = segment.slot(s);
+        return f(shared_version{h->version, h->tag, h->bytes, h + 1});
+    }
+
+    /**
+     * Calls f(T const &) on the current version, which must have been
+     * published with publish<T>.
+     */
+    template <typename T, typename F>
+    auto read_as(F f)
+    {
+        return read([&](shared_version const & v)
+        {
+            if (v.tag != shared_value_tag_v<T> || v.bytes != sizeof(T))
+                throw invalid_argument("shared version is not of the requested type");
+            return f(*(T const *)v.data);
+        });
+    }
+
+private:
+    shared_set_segment const & segment;
+    detail::shared_reader_slot * slot;
+};
+
+/**
+ * The flat encoding of a k-DHS in a shared version:
+ *     r : uint64, key_hash : uint64, bins : uint64,
+ *     seeds : uint64^bins, hashes : uint64^bins
+ */
+constexpr uint64_t SHARED_DHS_TAG = 0x5348415245444448ull;
+
+template <typename X, template <typename> typename H, typename A>
+size_t shared_dhs_bytes(disjoint_hash_set<X,H,A> const & xs)
+{
+    return (3 + 2 * xs.seeds.size()) * sizeof(uint64_t);
+}
+
+template <typename X, template <typename> typename H, typename A>
+vector<uint64_t> encode_shared_dhs(disjoint_hash_set<X,H,A> const & xs)
+{
+    vector<uint64_t> flat;
+    flat.reserve(3 + 2 * xs.seeds.size());
+    flat.push_back(xs.r);
+    flat.push_back(xs.key_hash);
+    flat.push_back(xs.seeds.size());
+    flat.insert(flat.end(), xs.seeds.begin(), xs.seeds.end());
+    flat.insert(flat.end(), xs.hashes.begin(), xs.hashes.end());
+    return flat;
+}
+
+template <typename X, template <typename> typename H, typename A>
+uint64_t publish(shared_set_writer & w, disjoint_hash_set<X,H,A> const & xs)
+{
+    auto const flat = encode_shared_dhs(xs);
+    return w.publish_bytes(flat.data(), flat.size() * sizeof(uint64_t), SHARED_DHS_TAG);
+}
+
+/**
+ * A k-DHS probed in place in a shared version.
+ */
+template <template <typename> typename H = std::hash>
+struct shared_dhs_view
+{
+    explicit shared_dhs_view(shared_version const & v)
+    {
+        auto const p = (uint64_t const *)v.data;
+        if (v.tag != SHARED_DHS_TAG || v.bytes < 3 * sizeof(uint64_t) ||
+            v.bytes != (3 + 2 * p[2]) * sizeof(uint64_t))
+            throw invalid_argument("shared version is not a k-DHS");
+        r = (unsigned)p[0];
+        key_hash = p[1];
+        bins = p[2];
+        seeds = p + 3;
+        hashes = seeds + bins;
+    }
+
+    unsigned r;
+    uint64_t key_hash;
+    uint64_t bins;
+    uint64_t const * seeds;
+    uint64_t const * hashes;
+};
+
+template <typename X, template <typename> typename H>
+auto contains(
+    trapdoor<X> const & x,
+    shared_dhs_view<H> const & xs)
+{
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_CONTAINS);
+    if (x.key_hash != xs.key_hash)
+    {
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+        throw invalid_argument("secret key mismatch");
+    }
+
+    auto const b = dhs_bin(x.value_hash, xs.bins);
+    return approximate_pos_neg<2,bool>{
+        singular_hash_fpr(xs.r),     // fpr
+        0.,                          // fnr
+        singular_hash<H>(x.value_hash, xs.seeds[b], xs.r) == xs.hashes[b]};
+}
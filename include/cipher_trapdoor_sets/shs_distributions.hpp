@@ -0,0 +1,376 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+using std::invalid_argument;
+using std::size_t;
+using std::vector;
+
+/**
+ * The probability distributions of the singular hash set (SHS) and the
+ * k-disjoint hash set (k-DHS) of paper/sections/shs.tex and the appendix,
+ * evaluated numerically at run time.
+ *
+ * Every distribution is computed in log space, so that probabilities far
+ * below the smallest double (e.g., the probability eps^(m-1) that a trial of
+ * the seed search succeeds, which is 2^-1200 for m = 101 and r = 12) do not
+ * underflow to zero and tail probabilities near one do not round to one.
+ *
+ *     log_binomial_pmf(x, n, p), log_binomial_cdf(t, n, p)
+ *         log b(x | n,p) and log B(t | n,p) of X ~ Bin(n,p). The cdf sums
+ *         whichever tail is smaller in log-sum-exp form, starting next to
+ *         the mode and stopping once the terms fall below the double
+ *         precision of the sum, so it costs O(sqrt(n p (1-p))) terms.
+ *
+ *     max_binomial_cdf(t, u, p, k), max_binomial_pmf, expected_max_binomial
+ *         the distribution of T = max{Q_1,...,Q_k} for independent
+ *         Q_i ~ Bin(u,p), with F_T(t) = B(t | u,p)^k.
+ *
+ *     rate_distortion_cdf(t, u, r)
+ *         F_T(t | u,r) = B(t | u,.5)^(2^(r+1) - 1), the largest number of
+ *         the u elements that one of the 2^(r+1) - 1 seeds of at most r
+ *         bits hashes correctly (shs.tex).
+ *
+ *     seed_bit_length_pmf(n, log2_p), expected_seed_bits(log2_p)
+ *         the distribution of the seed bit length N = floor(log2 Q) of a
+ *         seed search with Q ~ Geom(p) trials,
+ *             P[N = n] = q^(2^n - 1) (1 - q^(2^n)), q = 1 - p
+ *         (the probability mass of random bit length of the appendix).
+ *
+ *     expected_shs_bits(m, r), expected_dhs_trials(m, k, r),
+ *     log2_expected_dhs_trials(m, k, r), expected_dhs_bits(m, k, r)
+ *         the expected encoded bit length of an SHS, and the expected
+ *         number of trials (or its log2, finite for every m, k and r) and
+ *         bit length of a k-DHS over the Bin(m, 1/b) distribution of its
+ *         bin sizes.
+ *
+ * The batch forms take a grid of parameters and write one result per
+ * point, for evaluating a model over a parameter sweep. Their loops have
+ * no dependence between points, so the closed forms (e.g., the
+ * asymptotic seed bit length of small p) are vectorized by the compiler
+ * and the rest reduce to one series per point.
+ */
+
+constexpr double LOG_ZERO = -std::numeric_limits<double>::infinity();
+
+/**
+ * log(e^a + e^b) without overflow or underflow.
+ */
+inline double log_sum_exp(double a, double b)
+{
+    if (a < b)
+        std::swap(a, b);
+    return a == LOG_ZERO ? a : a + std::log1p(std::exp(b - a));
+}
+
+/**
+ * log(1 - e^a) for a <= 0, accurate for a near 0 and for a very negative
+ * (Maechler, "Accurately computing log(1 - exp(-|a|))").
+ */
+inline double log1mexp(double a)
+{
+    return a > -0.6931471805599453 ? std::log(-std::expm1(a)) : std::log1p(-std::exp(a));
+}
+
+inline double log_choose(size_t n, size_t x)
+{
+    return std::lgamma(n + 1.) - std::lgamma(x + 1.) - std::lgamma(n - x + 1.);
+}
+
+inline double log_binomial_pmf(size_t x, size_t n, double p)
+{
+    if (x > n)
+        return LOG_ZERO;
+    if (p <= 0)
+        return x == 0 ? 0. : LOG_ZERO;
+    if (p >= 1)
+        return x == n ? 0. : LOG_ZERO;
+    return log_choose(n, x) + x * std::log(p) + (n - x) * std::log1p(-p);
+}
+
+/**
+ * log P[X <= t] for X ~ Bin(n,p).
+ */
+inline double log_binomial_cdf(size_t t, size_t n, double p)
+{
+    if (t >= n)
+        return 0.;
+    if (p <= 0)
+        return 0.;
+    if (p >= 1)
+        return LOG_ZERO;
+
+    // the terms decrease away from the mode, so each tail is summed from
+    // the end nearest the mode and stops once a term no longer registers.
+    auto const mode = (size_t)std::floor((n + 1) * p);
+    auto const tail = [&](size_t first, size_t last, bool down)
+    {
+        double s = LOG_ZERO;
+        for (auto x = first;; down ? --x : ++x)
+        {
+            auto const l = log_binomial_pmf(x, n, p);
+            s = log_sum_exp(s, l);
+            if (x == last || l < s - 40)
+                break;
+        }
+        return s;
+    };
+
+    if (t < mode)
+        return tail(t, 0, true);
+    return log1mexp(tail(t + 1, n, false));
+}
+
+inline double binomial_cdf(size_t t, size_t n, double p)
+{
+    return std::exp(log_binomial_cdf(t, n, p));
+}
+
+/**
+ * P[T <= t] for the maximum T of k independent Bin(u,p) variables.
+ */
+inline double max_binomial_cdf(size_t t, size_t u, double p, double k)
+{
+    return std::exp(k * log_binomial_cdf(t, u, p));
+}
+
+/**
+ * P[T = t] = F_T(t) - F_T(t-1), computed as F_T(t) (1 - F_T(t-1)/F_T(t))
+ * so that the difference does not cancel when both are near one.
+ */
+inline double max_binomial_pmf(size_t t, size_t u, double p, double k)
+{
+    auto const l = k * log_binomial_cdf(t, u, p);
+    if (t == 0)
+        return std::exp(l);
+    auto const l0 = k * log_binomial_cdf(t - 1, u, p);
+    return l == LOG_ZERO ? 0. : std::exp(l) * -std::expm1(l0 - l);
+}
+
+/**
+ * E[T] = sum over t < u of P[T > t], for the maximum T of k independent
+ * Bin(u,p) variables. The terms are one below the bulk of the distribution
+ * of T and vanish above it, so the sum skips to the bulk by bisection on
+ * the cdf and stops once the terms vanish.
+ */
+inline double expected_max_binomial(size_t u, double p, double k)
+{
+    if (u == 0)
+        return 0.;
+
+    // the least t with F_T(t) > 2^-60; every t below it contributes 1.
+    size_t lo = 0, hi = u;
+    while (lo < hi)
+    {
+        auto const mid = lo + (hi - lo) / 2;
+        if (k * log_binomial_cdf(mid, u, p) > -60 * 0.6931471805599453)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    double e = (double)lo;
+    for (auto t = lo; t < u; ++t)
+    {
+        auto const tail = -std::expm1(k * log_binomial_cdf(t, u, p));
+        e += tail;
+        if (tail < 1e-17)
+            break;
+    }
+    return e;
+}
+
+/**
+ * F_T(t | u,r) = B(t | u,.5)^(2^(r+1) - 1) of shs.tex.
+ */
+inline double rate_distortion_cdf(size_t t, size_t u, unsigned r)
+{
+    return max_binomial_cdf(t, u, .5, std::ldexp(1., (int)r + 1) - 1);
+}
+
+/**
+ * The expected error rate (u - E[T]) / u of the best of the 2^(r+1) - 1
+ * seeds of at most r bits on u elements.
+ */
+inline double expected_rate_distortion(size_t u, unsigned r)
+{
+    return u == 0 ? 0. :
+        1 - expected_max_binomial(u, .5, std::ldexp(1., (int)r + 1) - 1) / u;
+}
+
+/**
+ * P[N = n] for the seed bit length N = floor(log2 Q), Q ~ Geom(p), with p
+ * given as log2 p.
+ */
+inline double seed_bit_length_pmf(unsigned n, double log2_p)
+{
+    if (log2_p >= 0)
+        return n == 0 ? 1. : 0.;
+
+    // log q = log(1 - p), which is -p to double precision for tiny p.
+    auto const log_p = log2_p * 0.6931471805599453;
+    auto const lq = log1mexp(log_p);
+    auto const a = (std::ldexp(1., (int)n) - 1) * lq;
+    auto const b = std::ldexp(1., (int)n) * lq;
+    return std::exp(a + log1mexp(b));
+}
+
+/**
+ * E[floor(log2 Q)] for Q ~ Geom(p), with p given as log2 p. Since
+ * P[N >= n] = (1-p)^(2^n - 1) is negligible once 2^n p is large, the sum
+ * stops a few terms past log2(1/p). For p below 2^-60, Q p is exponential
+ * to double precision and
+ *     E[floor(log2 Q)] = log2(1/p) - gamma log2 e - 1/2
+ * up to a periodic term of amplitude below 10^-5.
+ */
+inline double expected_seed_bits(double log2_p)
+{
+    if (log2_p >= 0)
+        return 0.;
+    if (log2_p < -60)
+        return -log2_p - 0.5772156649015329 / 0.6931471805599453 - .5;
+
+    auto const lq = std::log1p(-std::exp2(log2_p));
+    auto const last = (int)std::ceil(-log2_p) + 8;
+    double e = 0;
+    for (int n = 1; n <= last; ++n)
+        e += std::exp((std::ldexp(1., n) - 1) * lq);
+    return e;
+}
+
+inline void expected_seed_bits(double const * log2_p, double * out, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        out[i] = expected_seed_bits(log2_p[i]);
+}
+
+/**
+ * The expected bit length r + E[N] of the singular hash set of m elements
+ * with r-bit hashes.
+ */
+inline double expected_shs_bits(size_t m, unsigned r)
+{
+    if (m == 0)
+        throw invalid_argument("singular hash set of the empty set");
+    return r + expected_seed_bits(-(double)r * (m - 1));
+}
+
+/**
+ * The log2 of the expected total number of trials of the seed searches of
+ * a k-DHS of m elements with r-bit hashes and b = ceil(m/k) bins. A bin of
+ * C >= 1 elements takes eps^-(C-1) trials in expectation, and over
+ * C ~ Bin(m, q = 1/b)
+ *     E[eps^-(C-1) [C >= 1]] = eps ((1 - q + q/eps)^m - (1 - q)^m).
+ * The sum over the bins is evaluated in log space, so the result is finite
+ * however far the expectation is beyond the range of a double, e.g., for
+ * the 2^(2^26) trials of a single bin of m = 2^20 elements with r = 64.
+ */
+inline double log2_expected_dhs_trials(size_t m, size_t k, unsigned r)
+{
+    if (m == 0 || k == 0)
+        throw invalid_argument("k-disjoint hash set needs m > 0 and k > 0");
+
+    auto const b = (double)((m + k - 1) / k);
+    if (b == 1)
+        return (double)r * (m - 1);
+    auto const q = 1 / b;
+    auto const la = m * std::log1p(q * (std::exp2((double)r) - 1));
+    auto const lb = m * std::log1p(-q);
+    return std::log2(b) - r + (la + std::log1p(-std::exp(lb - la))) / std::log(2.);
+}
+
+/**
+ * The expected total number of trials of the seed searches of a k-DHS,
+ * 2^log2_expected_dhs_trials(m, k, r). It is +infinity once the expectation
+ * exceeds the largest double, i.e., from about 2^1024 trials on; a model
+ * that must order such sets uses the log2 form.
+ */
+inline double expected_dhs_trials(size_t m, size_t k, unsigned r)
+{
+    return std::exp2(log2_expected_dhs_trials(m, k, r));
+}
+
+/**
+ * The expected bit length b E[r + N_C] of a k-DHS of m elements with r-bit
+ * hashes, where N_C is the seed bit length of a bin of C ~ Bin(m, 1/b)
+ * elements. The sum runs outwards from the mode of C until the terms
+ * vanish.
+ */
+inline double expected_dhs_bits(size_t m, size_t k, unsigned r)
+{
+    if (m == 0 || k == 0)
+        throw invalid_argument("k-disjoint hash set needs m > 0 and k > 0");
+
+    auto const bins = (m + k - 1) / k;
+    if (bins == 1)
+        return expected_shs_bits(m, r);
+
+    auto const q = 1. / bins;
+    auto const term = [&](size_t c)
+    {
+        auto const w = std::exp(log_binomial_pmf(c, m, q));
+        return std::make_pair(w, c < 2 ? 0. : w * expected_seed_bits(-(double)r * (c - 1)));
+    };
+
+    auto const mode = std::min(m, (size_t)std::floor((m + 1) * q));
+    double seed_bits = 0;
+    for (auto c = mode; c <= m; ++c)
+    {
+        auto const [w, s] = term(c);
+        seed_bits += s;
+        if (w < 1e-18 && c > mode)
+            break;
+    }
+    for (auto c = mode; c-- > 2;)
+    {
+        auto const [w, s] = term(c);
+        seed_bits += s;
+        if (w < 1e-18)
+            break;
+    }
+    return bins * (r + seed_bits);
+}
+
+/**
+ * The moments of an SHS or k-DHS at one point of a parameter grid.
+ */
+struct shs_grid_point
+{
+    size_t m;
+    size_t k;
+    unsigned r;
+    double trials;
+    double log2_trials;
+    double bits;
+    double bits_per_element;
+};
+
+/**
+ * Evaluates the k-DHS models over the grid ms x ks x rs, in row-major
+ * order (r varies fastest). A k of 0 denotes the SHS, a single bin.
+ */
+inline vector<shs_grid_point> evaluate_shs_grid(
+    vector<size_t> const & ms,
+    vector<size_t> const & ks,
+    vector<unsigned> const & rs)
+{
+    vector<shs_grid_point> grid;
+    grid.reserve(ms.size() * ks.size() * rs.size());
+    for (auto m : ms)
+        for (auto k : ks)
+            for (auto r : rs)
+            {
+                auto const kk = k == 0 ? m : k;
+                auto const log2_trials = log2_expected_dhs_trials(m, kk, r);
+                shs_grid_point g{m, k, r, std::exp2(log2_trials), log2_trials,
+                    expected_dhs_bits(m, kk, r), 0.};
+                g.bits_per_element = g.bits / m;
+                grid.push_back(g);
+            }
+    return grid;
+}
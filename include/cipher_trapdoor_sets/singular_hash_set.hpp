@@ -0,0 +1,389 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+#include "memory_usage.hpp"
+#include "operation_metrics.hpp"
+#include "perf_counters.hpp"
+#include "trapdoor.hpp"
+#include "trapdoor_key.hpp"
+using std::invalid_argument;
+using std::nullopt;
+using std::optional;
+using std::size_t;
+using std::vector;
+
+/**
+ * The singular hash set (SHS) and the k-disjoint hash set (k-DHS) over
+ * trapdoors, as described in paper/sections/shs.tex.
+ *
+ * Let A = {a1,...,am} be a set of trapdoor<X> values and let
+ *     h_r(a,n) := tr(hash(a' # n'), r)
+ * be the r-bit truncation of a hash of a concatenated with the seed n. The
+ * singular hash set of A is the pair (n,h) where n is the first seed in the
+ * sequence 0,1,2,... such that
+ *     h_r(a1,n) = h_r(a2,n) = ... = h_r(am,n) =: h,
+ * i.e., every element of A collides on the singular hash h. Membership is
+ * then
+ *     contains(x, (n,h)) := h_r(x,n) == h,
+ * which has no false negatives and a false positive rate eps = 2^-r.
+ *
+ * Construction is a seed search. A trial succeeds with probability
+ * eps^(m-1), so the number of trials is geometrically distributed,
+ *     Q ~ Geom(eps^(m-1)),
+ * with an expected eps^-(m-1) trials. The n-th trial (counting from 1) maps
+ * to a bit string of length floor(log2 n), so the encoding (n',h) has a bit
+ * length of r + floor(log2 Q), whose expectation approaches the lower-bound
+ * of -log2 eps bits per element.
+ *
+ * Since the expected number of trials grows exponentially in m, the k-DHS
+ * bins the elements into about m/k bins by hash and builds a singular hash
+ * set per bin. A bin of c elements needs eps^-(c-1) expected trials, and
+ * membership tests the singular hash of the bin the element hashes to.
+ *
+ * Both constructors take a trial budget; if a seed is not found within the
+ * budget, construction fails with nullopt rather than running forever.
+ *
+ * The k-DHS holds its seeds and hashes in vectors with an allocator A, and
+ * allocate_disjoint_hash_set builds it (and its temporary bins) with a
+ * given allocator, e.g., a polymorphic_allocator over a request_arena
+ * (request_arena.hpp).
+ */
+
+/**
+ * The number of bits in the bijective binary encoding of the 0-based seed
+ * n, i.e., floor(log2(n+1)).
+ */
+inline unsigned seed_bit_length(size_t n)
+{
+    unsigned b = 0;
+    for (auto q = n + 1; q > 1; q >>= 1)
+        ++b;
+    return b;
+}
+
+/**
+ * The 64-bit finalizer of MurmurHash3. hash_combine alone is not enough to
+ * make the low bits of h_r depend on the seed when H<size_t> is the
+ * identity (as std::hash<size_t> is in common standard libraries).
+ */
+inline std::uint64_t fmix64(std::uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+/**
+ * The false positive rate 2^-r of r-bit singular hashes, built from its
+ * exponent bits since std::pow costs more than the probe itself.
+ */
+inline double singular_hash_fpr(unsigned r)
+{
+    auto const bits = (std::uint64_t)(1023 - r) << 52;
+    double fpr;
+    std::memcpy(&fpr, &bits, sizeof(fpr));
+    return fpr;
+}
+
+template <template <typename> typename H = std::hash>
+size_t singular_hash(size_t value_hash, size_t seed, unsigned r)
+{
+    auto s = seed;
+    hash_combine<H>(s, value_hash);
+    s = (size_t)fmix64(s);
+    return r >= 64 ? s : s & ((size_t(1) << r) - 1);
+}
+
+template <typename X, template <typename> typename H = std::hash>
+struct singular_hash_set
+{
+    using value_type = X;
+
+    size_t seed;
+    size_t hash;
+    unsigned r;
+    size_t key_hash;
+};
+
+/**
+ * Statistics of a construction, for comparing the implementation against
+ * the geometric model.
+ */
+struct shs_construction_stats
+{
+    size_t trials;
+    unsigned bit_length;
+};
+
+/**
+ * Searches for the singular hash set of the trapdoors [begin,end) with
+ * r-bit singular hashes. Returns nullopt if no seed is found in max_trials
+ * trials. If stats is not null, the number of trials (including the
+ * successful one) and the bit length of the encoding are written to it.
+ */
+template <
+    template <typename> typename H = std::hash,
+    typename I
+>
+auto make_singular_hash_set(
+    I begin,
+    I end,
+    unsigned r,
+    size_t max_trials,
+    shs_construction_stats * stats = nullptr)
+{
+    using X = typename std::iterator_traits<I>::value_type::value_type;
+    using result = optional<singular_hash_set<X,H>>;
+
+    if (begin == end)
+        throw invalid_argument("singular hash set of the empty set");
+    if (r == 0 || r > 64)
+        throw invalid_argument("singular hash width must be in [1,64]");
+
+    CIPHER_TRAPDOOR_SETS_PERF_SCOPE("make_singular_hash_set",
+        std::distance(begin, end));
+    auto const key_hash = begin->key_hash;
+    for (auto i = begin; i != end; ++i)
+    {
+        if (i->key_hash != key_hash)
+        {
+            CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+            throw invalid_argument("secret key mismatch");
+        }
+    }
+
+    for (size_t n = 0; n < max_trials; ++n)
+    {
+        auto const h = singular_hash<H>(begin->value_hash, n, r);
+        auto i = std::next(begin);
+        while (i != end && singular_hash<H>(i->value_hash, n, r) == h)
+            ++i;
+
+        if (i == end)
+        {
+            if (stats)
+                *stats = shs_construction_stats{n + 1, r + seed_bit_length(n)};
+            return result(singular_hash_set<X,H>{n, h, r, key_hash});
+        }
+    }
+
+    if (stats)
+        *stats = shs_construction_stats{max_trials, 0};
+    return result(nullopt);
+}
+
+template <typename X, template <typename> typename H>
+auto contains(
+    trapdoor<X> const & x,
+    singular_hash_set<X,H> const & xs)
+{
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_CONTAINS);
+    if (x.key_hash != xs.key_hash)
+    {
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+        throw invalid_argument("secret key mismatch");
+    }
+
+    return approximate_pos_neg<2,bool>{
+        singular_hash_fpr(xs.r),     // fpr
+        0.,                          // fnr
+        singular_hash<H>(x.value_hash, xs.seed, xs.r) == xs.hash};
+}
+
+template <typename X, template <typename> typename H>
+unsigned bit_length(singular_hash_set<X,H> const & xs)
+{
+    return xs.r + seed_bit_length(xs.seed);
+}
+
+template <typename X, template <typename> typename H>
+memory_footprint memory_usage(singular_hash_set<X,H> const & xs)
+{
+    return memory_footprint{sizeof(xs), 0, bit_length(xs)};
+}
+
+/**
+ * The k-disjoint hash set: one singular hash set per bin.
+ */
+template <
+    typename X,
+    template <typename> typename H = std::hash,
+    typename A = std::allocator<size_t>
+>
+struct disjoint_hash_set
+{
+    using value_type = X;
+    using allocator_type = A;
+
+    vector<size_t,A> seeds;
+    vector<size_t,A> hashes;
+    unsigned r;
+    size_t key_hash;
+};
+
+template <typename X, template <typename> typename H = std::hash>
+using pmr_disjoint_hash_set = disjoint_hash_set<X,H,std::pmr::polymorphic_allocator<size_t>>;
+
+/**
+ * The bin of a trapdoor in a k-DHS with the given number of bins. The bin is
+ * chosen by the high bits of the value hash so that it is independent of
+ * the singular hashes, which are derived from a hash_combine of the value
+ * hash.
+ */
+inline size_t dhs_bin(size_t value_hash, size_t bins)
+{
+    return (size_t)(((unsigned __int128)value_hash * bins) >> 64);
+}
+
+/**
+ * Builds the k-DHS of the trapdoors [begin,end) with about k elements per
+ * bin and r-bit singular hashes, allocating the set and the temporary bins
+ * with alloc. max_trials bounds the seed search of each bin. If stats is not
+ * null, the per-bin statistics are appended to it, in bin order (bins with
+ * no elements have zero trials).
+ */
+template <
+    template <typename> typename H = std::hash,
+    typename A,
+    typename I
+>
+auto allocate_disjoint_hash_set(
+    A const & alloc,
+    I begin,
+    I end,
+    size_t k,
+    unsigned r,
+    size_t max_trials,
+    vector<shs_construction_stats> * stats = nullptr)
+{
+    using T = typename std::iterator_traits<I>::value_type;
+    using X = typename T::value_type;
+    using S = typename std::allocator_traits<A>::template rebind_alloc<size_t>;
+    using B = typename std::allocator_traits<A>::template rebind_alloc<T>;
+    using V = typename std::allocator_traits<A>::template rebind_alloc<vector<T,B>>;
+    using result = optional<disjoint_hash_set<X,H,S>>;
+
+    auto const m = (size_t)std::distance(begin, end);
+    if (m == 0 || k == 0)
+        throw invalid_argument("k-disjoint hash set needs m > 0 and k > 0");
+    CIPHER_TRAPDOOR_SETS_PERF_SCOPE("make_disjoint_hash_set", m);
+
+    auto const bins = (m + k - 1) / k;
+    vector<vector<T,B>,V> members(bins, vector<T,B>(B(alloc)), V(alloc));
+    for (auto i = begin; i != end; ++i)
+    {
+        if (i->key_hash != begin->key_hash)
+        {
+            CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+            throw invalid_argument("secret key mismatch");
+        }
+        members[dhs_bin(i->value_hash, bins)].push_back(*i);
+    }
+
+    disjoint_hash_set<X,H,S> xs{vector<size_t,S>(bins, S(alloc)),
+        vector<size_t,S>(bins, S(alloc)), r, begin->key_hash};
+    for (size_t b = 0; b < bins; ++b)
+    {
+        if (members[b].empty())
+        {
+            if (stats)
+                stats->push_back(shs_construction_stats{0, r});
+            continue;
+        }
+
+        shs_construction_stats s;
+        auto shs = make_singular_hash_set<H>(members[b].begin(),
+            members[b].end(), r, max_trials, &s);
+        if (stats)
+            stats->push_back(s);
+        if (!shs)
+            return result(nullopt);
+
+        xs.seeds[b] = shs->seed;
+        xs.hashes[b] = shs->hash;
+    }
+    return result(std::move(xs));
+}
+
+template <
+    template <typename> typename H = std::hash,
+    typename I
+>
+auto make_disjoint_hash_set(
+    I begin,
+    I end,
+    size_t k,
+    unsigned r,
+    size_t max_trials,
+    vector<shs_construction_stats> * stats = nullptr)
+{
+    return allocate_disjoint_hash_set<H>(std::allocator<size_t>(), begin, end,
+        k, r, max_trials, stats);
+}
+
+/**
+ * Builds the k-DHS in the memory resource mr, e.g., a request arena.
+ */
+template <
+    template <typename> typename H = std::hash,
+    typename I
+>
+auto make_disjoint_hash_set(
+    std::pmr::memory_resource * mr,
+    I begin,
+    I end,
+    size_t k,
+    unsigned r,
+    size_t max_trials,
+    vector<shs_construction_stats> * stats = nullptr)
+{
+    return allocate_disjoint_hash_set<H>(std::pmr::polymorphic_allocator<size_t>(mr),
+        begin, end, k, r, max_trials, stats);
+}
+
+template <typename X, template <typename> typename H, typename A>
+auto contains(
+    trapdoor<X> const & x,
+    disjoint_hash_set<X,H,A> const & xs)
+{
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_CONTAINS);
+    if (x.key_hash != xs.key_hash)
+    {
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+        throw invalid_argument("secret key mismatch");
+    }
+
+    auto const b = dhs_bin(x.value_hash, xs.seeds.size());
+    return approximate_pos_neg<2,bool>{
+        singular_hash_fpr(xs.r),     // fpr
+        0.,                          // fnr
+        singular_hash<H>(x.value_hash, xs.seeds[b], xs.r) == xs.hashes[b]};
+}
+
+template <typename X, template <typename> typename H, typename A>
+size_t bit_length(disjoint_hash_set<X,H,A> const & xs)
+{
+    size_t bits = 0;
+    for (auto seed : xs.seeds)
+        bits += xs.r + seed_bit_length(seed);
+    return bits;
+}
+
+template <typename X, template <typename> typename H, typename A>
+memory_footprint memory_usage(disjoint_hash_set<X,H,A> const & xs)
+{
+    auto const heap = heap_bytes(xs.seeds) + heap_bytes(xs.hashes);
+    return memory_footprint{sizeof(xs) + heap, heap, bit_length(xs)};
+}
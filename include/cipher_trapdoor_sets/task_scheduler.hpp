@@ -0,0 +1,617 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+using std::size_t;
+using std::vector;
+
+/**
+ * The library-wide task scheduler of the parallel trapdoor algorithms.
+ *
+ * Every parallel entry point of the library runs through
+ *     parallel_for(begin, end, grain, f)      f(lo, hi) on subranges
+ *     parallel_reduce(begin, end, grain, identity, map, combine)
+ * on the current executor, so that parallel seed searches, set builds and
+ * batch hashing share one set of threads instead of oversubscribing the
+ * cores with a pool each. The one exception is the lanes of run_pipeline
+ * (trapdoor_pipeline.hpp), which may block and so keep threads of their
+ * own; their stages' parallel_for still runs here.
+ *
+ * The default executor is a work_stealing_scheduler with one worker per
+ * hardware thread (optionally pinned, worker i to the i-th CPU of the
+ * process's affinity mask). Each worker owns a Chase-Lev deque (Chase and
+ * Lev, "Dynamic circular work-stealing deque", with the memory orderings of
+ * Le et al., "Correct and efficient work-stealing for weak memory models"):
+ * the owner pushes and pops tasks at the bottom without contention, and idle
+ * workers steal from the top of a random victim. A parallel_for splits its
+ * range in halves, pushing the upper half as a task and recursing on the
+ * lower, until a range holds at most grain items; a worker that waits for a
+ * stolen half runs other tasks meanwhile, so nested parallel regions do not
+ * block workers. Tasks live on the stack of the worker that spawned them, so
+ * a parallel_for does not allocate.
+ *
+ * A call from a thread that is not a worker of the scheduler is injected
+ * into a shared queue and the calling thread blocks until it completes.
+ *
+ * An embedding service that runs its own thread pool installs it with
+ * set_executor. A foreign executor only has to implement bulk(n, f), which
+ * runs f(0),...,f(n-1) (in any order and on any threads) and returns once
+ * all have returned; parallel_for then hands it ranges of grain items.
+ *
+ * If f throws, the remaining ranges of the call are skipped and the first
+ * exception is rethrown from parallel_for.
+ */
+
+/**
+ * The interface of an executor for the library's parallel algorithms.
+ */
+struct executor
+{
+    virtual ~executor() = default;
+
+    /**
+     * The number of tasks that can run at once.
+     */
+    virtual size_t concurrency() const = 0;
+
+    /**
+     * Runs f(0),...,f(n-1) and returns once all of them have returned.
+     */
+    virtual void bulk(size_t n, std::function<void(size_t)> const & f) = 0;
+};
+
+/**
+ * A task of the scheduler. run is called once by the thread that takes the
+ * task, and sets done (with release ordering) when the task is complete.
+ */
+struct scheduler_task
+{
+    void (*run)(scheduler_task *) = nullptr;
+    std::atomic<bool> done{false};
+};
+
+/**
+ * The Chase-Lev deque of a worker, holding pointers to tasks. The ring
+ * doubles when full; retired rings are kept until the deque is destroyed,
+ * since a concurrent thief may still read from them.
+ */
+class chase_lev_deque
+{
+public:
+    explicit chase_lev_deque(size_t capacity = 256)
+    {
+        rings.emplace_back(new ring(capacity));
+        current.store(rings.back().get(), std::memory_order_relaxed);
+    }
+
+    chase_lev_deque(chase_lev_deque const &) = delete;
+    chase_lev_deque & operator=(chase_lev_deque const &) = delete;
+
+    /**
+     * Owner only.
+     */
+    void push(scheduler_task * t)
+    {
+        auto const b = bottom.load(std::memory_order_relaxed);
+        auto const f = top.load(std::memory_order_acquire);
+        auto * a = current.load(std::memory_order_relaxed);
+        if (b - f > (std::int64_t)a->mask)
+            a = grow(a, f, b);
+        a->put(b, t);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Owner only. Returns the most recently pushed task, or nullptr.
+     */
+    scheduler_task * pop()
+    {
+        auto const b = bottom.load(std::memory_order_relaxed) - 1;
+        auto * a = current.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto f = top.load(std::memory_order_relaxed);
+
+        if (f > b)
+        {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        auto * t = a->get(b);
+        if (f == b)
+        {
+            // the last task: race the thieves for it.
+            if (!top.compare_exchange_strong(f, f + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed))
+                t = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return t;
+    }
+
+    /**
+     * Any thread. Returns the least recently pushed task, or nullptr if the
+     * deque is empty or the steal lost a race.
+     */
+    scheduler_task * steal()
+    {
+        auto f = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto const b = bottom.load(std::memory_order_acquire);
+        if (f >= b)
+            return nullptr;
+
+        auto * a = current.load(std::memory_order_acquire);
+        auto * t = a->get(f);
+        if (!top.compare_exchange_strong(f, f + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return t;
+    }
+
+    bool empty() const
+    {
+        return bottom.load(std::memory_order_relaxed) <=
+            top.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct ring
+    {
+        explicit ring(size_t capacity) :
+            mask(capacity - 1),
+            slots(new std::atomic<scheduler_task *>[capacity]) {}
+
+        scheduler_task * get(std::int64_t i) const
+        {
+            return slots[i & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(std::int64_t i, scheduler_task * t)
+        {
+            slots[i & mask].store(t, std::memory_order_relaxed);
+        }
+
+        size_t mask;
+        std::unique_ptr<std::atomic<scheduler_task *>[]> slots;
+    };
+
+    ring * grow(ring * a, std::int64_t f, std::int64_t b)
+    {
+        rings.emplace_back(new ring(2 * (a->mask + 1)));
+        auto * grown = rings.back().get();
+        for (auto i = f; i < b; ++i)
+            grown->put(i, a->get(i));
+        current.store(grown, std::memory_order_release);
+        return grown;
+    }
+
+    alignas(64) std::atomic<std::int64_t> top{0};
+    alignas(64) std::atomic<std::int64_t> bottom{0};
+    std::atomic<ring *> current;
+    vector<std::unique_ptr<ring>> rings;
+};
+
+class work_stealing_scheduler;
+
+namespace detail
+{
+    struct scheduler_worker
+    {
+        work_stealing_scheduler * owner = nullptr;
+        size_t index = 0;
+        chase_lev_deque deque;
+        std::uint64_t victim_state = 0;
+    };
+
+    inline thread_local scheduler_worker * this_worker = nullptr;
+
+    /**
+     * The shared state of one parallel_for call.
+     */
+    struct parallel_job
+    {
+        std::atomic<bool> failed{false};
+        std::mutex lock;
+        std::exception_ptr error;
+
+        void fail(std::exception_ptr e)
+        {
+            std::lock_guard<std::mutex> g(lock);
+            if (!error)
+                error = e;
+            failed.store(true, std::memory_order_relaxed);
+        }
+    };
+}
+
+class work_stealing_scheduler : public executor
+{
+public:
+    /**
+     * Starts worker threads (the hardware threads if 0). If pin, worker i
+     * is pinned to the i-th CPU of the process's affinity mask.
+     */
+    explicit work_stealing_scheduler(size_t workers = 0, bool pin = false)
+    {
+        if (workers == 0)
+            workers = std::max(1u, std::thread::hardware_concurrency());
+
+        vector<int> cpus;
+        if (pin)
+        {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+                for (int c = 0; c < CPU_SETSIZE; ++c)
+                    if (CPU_ISSET(c, &mask))
+                        cpus.push_back(c);
+        }
+
+        for (size_t i = 0; i < workers; ++i)
+        {
+            this->workers.emplace_back(new detail::scheduler_worker);
+            this->workers.back()->owner = this;
+            this->workers.back()->index = i;
+            this->workers.back()->victim_state = 0x9e3779b97f4a7c15ull * (i + 1);
+        }
+        for (size_t i = 0; i < workers; ++i)
+        {
+            threads.emplace_back([this, i] { work(*this->workers[i]); });
+            if (!cpus.empty())
+            {
+                cpu_set_t one;
+                CPU_ZERO(&one);
+                CPU_SET(cpus[i % cpus.size()], &one);
+                pthread_setaffinity_np(threads.back().native_handle(), sizeof(one), &one);
+            }
+        }
+    }
+
+    work_stealing_scheduler(work_stealing_scheduler const &) = delete;
+    work_stealing_scheduler & operator=(work_stealing_scheduler const &) = delete;
+
+    ~work_stealing_scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto & t : threads)
+            t.join();
+    }
+
+    size_t concurrency() const override { return workers.size(); }
+
+    void bulk(size_t n, std::function<void(size_t)> const & f) override
+    {
+        run_range(0, n, 1, [&](size_t lo, size_t hi)
+        {
+            for (auto i = lo; i < hi; ++i)
+                f(i);
+        });
+    }
+
+    /**
+     * Runs f(lo, hi) over subranges of [begin,end) of at most grain items.
+     */
+    template <typename F>
+    void run_range(size_t begin, size_t end, size_t grain, F const & f)
+    {
+        if (begin >= end)
+            return;
+
+        detail::parallel_job job;
+        auto * w = detail::this_worker;
+        if (w && w->owner == this)
+            split(*w, begin, end, std::max<size_t>(1, grain), f, job);
+        else
+        {
+            range_task<F> root;
+            root.set(this, begin, end, std::max<size_t>(1, grain), &f, &job);
+            root.external = true;
+            inject(&root);
+
+            std::unique_lock<std::mutex> g(lock);
+            finished.wait(g, [&] { return root.done.load(std::memory_order_acquire); });
+        }
+
+        if (job.error)
+            std::rethrow_exception(job.error);
+    }
+
+private:
+    template <typename F>
+    struct range_task : scheduler_task
+    {
+        work_stealing_scheduler * scheduler;
+        size_t lo, hi, grain;
+        F const * f;
+        detail::parallel_job * job;
+        bool external = false;
+
+        void set(work_stealing_scheduler * s, size_t l, size_t h, size_t g,
+            F const * fn, detail::parallel_job * j)
+        {
+            run = &execute;
+            scheduler = s;
+            lo = l;
+            hi = h;
+            grain = g;
+            f = fn;
+            job = j;
+        }
+
+        static void execute(scheduler_task * t)
+        {
+            auto * r = static_cast<range_task *>(t);
+            r->scheduler->split(*detail::this_worker, r->lo, r->hi, r->grain, *r->f, *r->job);
+            if (r->external)
+            {
+                std::lock_guard<std::mutex> g(r->scheduler->lock);
+                r->done.store(true, std::memory_order_release);
+                r->scheduler->finished.notify_all();
+            }
+            else
+                r->done.store(true, std::memory_order_release);
+        }
+    };
+
+    /**
+     * Splits [lo,hi) in halves, spawning the upper halves, runs the lowest
+     * range, and then waits for the spawned halves, running other tasks
+     * while a stolen half is still running.
+     */
+    template <typename F>
+    void split(detail::scheduler_worker & w, size_t lo, size_t hi, size_t grain,
+        F const & f, detail::parallel_job & job)
+    {
+        range_task<F> children[64];
+        size_t k = 0;
+        while (hi - lo > grain && k < 64)
+        {
+            auto const mid = lo + (hi - lo) / 2;
+            children[k].set(this, mid, hi, grain, &f, &job);
+            spawn(w, &children[k]);
+            ++k;
+            hi = mid;
+        }
+
+        if (!job.failed.load(std::memory_order_relaxed))
+        {
+            try
+            {
+                f(lo, hi);
+            }
+            catch (...)
+            {
+                job.fail(std::current_exception());
+            }
+        }
+
+        while (k > 0)
+        {
+            auto & c = children[--k];
+            while (!c.done.load(std::memory_order_acquire))
+            {
+                if (auto * t = w.deque.pop())
+                    t->run(t);
+                else if (auto * t = find_work(w))
+                    t->run(t);
+                else
+                    std::this_thread::yield();
+            }
+        }
+    }
+
+    void spawn(detail::scheduler_worker & w, scheduler_task * t)
+    {
+        w.deque.push(t);
+        signal();
+    }
+
+    void inject(scheduler_task * t)
+    {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            injected.push_back(t);
+            pending.fetch_add(1, std::memory_order_relaxed);
+        }
+        signal();
+    }
+
+    void signal()
+    {
+        epoch.fetch_add(1, std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_seq_cst) > 0)
+        {
+            std::lock_guard<std::mutex> g(lock);
+            wake.notify_one();
+        }
+    }
+
+    /**
+     * Steals from the other workers, starting at a random victim, and then
+     * takes from the injection queue.
+     */
+    scheduler_task * find_work(detail::scheduler_worker & w)
+    {
+        auto const n = workers.size();
+        auto & s = w.victim_state;
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        auto const first = (size_t)(s % n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            auto & v = *workers[(first + i) % n];
+            if (&v == &w)
+                continue;
+            if (auto * t = v.deque.steal())
+                return t;
+        }
+
+        if (pending.load(std::memory_order_relaxed) == 0)
+            return nullptr;
+        std::lock_guard<std::mutex> g(lock);
+        if (injected.empty())
+            return nullptr;
+        auto * t = injected.front();
+        injected.pop_front();
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        return t;
+    }
+
+    void work(detail::scheduler_worker & w)
+    {
+        detail::this_worker = &w;
+        for (;;)
+        {
+            auto const seen = epoch.load(std::memory_order_seq_cst);
+            auto * t = w.deque.pop();
+            if (!t)
+                t = find_work(w);
+            if (t)
+            {
+                t->run(t);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> g(lock);
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            wake.wait(g, [&]
+            {
+                return stopping || epoch.load(std::memory_order_seq_cst) != seen;
+            });
+            sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            if (stopping)
+                return;
+        }
+    }
+
+    vector<std::unique_ptr<detail::scheduler_worker>> workers;
+    vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::deque<scheduler_task *> injected;
+    std::atomic<size_t> pending{0};
+    std::atomic<std::uint64_t> epoch{0};
+    std::atomic<size_t> sleepers{0};
+    bool stopping = false;
+};
+
+/**
+ * The default scheduler, started on first use.
+ */
+inline work_stealing_scheduler & default_scheduler()
+{
+    static work_stealing_scheduler s;
+    return s;
+}
+
+namespace detail
+{
+    inline std::atomic<executor *> installed_executor{nullptr};
+}
+
+/**
+ * Installs the executor of the library's parallel algorithms; nullptr
+ * restores the default scheduler. The executor must outlive its use.
+ */
+inline void set_executor(executor * e)
+{
+    detail::installed_executor.store(e, std::memory_order_release);
+}
+
+inline executor & current_executor()
+{
+    if (auto * e = detail::installed_executor.load(std::memory_order_acquire))
+        return *e;
+    return default_scheduler();
+}
+
+/**
+ * The grain of a range of n items when none is given: about eight ranges
+ * per task slot.
+ */
+inline size_t default_grain(size_t n, executor const & e)
+{
+    return std::max<size_t>(1, n / (8 * std::max<size_t>(1, e.concurrency())));
+}
+
+/**
+ * Runs f(lo, hi) over subranges of [begin,end) of at most grain items (a
+ * grain of 0 picks one) on the current executor.
+ */
+template <typename F>
+void parallel_for(size_t begin, size_t end, size_t grain, F const & f)
+{
+    if (begin >= end)
+        return;
+
+    auto & e = current_executor();
+    if (grain == 0)
+        grain = default_grain(end - begin, e);
+    if (end - begin <= grain)
+    {
+        f(begin, end);
+        return;
+    }
+
+    if (auto * s = dynamic_cast<work_stealing_scheduler *>(&e))
+        return s->run_range(begin, end, grain, f);
+
+    auto const chunks = (end - begin + grain - 1) / grain;
+    e.bulk(chunks, [&](size_t c)
+    {
+        auto const lo = begin + c * grain;
+        f(lo, std::min(end, lo + grain));
+    });
+}
+
+/**
+ * Reduces [begin,end): map(lo, hi) reduces a subrange of at most grain
+ * items to a T, and the partial results are combined in range order with
+ * combine, starting from identity. The result does not depend on the
+ * executor or on how the ranges were scheduled.
+ */
+template <typename T, typename M, typename C>
+T parallel_reduce(size_t begin, size_t end, size_t grain, T identity, M const & map, C const & combine)
+{
+    if (begin >= end)
+        return identity;
+    if (grain == 0)
+        grain = default_grain(end - begin, current_executor());
+
+    auto const chunks = (end - begin + grain - 1) / grain;
+    vector<T> partial(chunks, identity);
+    parallel_for(0, chunks, 1, [&](size_t lo, size_t hi)
+    {
+        for (auto c = lo; c < hi; ++c)
+        {
+            auto const first = begin + c * grain;
+            partial[c] = map(first, std::min(end, first + grain));
+        }
+    });
+
+    auto acc = identity;
+    for (auto & p : partial)
+        acc = combine(acc, p);
+    return acc;
+}
@@ -118,6 +118,17 @@ struct trapdoor
     size_t key_hash;
 };
 
+template <template <typename> typename H>
+struct trapdoor_key;
+
+template <template <typename> typename H>
+trapdoor_key<H> make_trapdoor_key(string_view k);
+
+/**
+ * Expands the secret k and makes the trapdoor of x with it, so the result
+ * equals make_trapdoor(x, make_trapdoor_key<H>(k)) (trapdoor_key.hpp) and
+ * trapdoors from the single and batched paths are comparable.
+ */
 template <
     typename X,
     template <typename> typename H = std::hash
@@ -126,7 +137,7 @@ auto make_trapdoor(
     X const & x,
     string_view k)
 {
-    return trapdoor<X>{x,H<std::string_view>{}(k)};
+    return make_trapdoor(x, make_trapdoor_key<H>(k));
 }
 
 
@@ -193,3 +204,4 @@ bool operator!=(trapdoor<X> const & x, trapdoor<X> const & y)
     return !(x == y);
 }
 
+#include "trapdoor_key.hpp"
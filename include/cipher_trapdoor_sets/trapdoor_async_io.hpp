@@ -0,0 +1,798 @@
+#pragma once
+
+#include <condition_variable>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(CIPHER_TRAPDOOR_SETS_IO_URING)
+#include <liburing.h>
+#endif
+#include "memory_usage.hpp"
+#include "trapdoor.hpp"
+#include "trapdoor_io.hpp"
+using std::condition_variable;
+using std::mutex;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::thread;
+using std::uint8_t;
+using std::unique_lock;
+using std::vector;
+
+/**
+ * Asynchronous block I/O for trapdoor files.
+ *
+ * A scan over a trapdoor file is a sequence of fixed-size blocks. With
+ * blocking reads, the consumer stalls on every block. Instead, a reader
+ * keeps D reads in flight into a ring of D buffers: when the consumer is
+ * done with block i, its buffer is immediately reused to prefetch block
+ * i + D. The consumer receives a view into the buffer itself, so a block is
+ * never copied between the disk and the hashing stage.
+ *
+ * There are two backends:
+ *
+ *     (1) io_uring, when compiled with CIPHER_TRAPDOOR_SETS_IO_URING and
+ *         linked with liburing. The ring of buffers is registered with the
+ *         kernel once and every read is a fixed-buffer read, so there is no
+ *         per-read page pinning and no system call per block beyond the
+ *         submission. This backend has not yet been built against liburing
+ *         or tested; treat it as experimental.
+ *
+ *     (2) A pool of I/O threads issuing pread (or pwrite) calls. This is the
+ *         default, and is used whenever io_uring is not compiled in.
+ *
+ * Buffers are aligned to 4096 bytes, so a block of trapdoor records may be
+ * reinterpreted as an array of trapdoor<X> in place when the in-memory
+ * layout of trapdoor<X> matches the file format (a little-endian platform
+ * with a 64-bit size_t).
+ *
+ * Errors are reported by throwing std::system_error from the consumer's
+ * thread.
+ */
+
+constexpr size_t IO_BUFFER_ALIGNMENT = 4096;
+
+struct io_buffer
+{
+    explicit io_buffer(size_t bytes) :
+        size((bytes + IO_BUFFER_ALIGNMENT - 1) / IO_BUFFER_ALIGNMENT * IO_BUFFER_ALIGNMENT),
+        data((uint8_t *)std::aligned_alloc(IO_BUFFER_ALIGNMENT, size))
+    {
+        if (!data)
+            throw std::bad_alloc();
+    }
+
+    io_buffer(io_buffer const &) = delete;
+    io_buffer & operator=(io_buffer const &) = delete;
+    ~io_buffer() { std::free(data); }
+
+    size_t size;
+    uint8_t * data;
+};
+
+/**
+ * A view of a block that has been read. It remains valid until the next call
+ * to async_block_reader::next.
+ */
+struct io_block
+{
+    uint8_t const * data;
+    size_t size;
+    size_t offset;
+
+    bool empty() const { return size == 0; }
+};
+
+inline void pread_fully(int fd, uint8_t * data, size_t size, size_t offset)
+{
+    while (size > 0)
+    {
+        auto n = ::pread(fd, data, size, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::system_error(errno, std::generic_category(), "pread");
+        if (n == 0)
+            throw runtime_error("unexpected end of file");
+        data += n;
+        size -= (size_t)n;
+        offset += (size_t)n;
+    }
+}
+
+inline void pwrite_fully(int fd, uint8_t const * data, size_t size, size_t offset)
+{
+    while (size > 0)
+    {
+        auto n = ::pwrite(fd, data, size, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::system_error(errno, std::generic_category(), "pwrite");
+        data += n;
+        size -= (size_t)n;
+        offset += (size_t)n;
+    }
+}
+
+/**
+ * Reads the byte range [begin, end) of fd in blocks of block_bytes (the last
+ * block may be shorter), keeping up to depth blocks in flight.
+ */
+struct async_block_reader
+{
+    async_block_reader(
+        int fd,
+        size_t begin,
+        size_t end,
+        size_t block_bytes = size_t(1) << 20,
+        size_t depth = 8,
+        size_t io_threads = 2) :
+        fd(fd),
+        begin(begin),
+        end(end),
+        block_bytes(block_bytes),
+        blocks(count_blocks(begin, end, block_bytes, depth))
+    {
+        for (size_t i = 0; i < depth; ++i)
+            buffers.emplace_back(new io_buffer(block_bytes));
+        slots = vector<slot>(depth);
+
+#if defined(CIPHER_TRAPDOOR_SETS_IO_URING)
+        (void)io_threads;
+        if (int r = io_uring_queue_init((unsigned)depth, &ring, 0); r < 0)
+            throw std::system_error(-r, std::generic_category(), "io_uring_queue_init");
+
+        vector<iovec> iov(depth);
+        for (size_t i = 0; i < depth; ++i)
+            iov[i] = iovec{buffers[i]->data, buffers[i]->size};
+        if (int r = io_uring_register_buffers(&ring, iov.data(), (unsigned)depth); r < 0)
+        {
+            io_uring_queue_exit(&ring);
+            throw std::system_error(-r, std::generic_category(), "io_uring_register_buffers");
+        }
+
+        for (size_t i = 0; i < depth && i < blocks; ++i)
+            submit(i);
+        io_uring_submit(&ring);
+#else
+        for (size_t i = 0; i < depth && i < blocks; ++i)
+            slots[i] = slot{slot::pending, i, 0, false, 0};
+        for (size_t t = 0; t < io_threads; ++t)
+            workers.emplace_back([this] { work(); });
+#endif
+    }
+
+    async_block_reader(async_block_reader const &) = delete;
+    async_block_reader & operator=(async_block_reader const &) = delete;
+
+    ~async_block_reader()
+    {
+#if defined(CIPHER_TRAPDOOR_SETS_IO_URING)
+        // drain reads still in flight before the buffers are released. If
+        // the ring fails, a read may still land in a buffer, so the buffers
+        // are leaked rather than freed under the kernel.
+        try
+        {
+            for (auto & s : slots)
+                while (s.state == slot::pending)
+                    complete_one();
+        }
+        catch (...)
+        {
+            for (auto & b : buffers)
+                b.release();
+        }
+        io_uring_unregister_buffers(&ring);
+        io_uring_queue_exit(&ring);
+#else
+        {
+            unique_lock<mutex> lock(m);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto & w : workers)
+            w.join();
+#endif
+    }
+
+    /**
+     * Returns the next block in order, or an empty block at the end of the
+     * range. The previous block's buffer is recycled for prefetching.
+     */
+    io_block next()
+    {
+        recycle();
+        if (current == blocks)
+            return io_block{nullptr, 0, end};
+
+        auto const i = current % slots.size();
+#if defined(CIPHER_TRAPDOOR_SETS_IO_URING)
+        while (slots[i].state == slot::pending)
+            complete_one();
+#else
+        unique_lock<mutex> lock(m);
+        changed.wait(lock, [&] { return slots[i].state != slot::pending; });
+#endif
+        if (slots[i].state == slot::failed)
+            throw std::system_error(slots[i].error, std::generic_category(), "read");
+
+        held = true;
+        auto const offset = begin + current * block_bytes;
+        return io_block{buffers[i]->data, block_size(current), offset};
+    }
+
+    size_t block_count() const { return blocks; }
+
+    /**
+     * The heap memory of the ring: the buffers and the slot bookkeeping.
+     */
+    size_t buffer_bytes() const
+    {
+        size_t bytes = heap_bytes(buffers) + heap_bytes(slots);
+        for (auto const & b : buffers)
+            bytes += sizeof(io_buffer) + b->size;
+        return bytes;
+    }
+
+private:
+    static size_t count_blocks(size_t begin, size_t end, size_t block_bytes, size_t depth)
+    {
+        if (block_bytes == 0 || depth == 0)
+            throw std::invalid_argument("block size and depth must be positive");
+        if (end < begin)
+            throw std::invalid_argument("block range ends before it begins");
+        return (end - begin + block_bytes - 1) / block_bytes;
+    }
+
+    struct slot
+    {
+        enum state_t { idle, pending, ready, failed };
+
+        state_t state = idle;
+        size_t block = 0;
+        size_t done = 0;
+        bool claimed = false;
+        int error = 0;
+    };
+
+    size_t block_size(size_t b) const
+    {
+        auto const offset = b * block_bytes;
+        return end - begin - offset < block_bytes ? end - begin - offset : block_bytes;
+    }
+
+    // hands the buffer of the block just consumed back for block current + D.
+    void recycle()
+    {
+        if (!held)
+            return;
+        held = false;
+
+        auto const i = current % slots.size();
+        auto const next_block = current + slots.size();
+        ++current;
+        if (next_block >= blocks)
+            return;
+
+#if defined(CIPHER_TRAPDOOR_SETS_IO_URING)
+        submit(next_block);
+        io_uring_submit(&ring);
+#else
+        {
+            unique_lock<mutex> lock(m);
+            slots[i] = slot{slot::pending, next_block, 0, false, 0};
+        }
+        changed.notify_all();
+#endif
+    }
+
+#if defined(CIPHER_TRAPDOOR_SETS_IO_URING)
+    void submit(size_t b)
+    {
+        auto const i = b % slots.size();
+        auto & s = slots[i];
+        s = slot{slot::pending, b, 0, true, 0};
+        auto * sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_read_fixed(sqe, fd, buffers[i]->data,
+            (unsigned)block_size(b), begin + b * block_bytes, (int)i);
+        io_uring_sqe_set_data64(sqe, i);
+    }
+
+    void complete_one()
+    {
+        io_uring_cqe * cqe;
+        if (int r = io_uring_wait_cqe(&ring, &cqe); r < 0)
+            throw std::system_error(-r, std::generic_category(), "io_uring_wait_cqe");
+
+        auto const i = (size_t)io_uring_cqe_get_data64(cqe);
+        auto const res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+
+        auto & s = slots[i];
+        if (res < 0)
+        {
+            s.state = slot::failed;
+            s.error = -res;
+            return;
+        }
+
+        // a short read is completed synchronously; it is rare on regular files.
+        s.done = (size_t)res;
+        auto const want = block_size(s.block);
+        try
+        {
+            if (s.done < want)
+                pread_fully(fd, buffers[i]->data + s.done, want - s.done,
+                    begin + s.block * block_bytes + s.done);
+            s.state = slot::ready;
+        }
+        catch (std::system_error const & e)
+        {
+            s.state = slot::failed;
+            s.error = e.code().value();
+        }
+    }
+
+    io_uring ring;
+#else
+    void work()
+    {
+        unique_lock<mutex> lock(m);
+        for (;;)
+        {
+            size_t i = slots.size();
+            changed.wait(lock, [&]
+            {
+                if (stopping)
+                    return true;
+                for (size_t j = 0; j < slots.size(); ++j)
+                {
+                    auto const & s = slots[j];
+                    if (s.state == slot::pending && !s.claimed)
+                    {
+                        i = j;
+                        return true;
+                    }
+                }
+                return false;
+            });
+            if (stopping)
+                return;
+
+            auto & s = slots[i];
+            s.claimed = true;
+            auto const b = s.block;
+            lock.unlock();
+
+            int error = 0;
+            try
+            {
+                pread_fully(fd, buffers[i]->data, block_size(b), begin + b * block_bytes);
+            }
+            catch (std::system_error const & e)
+            {
+                error = e.code().value();
+            }
+            catch (...)
+            {
+                error = EIO;
+            }
+
+            lock.lock();
+            s.state = error ? slot::failed : slot::ready;
+            s.error = error;
+            changed.notify_all();
+        }
+    }
+
+    vector<thread> workers;
+    mutex m;
+    condition_variable changed;
+    bool stopping = false;
+#endif
+
+    int fd;
+    size_t begin;
+    size_t end;
+    size_t block_bytes;
+    size_t blocks;
+    size_t current = 0;
+    bool held = false;
+    vector<std::unique_ptr<io_buffer>> buffers;
+    vector<slot> slots;
+};
+
+/**
+ * Writes a stream of blocks to fd starting at offset begin, keeping up to
+ * depth writes in flight. The producer fills the buffer returned by acquire
+ * and hands it back with submit; finish waits for every write to complete.
+ */
+struct async_block_writer
+{
+    async_block_writer(
+        int fd,
+        size_t begin,
+        size_t block_bytes = size_t(1) << 20,
+        size_t depth = 4) :
+        fd(fd),
+        offset(begin)
+    {
+        if (block_bytes == 0 || depth == 0)
+            throw std::invalid_argument("block size and depth must be positive");
+
+        for (size_t i = 0; i < depth; ++i)
+        {
+            buffers.emplace_back(new io_buffer(block_bytes));
+            free.push_back(buffers.back().get());
+        }
+        worker = thread([this] { work(); });
+    }
+
+    async_block_writer(async_block_writer const &) = delete;
+    async_block_writer & operator=(async_block_writer const &) = delete;
+
+    ~async_block_writer()
+    {
+        try { finish(); } catch (...) {}
+    }
+
+    /**
+     * Blocks until a buffer is free and returns it.
+     */
+    io_buffer & acquire()
+    {
+        unique_lock<mutex> lock(m);
+        changed.wait(lock, [&] { return !free.empty() || error; });
+        rethrow();
+        auto * b = free.back();
+        free.pop_back();
+        return *b;
+    }
+
+    /**
+     * Queues the first size bytes of an acquired buffer for writing at the
+     * next offset of the stream.
+     */
+    void submit(io_buffer & b, size_t size)
+    {
+        unique_lock<mutex> lock(m);
+        queued.push_back(pending_write{&b, size, offset});
+        offset += size;
+        changed.notify_all();
+    }
+
+    /**
+     * Waits for every queued write and returns the end offset of the stream.
+     */
+    size_t finish()
+    {
+        {
+            unique_lock<mutex> lock(m);
+            if (stopping)
+            {
+                rethrow();
+                return offset;
+            }
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+        unique_lock<mutex> lock(m);
+        rethrow();
+        return offset;
+    }
+
+    /**
+     * The heap memory of the buffers and the write queue.
+     */
+    size_t buffer_bytes() const
+    {
+        size_t bytes = heap_bytes(buffers) + heap_bytes(free) + heap_bytes(queued);
+        for (auto const & b : buffers)
+            bytes += sizeof(io_buffer) + b->size;
+        return bytes;
+    }
+
+private:
+    struct pending_write
+    {
+        io_buffer * buffer;
+        size_t size;
+        size_t offset;
+    };
+
+    void rethrow()
+    {
+        if (error)
+            throw std::system_error(error, std::generic_category(), "write");
+    }
+
+    void work()
+    {
+        unique_lock<mutex> lock(m);
+        for (;;)
+        {
+            changed.wait(lock, [&] { return !queued.empty() || stopping; });
+            if (queued.empty())
+                return;
+
+            auto w = queued.front();
+            queued.erase(queued.begin());
+            lock.unlock();
+
+            int e = 0;
+            try
+            {
+                pwrite_fully(fd, w.buffer->data, w.size, w.offset);
+            }
+            catch (std::system_error const & ex)
+            {
+                e = ex.code().value();
+            }
+
+            lock.lock();
+            if (e && !error)
+                error = e;
+            free.push_back(w.buffer);
+            changed.notify_all();
+        }
+    }
+
+    int fd;
+    size_t offset;
+    vector<std::unique_ptr<io_buffer>> buffers;
+    vector<io_buffer *> free;
+    vector<pending_write> queued;
+    thread worker;
+    mutex m;
+    condition_variable changed;
+    bool stopping = false;
+    int error = 0;
+};
+
+inline memory_footprint memory_usage(async_block_reader const & r)
+{
+    return memory_footprint{sizeof(r) + r.buffer_bytes(), r.buffer_bytes(), 0};
+}
+
+inline memory_footprint memory_usage(async_block_writer const & w)
+{
+    return memory_footprint{sizeof(w) + w.buffer_bytes(), w.buffer_bytes(), 0};
+}
+
+/**
+ * Owns a file descriptor and closes it, so a constructor that throws after
+ * opening a file does not leak it.
+ */
+struct file_descriptor
+{
+    explicit file_descriptor(int fd) : fd(fd) {}
+
+    file_descriptor(file_descriptor const &) = delete;
+    file_descriptor & operator=(file_descriptor const &) = delete;
+
+    ~file_descriptor()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    int get() const { return fd; }
+
+    int release()
+    {
+        auto const f = fd;
+        fd = -1;
+        return f;
+    }
+
+private:
+    int fd;
+};
+
+/**
+ * True if a trapdoor record in the file format has the same representation
+ * as trapdoor<X> in memory, in which case blocks may be used in place.
+ */
+template <typename X>
+constexpr bool trapdoor_records_are_native()
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return sizeof(size_t) == 8 && sizeof(trapdoor<X>) == TRAPDOOR_RECORD_BYTES;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Scans the rows of a trapdoor file with prefetching. Each block holds a
+ * whole number of rows.
+ */
+template <typename X>
+struct trapdoor_file_reader
+{
+    explicit trapdoor_file_reader(
+        string const & path,
+        size_t rows_per_block = size_t(1) << 16,
+        size_t depth = 8) :
+        fd(open_read(path)),
+        header(read_header(fd.get())),
+        reader(fd.get(), TRAPDOOR_FILE_HEADER_BYTES, data_end(fd.get(), header),
+            rows_per_block * header.columns * TRAPDOOR_RECORD_BYTES, depth)
+    {
+    }
+
+    uint32_t columns() const { return header.columns; }
+
+    /**
+     * Returns the next block of records, or an empty block at the end.
+     */
+    io_block next() { return reader.next(); }
+
+    /**
+     * The records of a block as trapdoors, without copying. Only available
+     * when trapdoor_records_are_native<X>(); otherwise use decode_trapdoors.
+     */
+    static trapdoor<X> const * records(io_block const & b)
+    {
+        static_assert(trapdoor_records_are_native<X>(),
+            "trapdoor records must be decoded on this platform");
+        return reinterpret_cast<trapdoor<X> const *>(b.data);
+    }
+
+    static size_t record_count(io_block const & b)
+    {
+        return b.size / TRAPDOOR_RECORD_BYTES;
+    }
+
+    size_t buffer_bytes() const { return reader.buffer_bytes(); }
+
+private:
+    static int open_read(string const & path)
+    {
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+        return fd;
+    }
+
+    static trapdoor_file_header read_header(int fd)
+    {
+        uint8_t bytes[TRAPDOOR_FILE_HEADER_BYTES];
+        pread_fully(fd, bytes, sizeof(bytes), 0);
+        auto h = decode_trapdoor_file_header(bytes);
+        if (!h)
+            throw runtime_error("not a trapdoor file");
+        return *h;
+    }
+
+    static size_t data_end(int fd, trapdoor_file_header const & h)
+    {
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+            throw std::system_error(errno, std::generic_category(), "fstat");
+
+        auto const row = h.columns * TRAPDOOR_RECORD_BYTES;
+        auto const rows = ((size_t)st.st_size - TRAPDOOR_FILE_HEADER_BYTES) / row;
+        return TRAPDOOR_FILE_HEADER_BYTES + rows * row;
+    }
+
+    file_descriptor fd;
+    trapdoor_file_header header;
+    async_block_reader reader;
+};
+
+/**
+ * Writes rows of trapdoors to a new trapdoor file with write-behind.
+ */
+template <typename X>
+struct trapdoor_file_writer
+{
+    trapdoor_file_writer(
+        string const & path,
+        uint32_t columns,
+        size_t rows_per_block = size_t(1) << 16,
+        size_t depth = 4) :
+        fd(open_write(path, columns)),
+        block_bytes(rows_per_block * columns * TRAPDOOR_RECORD_BYTES),
+        writer(fd.get(), TRAPDOOR_FILE_HEADER_BYTES, block_bytes, depth)
+    {
+    }
+
+    ~trapdoor_file_writer()
+    {
+        try { close(); } catch (...) {}
+    }
+
+    /**
+     * Appends the trapdoors [first,last); the number of trapdoors written
+     * over the life of the writer should be a multiple of the column count.
+     */
+    template <typename I>
+    void write(I first, I last)
+    {
+        for (; first != last; ++first)
+        {
+            if (!current)
+            {
+                current = &writer.acquire();
+                used = 0;
+            }
+            encode_trapdoors(first, std::next(first), current->data + used);
+            used += TRAPDOOR_RECORD_BYTES;
+            if (used == block_bytes)
+                flush();
+        }
+    }
+
+    void close()
+    {
+        if (fd.get() < 0)
+            return;
+        flush();
+        writer.finish();
+        if (::close(fd.release()) != 0)
+            throw std::system_error(errno, std::generic_category(), "close");
+    }
+
+    size_t buffer_bytes() const { return writer.buffer_bytes(); }
+
+private:
+    void flush()
+    {
+        if (current && used > 0)
+            writer.submit(*current, used);
+        current = nullptr;
+    }
+
+    static int open_write(string const & path, uint32_t columns)
+    {
+        auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+
+        uint8_t header[TRAPDOOR_FILE_HEADER_BYTES];
+        encode_trapdoor_file_header(columns, header);
+        try
+        {
+            pwrite_fully(fd, header, sizeof(header), 0);
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        return fd;
+    }
+
+    file_descriptor fd;
+    size_t block_bytes;
+    async_block_writer writer;
+    io_buffer * current = nullptr;
+    size_t used = 0;
+};
+
+template <typename X>
+memory_footprint memory_usage(trapdoor_file_reader<X> const & r)
+{
+    return memory_footprint{sizeof(r) + r.buffer_bytes(), r.buffer_bytes(), 0};
+}
+
+template <typename X>
+memory_footprint memory_usage(trapdoor_file_writer<X> const & w)
+{
+    return memory_footprint{sizeof(w) + w.buffer_bytes(), w.buffer_bytes(), 0};
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <string_view>
+#include <functional>
+#include <cstddef>
+#include <iterator>
+#include <memory_resource>
+#include <vector>
+#include "operation_metrics.hpp"
+#include "perf_counters.hpp"
+#include "trapdoor.hpp"
+#include "trapdoor_key.hpp"
+#include "trapdoor_key_cache.hpp"
+using std::size_t;
+using std::string_view;
+using std::vector;
+
+/**
+ * Batched construction of trapdoors.
+ *
+ * The single-key batch path maps a column of values x1,...,xn of type X to
+ * the column
+ *     T(x1),...,T(xn)
+ * where T(x) := make_trapdoor(s,x). The secret s is expanded once into a
+ * trapdoor_key, so the per-row cost is a single hash of the value.
+ *
+ * The multi-key batch path maps a column of values x1,...,xn and a column
+ * of key identifiers j1,...,jn to the column
+ *     T[j1](x1),...,T[jn](xn),
+ * where T[j](x) := make_trapdoor(resolve(j),x). A key identifier is the key
+ * hash of the secret, i.e., the value stored in trapdoor<X>::key_hash, and
+ * resolve maps a key identifier to its secret.
+ *
+ * The rows are grouped by key identifier: each distinct identifier is
+ * assigned a dense group index by a small open-addressed table, and the
+ * group's expanded key is looked up once in the calling thread's
+ * trapdoor_key_cache, so a secret is only resolved and expanded when it is
+ * not already warm. The rows are then hashed in their original order with
+ * their group's key, so the values and the output are both accessed
+ * sequentially and the trapdoors are written in the original row order.
+ * Runs of rows with the same key skip the table lookup.
+ *
+ * If there are u distinct keys in a batch of n rows, the cost is n hashes of
+ * values plus at most u key expansions plus one table probe per row, and so
+ * for u << n the amortized cost per row approaches that of the single-key
+ * batch path.
+ *
+ * The table and the group keys are allocated from a small buffer on the
+ * stack, and from a given memory resource (e.g., a request arena) only when
+ * a batch has more distinct keys than fit in it, so a batch with a few keys
+ * does not allocate at all.
+ */
+
+/**
+ * Single-key batch path. Writes T(x) for each x in [begin,end) to out and
+ * returns the end of the output range.
+ */
+template <
+    typename I,
+    typename O,
+    template <typename> typename H
+>
+O make_trapdoors(
+    I begin,
+    I end,
+    trapdoor_key<H> const & key,
+    O out)
+{
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_MAKE_TRAPDOORS);
+    CIPHER_TRAPDOOR_SETS_PERF_SCOPE("make_trapdoors",
+        perf_item_count(begin, end));
+    for (; begin != end; ++begin, ++out)
+        *out = make_trapdoor(*begin, key);
+    return out;
+}
+
+template <
+    template <typename> typename H = std::hash,
+    typename I,
+    typename O
+>
+O make_trapdoors(
+    I begin,
+    I end,
+    string_view k,
+    O out)
+{
+    return make_trapdoors(begin, end, make_trapdoor_key<H>(k), out);
+}
+
+constexpr size_t EMPTY_GROUP = ~size_t(0);
+
+/**
+ * Doubles the capacity of the key identifier table of the multi-key path.
+ */
+inline void rehash_key_groups(
+    std::pmr::vector<size_t> & slot_id,
+    std::pmr::vector<size_t> & slot_group)
+{
+    std::pmr::vector<size_t> ids(2 * slot_id.size(), slot_id.get_allocator());
+    std::pmr::vector<size_t> groups(2 * slot_id.size(), EMPTY_GROUP,
+        slot_group.get_allocator());
+    auto const mask = ids.size() - 1;
+    for (size_t i = 0; i < slot_id.size(); ++i)
+    {
+        if (slot_group[i] == EMPTY_GROUP)
+            continue;
+        auto s = slot_id[i] & mask;
+        while (groups[s] != EMPTY_GROUP)
+            s = (s + 1) & mask;
+        ids[s] = slot_id[i];
+        groups[s] = slot_group[i];
+    }
+    slot_id.swap(ids);
+    slot_group.swap(groups);
+}
+
+/**
+ * Multi-key batch path.
+ *
+ * [begin,end) is the column of values, keys is the start of the column of
+ * key identifiers (one per value), and resolve : size_t -> string_view maps
+ * a key identifier to its secret. The input iterators and out must be
+ * random access. Returns the end of the output range.
+ *
+ * If resolve(j) is a secret whose key hash is not j, the key identifier
+ * column is inconsistent with the secrets and invalid_argument is thrown
+ * (by the key cache).
+ *
+ * mr is the resource of the key table when it outgrows the stack buffer.
+ */
+template <
+    template <typename> typename H = std::hash,
+    typename I,
+    typename K,
+    typename F,
+    typename O
+>
+O make_trapdoors(
+    I begin,
+    I end,
+    K keys,
+    F resolve,
+    O out,
+    std::pmr::memory_resource * mr = std::pmr::get_default_resource())
+{
+    auto const n = static_cast<size_t>(std::distance(begin, end));
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_MAKE_TRAPDOORS);
+    CIPHER_TRAPDOOR_SETS_PERF_SCOPE("make_trapdoors (multi-key)", n);
+
+    // an open-addressed table from key identifier to group. Key identifiers
+    // are key hashes and thus (a priori) uniform, so their low bits are used
+    // directly as the start of the probe sequence.
+    std::byte buffer[1024];
+    std::pmr::monotonic_buffer_resource local(buffer, sizeof(buffer), mr);
+    std::pmr::vector<size_t> slot_id(16, &local);
+    std::pmr::vector<size_t> slot_group(16, EMPTY_GROUP, &local);
+    std::pmr::vector<trapdoor_key<H>> contexts(&local);
+    contexts.reserve(8);
+
+    auto group_of = [&](size_t id) -> size_t
+    {
+        auto const mask = slot_id.size() - 1;
+        for (auto s = id & mask;; s = (s + 1) & mask)
+        {
+            if (slot_group[s] == EMPTY_GROUP)
+            {
+                slot_id[s] = id;
+                slot_group[s] = contexts.size();
+                contexts.push_back(cached_trapdoor_key<H>(id, resolve));
+                if (2 * contexts.size() > slot_id.size())
+                    rehash_key_groups(slot_id, slot_group);
+                return contexts.size() - 1;
+            }
+            if (slot_id[s] == id)
+                return slot_group[s];
+        }
+    };
+
+    size_t last_id = 0;
+    size_t last_group = EMPTY_GROUP;
+    for (size_t i = 0; i < n; ++i)
+    {
+        size_t const id = keys[i];
+        if (last_group == EMPTY_GROUP || id != last_id)
+        {
+            last_id = id;
+            last_group = group_of(id);
+        }
+        out[i] = make_trapdoor(begin[i], contexts[last_group]);
+    }
+
+    return out + n;
+}
@@ -119,6 +119,10 @@
  * sets, frequency analysis or correlation analysis may reveal quite a bit).
  */
 
+#include "memory_usage.hpp"
+#include "operation_metrics.hpp"
+#include "type_fingerprint.hpp"
+
 template <typename X, size_t N>
 struct trapdoor_boolean_algebra
 {
@@ -137,6 +141,12 @@ struct trapdoor_boolean_algebra
     array<char,4> key_hash;
 };
 
+template <typename X, size_t N>
+memory_footprint memory_usage(trapdoor_boolean_algebra<X,N> const & xs)
+{
+    return memory_footprint{sizeof(xs), 0, CHAR_BIT * (N + 4)};
+}
+
 template <typename X, size_t N>
 auto make_empty_trapdoor_set()
 {
@@ -153,8 +163,12 @@ auto operator+(
     trapdoor_boolean_algebra<X,N> const & x,
     trapdoor_boolean_algebra<X,N> const & y)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_SET_OP);
     if (x.key_hash != y.key_hash)
+    {
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
         throw invalid_argument("secret key mismatch");
+    }
 
     return trapdoor_boolean_algebra<X>(
         x.value_hash | y.value_hash,
@@ -165,6 +179,7 @@ template <typename X, size_t N>
 auto operator!(
     trapdoor_boolean_algebra<X,N> const & x)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_SET_OP);
     return trapdoor_boolean_algebra<X>(
         ~x.value_hash,
         x.key_hash);
@@ -175,8 +190,12 @@ auto operator*(
     trapdoor_boolean_algebra<X,N> const & x,
     trapdoor_boolean_algebra<X,N> const & y)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_SET_OP);
     if (x.key_hash != y.key_hash)
+    {
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
         throw invalid_argument("secret key mismatch");
+    }
 
     return trapdoor_boolean_algebra<X>(
         x.value_hash & y.value_hash,
@@ -189,8 +208,12 @@ auto disjoint_union(
     trapdoor_boolean_algebra<X,N> const & x,
     trapdoor_boolean_algebra<Y,N> const & y)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_SET_OP);
     if (x.key_hash != y.key_hash)
+    {
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
         throw invalid_argument("secret key mismatch");
+    }
 
     return trapdoor_boolean_algebra<variant<X,Y>>(
         x.value_hash | y.value_hash,
@@ -202,6 +225,8 @@ template <typename X>
 approximate_bool empty(trapdoor_boolean_algebra<X> const & xs)
 {
     auto b = std::all_of(xs.begin(),xs.end(),[](char x) { return x == 0; });
+    if (b)
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_EMPTY_RESULT);
     return approximate_bool{b,0.5};
 }
 
@@ -211,8 +236,12 @@ approximate_bool contains(
     trapdoor<X,N> const & x,
     trapdoor_boolean_algebra<X,N> const & xs)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_CONTAINS);
     if (x.key_hash != xs.key_hash)
+    {
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
         throw invalid_argment("secret key mismatch");
+    }
 
     return approximate_bool{b, .5};
 }
@@ -222,6 +251,7 @@ approximate_bool operator<=(
     trapdoor_boolean_algebra<X> const & x,
     trapdoor_boolean_algebra<X> const & y)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_SET_OP);
     auto b = std::all_of(xs.begin(),xs.end(),[](char x) { return x == 0; });
     return approximate_bool{b, .5};
 }
@@ -231,13 +261,19 @@ approximate_bool operator==(
     trapdoor_boolean_algebra<X> const & x
     trapdoor_boolean_algebra<X> const & y)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_SET_OP);
     auto b = std::all_of(xs.begin(),xs.end(),[](char x) { return x == 0; });
     return approximate_bool{b, .5};
 }
 
 
+/**
+ * The digest of x: its value and key hashes with the fingerprint of X
+ * mixed in. The type fingerprint is a compile-time constant
+ * (type_fingerprint.hpp).
+ */
 template <typename X, size_t N>
 auto hash(trapdoor_boolean_algebra<X,N> const & x)
 {
-    return x.value_hash ^ x.key_hash ^ hash(typeid(X))
+    return x.value_hash ^ x.key_hash ^ type_fingerprint<X>();
 }
\ No newline at end of file
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "trapdoor_protocol.hpp"
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::vector;
+
+/**
+ * A client of the trapdoor query server (trapdoor_server.hpp).
+ *
+ * The blocking calls list, contains, evaluate and lookup send one request
+ * and wait for its response. To pipeline, queue requests with the send_
+ * calls, which return the request ids, flush() them, and receive() the
+ * responses, which arrive in request order:
+ *
+ *     trapdoor_client c("/run/trapdoors.sock");
+ *     for (auto const & batch : batches)
+ *         c.send_contains(set, batch.begin(), batch.end());
+ *     c.flush();
+ *     for (size_t i = 0; i < batches.size(); ++i)
+ *         auto member = decode_membership_response(c.receive().reader());
+ *
+ * The server answers while the client is still writing, and once the
+ * unread responses fill the socket buffers it stops reading requests. So
+ * that a pipeline of any length cannot deadlock, flush() waits for the
+ * socket to be writable or readable and reads the responses that arrive
+ * meanwhile into a buffer of the client, from which receive() takes them;
+ * they take memory until they are received.
+ *
+ * A response with STATUS_ERROR is turned into a runtime_error by the
+ * blocking calls and by trapdoor_response::reader(). A client is used by
+ * one thread at a time.
+ */
+
+struct trapdoor_response
+{
+    uint32_t id;
+    uint8_t status;
+    vector<uint8_t> payload;
+
+    /**
+     * The payload of a successful response; throws the server's message
+     * otherwise.
+     */
+    frame_reader reader() const
+    {
+        if (status != STATUS_OK)
+            throw runtime_error(string(payload.begin(), payload.end()));
+        return frame_reader{payload.data(), payload.data() + payload.size()};
+    }
+};
+
+class trapdoor_client
+{
+public:
+    /**
+     * Connects to the server listening at path.
+     */
+    explicit trapdoor_client(string const & path)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            throw runtime_error("socket path too long: " + path);
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            throw runtime_error("cannot create socket");
+        if (::connect(fd, (sockaddr const *)&addr, sizeof(addr)) != 0)
+        {
+            ::close(fd);
+            throw runtime_error("cannot connect to " + path);
+        }
+    }
+
+    /**
+     * Takes ownership of a connected socket, e.g., from
+     * trapdoor_server::connect_local().
+     */
+    explicit trapdoor_client(int fd) : fd(fd) {}
+
+    trapdoor_client(trapdoor_client const &) = delete;
+    trapdoor_client & operator=(trapdoor_client const &) = delete;
+
+    ~trapdoor_client() { ::close(fd); }
+
+    uint32_t send_list()
+    {
+        encode_list_request(out, next_id);
+        return next_id++;
+    }
+
+    template <typename I>
+    uint32_t send_contains(uint32_t set, I begin, I end)
+    {
+        encode_contains_request(out, next_id, set, begin, end);
+        return next_id++;
+    }
+
+    template <typename I>
+    uint32_t send_evaluate(set_expression const & e, I begin, I end)
+    {
+        encode_evaluate_request(out, next_id, e, begin, end);
+        return next_id++;
+    }
+
+    template <typename I>
+    uint32_t send_lookup(uint32_t set, I begin, I end)
+    {
+        encode_lookup_request(out, next_id, set, begin, end);
+        return next_id++;
+    }
+
+    /**
+     * Writes the queued requests, buffering the responses that arrive
+     * meanwhile.
+     */
+    void flush()
+    {
+        size_t sent = 0;
+        while (sent < out.size())
+        {
+            pollfd p{fd, POLLIN | POLLOUT, 0};
+            if (::poll(&p, 1, -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw runtime_error("connection to trapdoor server lost");
+            }
+            if (p.revents & POLLIN)
+                buffer_responses();
+            if (!(p.revents & (POLLOUT | POLLERR | POLLHUP)))
+                continue;
+
+            auto const n = ::send(fd, out.data() + sent, out.size() - sent,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+            if (n <= 0)
+                throw runtime_error("connection to trapdoor server lost");
+            sent += (size_t)n;
+        }
+        out.clear();
+    }
+
+    /**
+     * Waits for the next response.
+     */
+    trapdoor_response receive()
+    {
+        uint8_t header[PROTOCOL_FRAME_HEADER_BYTES];
+        read_exact(header, sizeof(header));
+        auto const length = load_le32(header);
+        if (length < PROTOCOL_FRAME_HEADER_BYTES - 4 || length > PROTOCOL_MAX_FRAME_BYTES)
+            throw runtime_error("malformed response frame");
+
+        trapdoor_response r{load_le32(header + 4), header[8], {}};
+        r.payload.resize(length - (PROTOCOL_FRAME_HEADER_BYTES - 4));
+        read_exact(r.payload.data(), r.payload.size());
+        return r;
+    }
+
+    vector<set_info> list()
+    {
+        send_list();
+        return decode_list_response(round_trip().reader());
+    }
+
+    template <typename I>
+    vector<bool> contains(uint32_t set, I begin, I end)
+    {
+        send_contains(set, begin, end);
+        return decode_membership_response(round_trip().reader());
+    }
+
+    template <typename I>
+    vector<bool> evaluate(set_expression const & e, I begin, I end)
+    {
+        send_evaluate(e, begin, end);
+        return decode_membership_response(round_trip().reader());
+    }
+
+    template <typename I>
+    vector<vector<uint64_t>> lookup(uint32_t set, I begin, I end)
+    {
+        send_lookup(set, begin, end);
+        return decode_lookup_response(round_trip().reader());
+    }
+
+private:
+    trapdoor_response round_trip()
+    {
+        flush();
+        return receive();
+    }
+
+    /**
+     * Reads what has arrived on the socket into the response buffer.
+     */
+    void buffer_responses()
+    {
+        constexpr size_t READ_BYTES = size_t(1) << 16;
+        if (in_pos == in.size())
+        {
+            in.clear();
+            in_pos = 0;
+        }
+        auto const filled = in.size();
+        in.resize(filled + READ_BYTES);
+        auto const n = ::recv(fd, in.data() + filled, READ_BYTES, MSG_DONTWAIT);
+        in.resize(filled + (n > 0 ? (size_t)n : 0));
+        if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+            throw runtime_error("connection to trapdoor server lost");
+    }
+
+    void read_exact(uint8_t * p, size_t bytes)
+    {
+        if (auto const buffered = std::min(bytes, in.size() - in_pos))
+        {
+            std::memcpy(p, in.data() + in_pos, buffered);
+            in_pos += buffered;
+            p += buffered;
+            bytes -= buffered;
+        }
+
+        while (bytes > 0)
+        {
+            auto const n = ::recv(fd, p, bytes, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw runtime_error("connection to trapdoor server lost");
+            p += n;
+            bytes -= (size_t)n;
+        }
+    }
+
+    int fd;
+    uint32_t next_id = 0;
+    vector<uint8_t> out;
+    vector<uint8_t> in;                 // responses read by flush()
+    size_t in_pos = 0;
+};
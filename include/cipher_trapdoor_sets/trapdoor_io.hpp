@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include "trapdoor.hpp"
+using std::FILE;
+using std::nullopt;
+using std::optional;
+using std::runtime_error;
+using std::size_t;
+using std::uint32_t;
+using std::uint64_t;
+using std::uint8_t;
+
+/**
+ * The binary trapdoor format.
+ *
+ * A trapdoor file is a table of trapdoors with a fixed number of columns.
+ * It consists of a 16 byte header followed by the rows:
+ *
+ *     magic   : 8 bytes, "TRAPDOOR"
+ *     version : uint32, currently 1
+ *     columns : uint32, the number of trapdoors per row
+ *     rows    : (value_hash : uint64, key_hash : uint64)^columns, repeated
+ *
+ * All integers are little-endian. A trapdoor record is 16 bytes regardless
+ * of the platform's size_t, and the number of rows is implied by the file
+ * size, so a writer may stream rows without knowing the count in advance.
+ *
+ * The format carries no type information about X: a trapdoor<X> is written
+ * as its two hashes, and the key hash is the only form of type checking
+ * available to a reader.
+ */
+
+constexpr char TRAPDOOR_FILE_MAGIC[8] = {'T','R','A','P','D','O','O','R'};
+constexpr uint32_t TRAPDOOR_FILE_VERSION = 1;
+constexpr size_t TRAPDOOR_FILE_HEADER_BYTES = 16;
+constexpr size_t TRAPDOOR_RECORD_BYTES = 16;
+
+struct trapdoor_file_header
+{
+    uint32_t version;
+    uint32_t columns;
+};
+
+inline void store_le64(uint8_t * p, uint64_t x)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = (uint8_t)(x >> (8 * i));
+}
+
+inline uint64_t load_le64(uint8_t const * p)
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 8; ++i)
+        x |= (uint64_t)p[i] << (8 * i);
+    return x;
+}
+
+inline void store_le32(uint8_t * p, uint32_t x)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = (uint8_t)(x >> (8 * i));
+}
+
+inline uint32_t load_le32(uint8_t const * p)
+{
+    uint32_t x = 0;
+    for (int i = 0; i < 4; ++i)
+        x |= (uint32_t)p[i] << (8 * i);
+    return x;
+}
+
+inline void encode_trapdoor_file_header(
+    uint32_t columns,
+    uint8_t * out)
+{
+    std::memcpy(out, TRAPDOOR_FILE_MAGIC, sizeof(TRAPDOOR_FILE_MAGIC));
+    store_le32(out + 8, TRAPDOOR_FILE_VERSION);
+    store_le32(out + 12, columns);
+}
+
+/**
+ * Decodes a header, or returns nullopt if the bytes are not the header of
+ * a trapdoor file of a supported version.
+ */
+inline optional<trapdoor_file_header> decode_trapdoor_file_header(
+    uint8_t const * in)
+{
+    if (std::memcmp(in, TRAPDOOR_FILE_MAGIC, sizeof(TRAPDOOR_FILE_MAGIC)) != 0)
+        return nullopt;
+
+    auto h = trapdoor_file_header{load_le32(in + 8), load_le32(in + 12)};
+    if (h.version != TRAPDOOR_FILE_VERSION || h.columns == 0)
+        return nullopt;
+    return h;
+}
+
+/**
+ * Encodes the trapdoors [begin,end) as consecutive records starting at out
+ * and returns the end of the encoded bytes.
+ */
+template <typename I>
+uint8_t * encode_trapdoors(I begin, I end, uint8_t * out)
+{
+    for (; begin != end; ++begin, out += TRAPDOOR_RECORD_BYTES)
+    {
+        store_le64(out, (uint64_t)begin->value_hash);
+        store_le64(out + 8, (uint64_t)begin->key_hash);
+    }
+    return out;
+}
+
+/**
+ * Decodes n records starting at in to out and returns the end of the output.
+ */
+template <typename X, typename O>
+O decode_trapdoors(uint8_t const * in, size_t n, O out)
+{
+    for (size_t i = 0; i < n; ++i, in += TRAPDOOR_RECORD_BYTES, ++out)
+        *out = trapdoor<X>{(size_t)load_le64(in), (size_t)load_le64(in + 8)};
+    return out;
+}
+
+inline void write_trapdoor_file_header(FILE * f, uint32_t columns)
+{
+    uint8_t header[TRAPDOOR_FILE_HEADER_BYTES];
+    encode_trapdoor_file_header(columns, header);
+    if (std::fwrite(header, 1, sizeof(header), f) != sizeof(header))
+        throw runtime_error("failed to write trapdoor file header");
+}
+
+inline trapdoor_file_header read_trapdoor_file_header(FILE * f)
+{
+    uint8_t header[TRAPDOOR_FILE_HEADER_BYTES];
+    if (std::fread(header, 1, sizeof(header), f) != sizeof(header))
+        throw runtime_error("truncated trapdoor file header");
+
+    auto h = decode_trapdoor_file_header(header);
+    if (!h)
+        throw runtime_error("not a trapdoor file");
+    return *h;
+}
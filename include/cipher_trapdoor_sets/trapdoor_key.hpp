@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string_view>
+#include <functional>
+#include "trapdoor.hpp"
+using std::size_t;
+using std::string_view;
+
+/**
+ * trapdoor_key<H> is a regular type.
+ *
+ * A trapdoor key is the expanded form of a secret k. make_trapdoor takes
+ * the secret as a string_view and hashes it on every call,
+ *     make_trapdoor : {0,1}^* -> X -> trapdoor<X>,
+ * but the secret only has to be expanded once. The partial application
+ *     T(x) := \x -> make_trapdoor(s,x)
+ * is thus represented by a value of type trapdoor_key<H>, which holds:
+ *
+ *     (1) key_hash, the hash of the secret, which is the same value that
+ *         make_trapdoor stores in trapdoor<X>::key_hash to facilitate a
+ *         form of dynamic type checking.
+ *
+ *     (2) seed, a keyed seed that is mixed into the hash of every value.
+ *         The seed is a function of the secret, so trapdoors of the same
+ *         value under different secrets are uncorrelated.
+ *
+ * Expanding a key costs one pass over the secret. Every trapdoor made with
+ * the expanded key thereafter costs one hash of the value and one
+ * hash_combine. make_trapdoor(x, k) with the secret itself expands it on
+ * each call and returns the same trapdoor as make_trapdoor(x, key).
+ */
+
+/**
+ * The same mixing function used by random_trapdoor_generator.
+ */
+template <
+    template <typename> typename H = std::hash,
+    typename T
+>
+void hash_combine(size_t & seed, T const & x)
+{
+    seed ^= H<T>{}(x) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+template <template <typename> typename H = std::hash>
+struct trapdoor_key
+{
+    size_t key_hash;
+    size_t seed;
+};
+
+template <template <typename> typename H = std::hash>
+trapdoor_key<H> make_trapdoor_key(string_view k)
+{
+    auto key_hash = H<string_view>{}(k);
+    auto seed = key_hash;
+    hash_combine<H>(seed, k);
+    return trapdoor_key<H>{key_hash, seed};
+}
+
+template <
+    typename X,
+    template <typename> typename H
+>
+auto make_trapdoor(
+    X const & x,
+    trapdoor_key<H> const & key)
+{
+    auto s = key.seed;
+    hash_combine<H>(s, x);
+    return trapdoor<X>{s, key.key_hash};
+}
+
+template <template <typename> typename H>
+bool operator==(trapdoor_key<H> const & lhs, trapdoor_key<H> const & rhs)
+{
+    return lhs.key_hash == rhs.key_hash && lhs.seed == rhs.seed;
+}
+
+template <template <typename> typename H>
+bool operator!=(trapdoor_key<H> const & lhs, trapdoor_key<H> const & rhs)
+{
+    return !(lhs == rhs);
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <stdexcept>
+#include <string_view>
+#include <functional>
+#include <utility>
+#include "memory_usage.hpp"
+#include "operation_metrics.hpp"
+#include "trapdoor_key.hpp"
+using std::array;
+using std::atomic;
+using std::invalid_argument;
+using std::size_t;
+using std::string_view;
+
+/**
+ * A bounded, thread-local cache of expanded keys.
+ *
+ * A service that handles many secrets would otherwise resolve and expand a
+ * secret every time it sees its key hash. The cache maps
+ *     key_hash -> trapdoor_key<H>
+ * and is direct-mapped: the key hash of a secret is (a priori) uniformly
+ * distributed, so slot key_hash mod C is a uniformly distributed slot
+ * and no further hashing is needed. A collision evicts the previous entry.
+ *
+ * Each thread has its own cache, so lookups take no locks. The only shared
+ * state is a global generation counter. When a key is rotated (or revoked),
+ * invalidate_trapdoor_keys() increments the counter, and every entry that
+ * was expanded under an older generation is treated as a miss the next time
+ * it is looked up on any thread. The counter is written rarely, so reading
+ * it on each lookup does not contend.
+ */
+
+inline atomic<size_t> trapdoor_key_generation{0};
+
+inline void invalidate_trapdoor_keys()
+{
+    trapdoor_key_generation.fetch_add(1, std::memory_order_release);
+}
+
+template <
+    template <typename> typename H = std::hash,
+    size_t C = 64
+>
+struct trapdoor_key_cache
+{
+    static_assert(C > 0, "capacity must be positive");
+
+    struct entry
+    {
+        size_t generation;
+        bool valid;
+        trapdoor_key<H> key;
+    };
+
+    /**
+     * Returns the expanded key whose key hash is key_hash. On a miss,
+     * resolve : size_t -> string_view is called to obtain the secret, which
+     * is expanded and stored.
+     *
+     * Throws invalid_argument if the resolved secret does not hash to
+     * key_hash. The returned reference is only valid until the next lookup
+     * on this cache, so callers that hold on to a key should copy it.
+     */
+    template <typename F>
+    trapdoor_key<H> const & find_or_expand(size_t key_hash, F && resolve)
+    {
+        auto const generation = trapdoor_key_generation.load(
+            std::memory_order_acquire);
+        auto & e = entries[key_hash % C];
+        if (e.valid && e.generation == generation && e.key.key_hash == key_hash)
+        {
+            ++hits;
+            return e.key;
+        }
+
+        ++misses;
+        auto key = make_trapdoor_key<H>(resolve(key_hash));
+        if (key.key_hash != key_hash)
+        {
+            CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
+            throw invalid_argument("secret key mismatch");
+        }
+
+        e = entry{generation, true, key};
+        return e.key;
+    }
+
+    /**
+     * Returns the expanded key of the secret k.
+     */
+    trapdoor_key<H> const & find_or_expand(string_view k)
+    {
+        return find_or_expand(H<string_view>{}(k), [k](size_t) { return k; });
+    }
+
+    void clear()
+    {
+        for (auto & e : entries)
+            e.valid = false;
+    }
+
+    static constexpr size_t capacity() { return C; }
+
+    array<entry,C> entries{};
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+template <template <typename> typename H, size_t C>
+memory_footprint memory_usage(trapdoor_key_cache<H,C> const & cache)
+{
+    return memory_footprint{sizeof(cache), 0, 0};
+}
+
+/**
+ * The calling thread's key cache.
+ */
+template <
+    template <typename> typename H = std::hash,
+    size_t C = 64
+>
+auto & thread_trapdoor_key_cache()
+{
+    static thread_local trapdoor_key_cache<H,C> cache;
+    return cache;
+}
+
+template <
+    template <typename> typename H = std::hash,
+    typename F
+>
+trapdoor_key<H> const & cached_trapdoor_key(size_t key_hash, F && resolve)
+{
+    return thread_trapdoor_key_cache<H>().find_or_expand(
+        key_hash, std::forward<F>(resolve));
+}
+
+template <template <typename> typename H = std::hash>
+trapdoor_key<H> const & cached_trapdoor_key(string_view k)
+{
+    return thread_trapdoor_key_cache<H>().find_or_expand(k);
+}
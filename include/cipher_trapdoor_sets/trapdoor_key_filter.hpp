@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "perf_counters.hpp"
+#include "trapdoor.hpp"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+using std::invalid_argument;
+using std::make_pair;
+using std::pair;
+using std::size_t;
+using std::uint32_t;
+using std::uint64_t;
+using std::vector;
+
+/**
+ * Bulk verification of key hashes.
+ *
+ * Operations on trapdoor<X> compare key hashes and throw invalid_argument on
+ * a mismatch, which is a form of dynamic type checking one value at a time.
+ * When a batch of trapdoors arrives from many producers, we instead want to
+ * partition the batch into the rows whose key hash is in a set of accepted
+ * key hashes K and the rows that are rejected.
+ *
+ * The filter runs in two passes:
+ *
+ *     (1) A reject bitmap R is computed, 64 rows per word, where bit i of R
+ *         is set if and only if key_hash(x_i) is not in K. With AVX2, four
+ *         key hashes are compared against a broadcast of each accepted key
+ *         per instruction; otherwise the scalar loop is written so that the
+ *         compiler may vectorize it.
+ *
+ *     (2) The accepted rows are compacted into the output buffer by a
+ *         branchless stream compaction: every row is stored to the next
+ *         output slot, and the slot index advances only if the row is
+ *         accepted. The cost is independent of the reject rate.
+ *
+ * Each accepted key adds one comparison per row, so K is intended to be small
+ * (one or several keys).
+ *
+ * The reject bitmap has (n + 63) / 64 words and the bits past row n in the
+ * last word are zero.
+ */
+
+constexpr size_t reject_bitmap_words(size_t n)
+{
+    return (n + 63) / 64;
+}
+
+namespace detail
+{
+    inline uint64_t key_reject_bits(
+        size_t const * key_hashes,
+        size_t stride,
+        size_t n,
+        size_t const * keys,
+        size_t m)
+    {
+        uint64_t rejects = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            auto const kh = key_hashes[i * stride];
+            bool accepted = false;
+            for (size_t j = 0; j < m; ++j)
+                accepted |= (kh == keys[j]);
+            rejects |= uint64_t(!accepted) << i;
+        }
+        return rejects;
+    }
+
+#if defined(__AVX2__)
+    // four consecutive key hashes from a column.
+    inline unsigned key_accept_mask4(
+        size_t const * key_hashes,
+        __m256i const * keys,
+        size_t m)
+    {
+        auto const k = _mm256_loadu_si256((__m256i const *)key_hashes);
+        auto eq = _mm256_setzero_si256();
+        for (size_t j = 0; j < m; ++j)
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(k, keys[j]));
+        return (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(eq));
+    }
+
+    // four consecutive trapdoors {value_hash,key_hash}; only the key lanes
+    // (1 and 3 of each load) are kept.
+    inline unsigned key_accept_mask4_aos(
+        size_t const * words,
+        __m256i const * keys,
+        size_t m)
+    {
+        auto const lo = _mm256_loadu_si256((__m256i const *)words);
+        auto const hi = _mm256_loadu_si256((__m256i const *)(words + 4));
+        auto eq_lo = _mm256_setzero_si256();
+        auto eq_hi = _mm256_setzero_si256();
+        for (size_t j = 0; j < m; ++j)
+        {
+            eq_lo = _mm256_or_si256(eq_lo, _mm256_cmpeq_epi64(lo, keys[j]));
+            eq_hi = _mm256_or_si256(eq_hi, _mm256_cmpeq_epi64(hi, keys[j]));
+        }
+        auto const a = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(eq_lo));
+        auto const b = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(eq_hi));
+        return ((a >> 1) & 1u) | ((a >> 2) & 2u) |
+               ((b << 1) & 4u) | (b & 8u);
+    }
+#endif
+
+    /**
+     * Computes the reject bitmap of n key hashes, where key hash i is at
+     * key_hashes[i * stride] and stride is 1 (a column) or 2 (an array of
+     * trapdoors).
+     */
+    inline void key_reject_bitmap(
+        size_t const * key_hashes,
+        size_t stride,
+        size_t n,
+        size_t const * keys,
+        size_t m,
+        uint64_t * rejects)
+    {
+        size_t i = 0;
+#if defined(__AVX2__)
+        static_assert(sizeof(size_t) == sizeof(long long));
+        constexpr size_t MAX_KEYS = 16;
+        if (m <= MAX_KEYS)
+        {
+            __m256i broadcast[MAX_KEYS];
+            for (size_t j = 0; j < m; ++j)
+                broadcast[j] = _mm256_set1_epi64x((long long)keys[j]);
+
+            for (; i + 64 <= n; i += 64)
+            {
+                uint64_t accepts = 0;
+                for (size_t b = 0; b < 64; b += 4)
+                {
+                    auto const p = key_hashes + (i + b) * stride;
+                    auto const mask = stride == 1 ?
+                        key_accept_mask4(p, broadcast, m) :
+                        key_accept_mask4_aos(p - 1, broadcast, m);
+                    accepts |= uint64_t(mask) << b;
+                }
+                rejects[i / 64] = ~accepts;
+            }
+        }
+#endif
+        for (; i < n; i += 64)
+        {
+            auto const count = n - i < 64 ? n - i : 64;
+            rejects[i / 64] = key_reject_bits(
+                key_hashes + i * stride, stride, count, keys, m);
+        }
+    }
+}
+
+/**
+ * Computes the reject bitmap of the trapdoors xs[0],...,xs[n-1] against the
+ * accepted key hashes keys[0],...,keys[m-1].
+ */
+template <typename X>
+void key_reject_bitmap(
+    trapdoor<X> const * xs,
+    size_t n,
+    size_t const * keys,
+    size_t m,
+    uint64_t * rejects)
+{
+    static_assert(sizeof(trapdoor<X>) == 2 * sizeof(size_t),
+        "trapdoor<X> must be laid out as {value_hash, key_hash}");
+
+    if (n == 0)
+        return;
+    detail::key_reject_bitmap(&xs->key_hash, 2, n, keys, m, rejects);
+}
+
+/**
+ * Copies the trapdoors in xs[0],...,xs[n-1] whose key hash is accepted to
+ * out, in order, and writes the reject bitmap to rejects. out must have room
+ * for n trapdoors. Returns the number of accepted trapdoors.
+ */
+template <typename X>
+size_t filter_by_key(
+    trapdoor<X> const * xs,
+    size_t n,
+    size_t const * keys,
+    size_t m,
+    trapdoor<X> * out,
+    uint64_t * rejects)
+{
+    CIPHER_TRAPDOOR_SETS_PERF_SCOPE("filter_by_key", n);
+    key_reject_bitmap(xs, n, keys, m, rejects);
+
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        out[k] = xs[i];
+        k += 1 - ((rejects[i / 64] >> (i % 64)) & 1);
+    }
+    return k;
+}
+
+/**
+ * Vector form. The accepted rows and the reject bitmap are allocated with
+ * the allocator of xs, so a batch in a request arena is filtered into it.
+ */
+template <typename X, typename A, typename B>
+auto filter_by_key(
+    vector<trapdoor<X>,A> const & xs,
+    vector<size_t,B> const & keys)
+{
+    using R = typename std::allocator_traits<A>::template rebind_alloc<uint64_t>;
+    vector<trapdoor<X>,A> accepted(xs.size(), xs.get_allocator());
+    vector<uint64_t,R> rejects(reject_bitmap_words(xs.size()), R(xs.get_allocator()));
+    accepted.resize(filter_by_key(xs.data(), xs.size(), keys.data(),
+        keys.size(), accepted.data(), rejects.data()));
+    return make_pair(std::move(accepted), std::move(rejects));
+}
+
+/**
+ * Column form. key_hashes[0],...,key_hashes[n-1] is a column of key hashes
+ * (e.g., the key_hash column of a struct-of-arrays batch). The indices of
+ * the accepted rows are written to selection, in order, and the reject
+ * bitmap is written to rejects. selection must have room for n indices.
+ * Returns the number of accepted rows. The indices are 32-bit, half the
+ * traffic of size_t, so a column of more than UINT32_MAX rows throws
+ * invalid_argument; a larger batch is selected a chunk at a time.
+ */
+inline size_t select_by_key(
+    size_t const * key_hashes,
+    size_t n,
+    size_t const * keys,
+    size_t m,
+    uint32_t * selection,
+    uint64_t * rejects)
+{
+    if (n > UINT32_MAX)
+        throw invalid_argument("too many rows for 32-bit selection indices");
+    CIPHER_TRAPDOOR_SETS_PERF_SCOPE("select_by_key", n);
+    detail::key_reject_bitmap(key_hashes, 1, n, keys, m, rejects);
+
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        selection[k] = (uint32_t)i;
+        k += 1 - ((rejects[i / 64] >> (i % 64)) & 1);
+    }
+    return k;
+}
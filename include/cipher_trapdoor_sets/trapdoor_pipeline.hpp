@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "task_scheduler.hpp"
+using std::size_t;
+using std::vector;
+
+/**
+ * Morsel-driven pipelines of trapdoor operators.
+ *
+ * A job such as
+ *     parse -> trapdoor -> filter by set membership -> aggregate -> write
+ * run as one pass per operator materializes every intermediate column in
+ * memory, so each pass streams its input back from DRAM. A pipeline instead
+ * cuts the input into morsels of DEFAULT_MORSEL_ROWS or so rows (Leis et
+ * al., "Morsel-driven parallelism") and pushes each morsel through all the
+ * stages back to back on one thread, so the intermediate columns of a
+ * morsel are written by one stage and read by the next while they are still
+ * in L2.
+ *
+ * A morsel is a value of a user type M that holds the columns of a batch of
+ * rows, e.g.,
+ *
+ *     struct rows_morsel
+ *     {
+ *         size_t first, count;
+ *         vector<trapdoor<string>> trapdoors;
+ *         vector<char> member;
+ *         vector<uint8_t> encoded;
+ *     };
+ *
+ * and the job is
+ *
+ *     lane_local<size_t> hits(pipeline_lanes(opts));
+ *     run_pipeline<rows_morsel>(opts,
+ *         range_source(values.size(), DEFAULT_MORSEL_ROWS,
+ *             [](rows_morsel & m, size_t lo, size_t hi)
+ *             { m.first = lo; m.count = hi - lo; }),
+ *         [&](rows_morsel & m) { write(m.encoded); },
+ *         [&](rows_morsel & m) { ...make_trapdoors into m.trapdoors... },
+ *         [&](rows_morsel & m) { ...contains(t, set) into m.member... },
+ *         [&](rows_morsel & m) { hits.local() += count(m.member); },
+ *         [&](rows_morsel & m) { ...encode_trapdoors into m.encoded... });
+ *     auto const total = hits.combine(0, std::plus<>());
+ *
+ * where
+ *
+ *     source(m) -> bool   fills the next morsel, or returns false at the
+ *                         end of the input. Calls are serialized, so a
+ *                         source may read a stream.
+ *     stages(m)...        run in order on the morsel, on the lane that
+ *                         took it.
+ *     sink(m)             consumes a finished morsel. Calls are
+ *                         serialized, and with ordered (the default) they
+ *                         are in source order, e.g., for a writer.
+ *
+ * Lanes (by default, one per task slot of the executor of
+ * task_scheduler.hpp) take morsels from the source in parallel. There are
+ * window morsel objects, which are reused: a stage should clear and refill
+ * the columns of its morsel rather than allocate new ones, so the columns
+ * keep their capacity and their cache lines. A lane that finds every morsel
+ * object in flight (e.g., since the sink is slower than the stages, or an
+ * ordered sink is waiting for an earlier morsel) waits until one is
+ * consumed, so a slow sink throttles the source instead of letting finished
+ * morsels pile up.
+ *
+ * Aggregates are accumulated without synchronization in lane_local values,
+ * one per lane, and combined after the run.
+ *
+ * Parallelism comes mainly from the lanes, but a stage may also call
+ * parallel_for on its morsel, which runs on the executor. Each lane is
+ * therefore run by a thread of its own rather than as a task of the
+ * executor: a worker that waits for a stolen half of a stage's parallel_for
+ * runs other tasks meanwhile, and if one of them were a lane blocked on a
+ * full window, the morsel held by the stage below it on the same stack
+ * could never finish. The lane threads are kept in a process-wide pool and
+ * reused from run to run; a run hands each lane to an idle thread and
+ * starts a thread only if none is idle, so threads are created only when
+ * more lanes run at once than ever before.
+ *
+ * run_pipeline blocks the calling thread until the lanes are done, so it
+ * should not itself be called from a task of the executor. If the source,
+ * a stage or the sink throws, no further morsels are taken and the first
+ * exception is rethrown from run_pipeline.
+ */
+
+constexpr size_t DEFAULT_MORSEL_ROWS = 4096;
+
+struct pipeline_options
+{
+    size_t lanes = 0;           // 0 for the executor's concurrency
+    size_t window = 0;          // morsels in flight; 0 for twice the lanes
+    bool ordered = true;        // the sink sees morsels in source order
+};
+
+struct pipeline_stats
+{
+    size_t morsels = 0;
+    size_t stalls = 0;          // waits of a lane for a free morsel
+};
+
+namespace detail
+{
+    inline thread_local size_t pipeline_lane = 0;
+
+    /**
+     * Sets the lane of the calling thread for the lifetime of the scope.
+     */
+    struct pipeline_lane_scope
+    {
+        explicit pipeline_lane_scope(size_t lane) : previous(pipeline_lane)
+        {
+            pipeline_lane = lane;
+        }
+
+        ~pipeline_lane_scope() { pipeline_lane = previous; }
+
+        size_t previous;
+    };
+
+    /**
+     * The threads that run pipeline lanes. bulk(n, f) runs f(0), ...,
+     * f(n - 1) each on a thread of its own at once, an idle one or else a
+     * new one, so a lane never waits for another lane's thread; a thread
+     * waits for its next call once its lane is done.
+     */
+    class pipeline_lane_pool
+    {
+    public:
+        pipeline_lane_pool() = default;
+        pipeline_lane_pool(pipeline_lane_pool const &) = delete;
+        pipeline_lane_pool & operator=(pipeline_lane_pool const &) = delete;
+
+        ~pipeline_lane_pool()
+        {
+            {
+                std::lock_guard<std::mutex> g(lock);
+                closing = true;
+            }
+            ready.notify_all();
+            for (auto & t : threads)
+                t.join();
+        }
+
+        /**
+         * Runs f(i), which must not throw, for each i in [0,n) and returns
+         * once every thread that ran one is idle again. If a thread cannot
+         * be started, nothing runs.
+         */
+        void bulk(size_t n, std::function<void(size_t)> const & f)
+        {
+            call c{&f, n};
+            std::unique_lock<std::mutex> g(lock);
+            while (idle < n)
+            {
+                threads.emplace_back([this] { serve(); });
+                ++idle;
+            }
+            idle -= n;
+            for (size_t i = 0; i < n; ++i)
+                jobs.push_back(job{&c, i});
+            ready.notify_all();
+            finished.wait(g, [&] { return c.remaining == 0; });
+        }
+
+    private:
+        struct call
+        {
+            std::function<void(size_t)> const * f;
+            size_t remaining;
+        };
+
+        struct job
+        {
+            call * c;
+            size_t i;
+        };
+
+        void serve()
+        {
+            std::unique_lock<std::mutex> g(lock);
+            for (;;)
+            {
+                ready.wait(g, [&] { return !jobs.empty() || closing; });
+                if (jobs.empty())
+                    return;
+                auto const j = jobs.front();
+                jobs.pop_front();
+                g.unlock();
+                (*j.c->f)(j.i);
+                g.lock();
+                ++idle;
+                if (--j.c->remaining == 0)
+                    finished.notify_all();
+            }
+        }
+
+        std::mutex lock;
+        std::condition_variable ready;
+        std::condition_variable finished;
+        std::deque<job> jobs;
+        size_t idle = 0;                // threads neither running nor claimed by a job
+        bool closing = false;
+        vector<std::thread> threads;
+    };
+
+    inline pipeline_lane_pool & global_pipeline_lane_pool()
+    {
+        static pipeline_lane_pool pool;
+        return pool;
+    }
+}
+
+/**
+ * The lane of the calling stage.
+ */
+inline size_t current_pipeline_lane()
+{
+    return detail::pipeline_lane;
+}
+
+inline size_t pipeline_lanes(pipeline_options const & opts)
+{
+    return opts.lanes != 0 ? opts.lanes : current_executor().concurrency();
+}
+
+/**
+ * One T per lane, each on its own cache line.
+ */
+template <typename T>
+class lane_local
+{
+public:
+    explicit lane_local(size_t lanes, T const & init = T()) :
+        slots(lanes, slot{init}) {}
+
+    T & local() { return slots[current_pipeline_lane()].value; }
+
+    T & operator[](size_t lane) { return slots[lane].value; }
+
+    size_t size() const { return slots.size(); }
+
+    /**
+     * Folds the lanes' values, in lane order, into acc.
+     */
+    template <typename C>
+    T combine(T acc, C const & c) const
+    {
+        for (auto const & s : slots)
+            acc = c(acc, s.value);
+        return acc;
+    }
+
+private:
+    struct alignas(64) slot
+    {
+        T value;
+    };
+
+    vector<slot> slots;
+};
+
+/**
+ * A source of the morsels [lo,hi) of rows [0,n), at most rows each.
+ * assign(m, lo, hi) sets the range of the morsel m.
+ */
+template <typename F>
+auto range_source(size_t n, size_t rows, F assign)
+{
+    return [n, rows = std::max<size_t>(1, rows), assign, next = size_t(0)](auto & m) mutable
+    {
+        if (next >= n)
+            return false;
+        auto const lo = next;
+        next = std::min(n, lo + rows);
+        assign(m, lo, next);
+        return true;
+    };
+}
+
+/**
+ * Runs the morsels of source through the stages and into sink.
+ */
+template <typename M, typename Source, typename Sink, typename... Stages>
+pipeline_stats run_pipeline(
+    pipeline_options const & opts,
+    Source source,
+    Sink sink,
+    Stages... stages)
+{
+    struct slot
+    {
+        M morsel;
+        size_t seq = 0;
+    };
+
+    auto const lanes = pipeline_lanes(opts);
+    auto const window = std::max(lanes, opts.window != 0 ? opts.window : 2 * lanes);
+
+    vector<slot> slots(window);
+    vector<slot *> free_slots;
+    for (auto & s : slots)
+        free_slots.push_back(&s);
+
+    // in ordered mode, the morsels in flight have sequence numbers in
+    // [written, written + window), so a ring of window slots reorders them.
+    vector<slot *> reorder(window, nullptr);
+    size_t written = 0;
+    size_t next_seq = 0;
+
+    std::mutex free_lock, source_lock, sink_lock;
+    std::condition_variable freed;
+    std::atomic<bool> stopped{false};
+    std::exception_ptr error;
+    pipeline_stats stats;
+
+    auto release = [&](slot * s)
+    {
+        {
+            std::lock_guard<std::mutex> g(free_lock);
+            free_slots.push_back(s);
+        }
+        freed.notify_one();
+    };
+
+    auto stop = [&]
+    {
+        {
+            std::lock_guard<std::mutex> g(free_lock);
+            stopped = true;
+        }
+        freed.notify_all();
+    };
+
+    auto lane = [&](size_t l)
+    {
+        detail::pipeline_lane_scope scope(l);
+        for (;;)
+        {
+            slot * s;
+            {
+                std::unique_lock<std::mutex> g(free_lock);
+                if (free_slots.empty() && !stopped)
+                {
+                    ++stats.stalls;
+                    freed.wait(g, [&] { return !free_slots.empty() || stopped; });
+                }
+                if (stopped)
+                    return;
+                s = free_slots.back();
+                free_slots.pop_back();
+            }
+
+            {
+                std::lock_guard<std::mutex> g(source_lock);
+                if (stopped || !source(s->morsel))
+                {
+                    release(s);
+                    stop();
+                    return;
+                }
+                s->seq = next_seq++;
+            }
+
+            (stages(s->morsel), ...);
+
+            std::lock_guard<std::mutex> g(sink_lock);
+            if (!opts.ordered)
+            {
+                sink(s->morsel);
+                ++stats.morsels;
+                release(s);
+                continue;
+            }
+
+            reorder[s->seq % window] = s;
+            for (slot * r; (r = reorder[written % window]) && r->seq == written; ++written)
+            {
+                reorder[written % window] = nullptr;
+                sink(r->morsel);
+                ++stats.morsels;
+                release(r);
+            }
+        }
+    };
+
+    auto run_lane = [&](size_t l)
+    {
+        try
+        {
+            lane(l);
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard<std::mutex> g(free_lock);
+                if (!error)
+                    error = std::current_exception();
+            }
+            stop();
+        }
+    };
+
+    detail::global_pipeline_lane_pool().bulk(lanes, run_lane);
+
+    if (error)
+        std::rethrow_exception(error);
+    return stats;
+}
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "trapdoor_io.hpp"
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint16_t;
+using std::uint32_t;
+using std::uint64_t;
+using std::uint8_t;
+using std::vector;
+
+/**
+ * The binary protocol of the trapdoor query server (trapdoor_server.hpp).
+ *
+ * A connection carries frames in both directions:
+ *
+ *     length  : uint32, the number of bytes after this field
+ *     id      : uint32, chosen by the client and echoed in the response
+ *     code    : uint8, the operation of a request or the status of a
+ *               response
+ *     payload : length - 5 bytes
+ *
+ * All integers are little-endian and trapdoors are 16 byte records as in
+ * trapdoor_io.hpp. A client may send any number of requests before reading
+ * (pipelining); the server answers the requests of a connection in order.
+ *
+ * Requests:
+ *
+ *     OP_LIST      ()
+ *                  -> count : uint32, (id : uint32, rows : uint64,
+ *                     name_length : uint16, name)^count
+ *     OP_CONTAINS  (set : uint32, n : uint32, trapdoor^n)
+ *                  -> n : uint32, membership bitmap of (n + 7) / 8 bytes
+ *     OP_EVALUATE  (code_length : uint32, expression code, n : uint32,
+ *                  trapdoor^n)
+ *                  -> n : uint32, membership bitmap
+ *     OP_LOOKUP    (set : uint32, n : uint32, trapdoor^n)
+ *                  -> n : uint32, (count : uint32, row : uint64^count)^n
+ *
+ * Bit i of a bitmap is bit i % 8 of byte i / 8. OP_LOOKUP returns the rows
+ * of the set's table whose trapdoor in the set's column equals the query.
+ *
+ * A set expression is a postfix program over sets:
+ *
+ *     EXPR_SET id:uint32    push the set id
+ *     EXPR_UNION            pop B, A; push A or B
+ *     EXPR_INTERSECTION     pop B, A; push A and B
+ *     EXPR_DIFFERENCE       pop B, A; push A and not B
+ *     EXPR_COMPLEMENT       pop A; push not A
+ *
+ * and is built with expr_set(id) and the operators |, &, - and !, e.g.,
+ * (expr_set(0) | expr_set(1)) - expr_set(2). Membership in an expression is
+ * evaluated through the homomorphism, element by element, e.g.,
+ * contains(x, A - B) = contains(x, A) and not contains(x, B). The server
+ * holds a bitmap per stack entry, so it refuses a program whose stack would
+ * grow deeper than PROTOCOL_MAX_EXPRESSION_DEPTH entries; an expression
+ * built by the operators needs one entry more than its nesting of right
+ * operands.
+ *
+ * A response has status STATUS_OK and the payload above, or STATUS_ERROR
+ * and a message (the rest of the payload), e.g., "secret key mismatch" if a
+ * trapdoor's key hash is not the key hash of the set.
+ */
+
+constexpr size_t PROTOCOL_FRAME_HEADER_BYTES = 9;
+constexpr uint32_t PROTOCOL_MAX_FRAME_BYTES = uint32_t(1) << 28;
+constexpr size_t PROTOCOL_MAX_EXPRESSION_DEPTH = 64;
+
+enum protocol_op : uint8_t
+{
+    OP_LIST = 1,
+    OP_CONTAINS = 2,
+    OP_EVALUATE = 3,
+    OP_LOOKUP = 4
+};
+
+enum protocol_status : uint8_t
+{
+    STATUS_OK = 0,
+    STATUS_ERROR = 1
+};
+
+enum set_expression_op : uint8_t
+{
+    EXPR_SET = 1,
+    EXPR_UNION = 2,
+    EXPR_INTERSECTION = 3,
+    EXPR_DIFFERENCE = 4,
+    EXPR_COMPLEMENT = 5
+};
+
+/**
+ * Appends the fields of a frame to a buffer.
+ */
+struct frame_writer
+{
+    vector<uint8_t> & out;
+    size_t start;
+
+    /**
+     * Starts a frame at the end of out.
+     */
+    frame_writer(vector<uint8_t> & out, uint32_t id, uint8_t code) :
+        out(out),
+        start(out.size())
+    {
+        put32(0);
+        put32(id);
+        put8(code);
+    }
+
+    void put8(uint8_t x) { out.push_back(x); }
+
+    void put16(uint16_t x)
+    {
+        put8((uint8_t)x);
+        put8((uint8_t)(x >> 8));
+    }
+
+    void put32(uint32_t x)
+    {
+        auto const n = out.size();
+        out.resize(n + 4);
+        store_le32(out.data() + n, x);
+    }
+
+    void put64(uint64_t x)
+    {
+        auto const n = out.size();
+        out.resize(n + 8);
+        store_le64(out.data() + n, x);
+    }
+
+    void put(void const * p, size_t bytes)
+    {
+        auto const b = (uint8_t const *)p;
+        out.insert(out.end(), b, b + bytes);
+    }
+
+    template <typename I>
+    void put_trapdoors(I begin, I end)
+    {
+        auto const n = out.size();
+        out.resize(n + (size_t)std::distance(begin, end) * TRAPDOOR_RECORD_BYTES);
+        encode_trapdoors(begin, end, out.data() + n);
+    }
+
+    /**
+     * Patches the length of the frame; call once all fields are written.
+     */
+    void finish()
+    {
+        auto const length = out.size() - start - 4;
+        if (length > PROTOCOL_MAX_FRAME_BYTES)
+            throw runtime_error("frame too large");
+        store_le32(out.data() + start, (uint32_t)length);
+    }
+};
+
+/**
+ * Reads the fields of a frame's payload, throwing on a truncated frame.
+ */
+struct frame_reader
+{
+    uint8_t const * p;
+    uint8_t const * end;
+
+    void need(size_t bytes) const
+    {
+        if ((size_t)(end - p) < bytes)
+            throw runtime_error("truncated frame");
+    }
+
+    uint8_t get8()
+    {
+        need(1);
+        return *p++;
+    }
+
+    uint16_t get16()
+    {
+        need(2);
+        auto const x = (uint16_t)(p[0] | (p[1] << 8));
+        p += 2;
+        return x;
+    }
+
+    uint32_t get32()
+    {
+        need(4);
+        auto const x = load_le32(p);
+        p += 4;
+        return x;
+    }
+
+    uint64_t get64()
+    {
+        need(8);
+        auto const x = load_le64(p);
+        p += 8;
+        return x;
+    }
+
+    /**
+     * Returns the next bytes and skips them.
+     */
+    uint8_t const * take(size_t bytes)
+    {
+        need(bytes);
+        auto const q = p;
+        p += bytes;
+        return q;
+    }
+
+    /**
+     * Returns n trapdoor records in place and skips them.
+     */
+    uint8_t const * take_trapdoors(size_t n)
+    {
+        if (n > (size_t)(end - p) / TRAPDOOR_RECORD_BYTES)
+            throw runtime_error("truncated frame");
+        return take(n * TRAPDOOR_RECORD_BYTES);
+    }
+
+    size_t remaining() const { return (size_t)(end - p); }
+};
+
+/**
+ * A set expression in postfix form.
+ */
+struct set_expression
+{
+    vector<uint8_t> code;
+};
+
+inline set_expression expr_set(uint32_t id)
+{
+    set_expression e;
+    e.code.resize(5);
+    e.code[0] = EXPR_SET;
+    store_le32(e.code.data() + 1, id);
+    return e;
+}
+
+namespace detail
+{
+    inline set_expression binary_expression(
+        set_expression a,
+        set_expression const & b,
+        set_expression_op op)
+    {
+        a.code.insert(a.code.end(), b.code.begin(), b.code.end());
+        a.code.push_back(op);
+        return a;
+    }
+}
+
+inline set_expression operator|(set_expression a, set_expression const & b)
+{
+    return detail::binary_expression(std::move(a), b, EXPR_UNION);
+}
+
+inline set_expression operator&(set_expression a, set_expression const & b)
+{
+    return detail::binary_expression(std::move(a), b, EXPR_INTERSECTION);
+}
+
+inline set_expression operator-(set_expression a, set_expression const & b)
+{
+    return detail::binary_expression(std::move(a), b, EXPR_DIFFERENCE);
+}
+
+inline set_expression operator!(set_expression a)
+{
+    a.code.push_back(EXPR_COMPLEMENT);
+    return a;
+}
+
+struct set_info
+{
+    uint32_t id;
+    uint64_t rows;
+    string name;
+};
+
+inline void encode_list_request(vector<uint8_t> & out, uint32_t id)
+{
+    frame_writer f(out, id, OP_LIST);
+    f.finish();
+}
+
+template <typename I>
+void encode_contains_request(vector<uint8_t> & out, uint32_t id, uint32_t set, I begin, I end)
+{
+    frame_writer f(out, id, OP_CONTAINS);
+    f.put32(set);
+    f.put32((uint32_t)std::distance(begin, end));
+    f.put_trapdoors(begin, end);
+    f.finish();
+}
+
+template <typename I>
+void encode_evaluate_request(
+    vector<uint8_t> & out,
+    uint32_t id,
+    set_expression const & e,
+    I begin,
+    I end)
+{
+    frame_writer f(out, id, OP_EVALUATE);
+    f.put32((uint32_t)e.code.size());
+    f.put(e.code.data(), e.code.size());
+    f.put32((uint32_t)std::distance(begin, end));
+    f.put_trapdoors(begin, end);
+    f.finish();
+}
+
+template <typename I>
+void encode_lookup_request(vector<uint8_t> & out, uint32_t id, uint32_t set, I begin, I end)
+{
+    frame_writer f(out, id, OP_LOOKUP);
+    f.put32(set);
+    f.put32((uint32_t)std::distance(begin, end));
+    f.put_trapdoors(begin, end);
+    f.finish();
+}
+
+inline vector<set_info> decode_list_response(frame_reader r)
+{
+    vector<set_info> sets(r.get32());
+    for (auto & s : sets)
+    {
+        s.id = r.get32();
+        s.rows = r.get64();
+        auto const n = r.get16();
+        auto const name = r.take(n);
+        s.name.assign((char const *)name, n);
+    }
+    return sets;
+}
+
+/**
+ * Decodes the bitmap of OP_CONTAINS and OP_EVALUATE.
+ */
+inline vector<bool> decode_membership_response(frame_reader r)
+{
+    vector<bool> member(r.get32());
+    auto const bits = r.take((member.size() + 7) / 8);
+    for (size_t i = 0; i < member.size(); ++i)
+        member[i] = (bits[i / 8] >> (i % 8)) & 1;
+    return member;
+}
+
+inline vector<vector<uint64_t>> decode_lookup_response(frame_reader r)
+{
+    vector<vector<uint64_t>> rows(r.get32());
+    for (auto & q : rows)
+    {
+        auto const n = r.get32();
+        if (n > r.remaining() / 8)
+            throw runtime_error("truncated frame");
+        q.resize(n);
+        for (auto & row : q)
+            row = r.get64();
+    }
+    return rows;
+}
@@ -0,0 +1,648 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "trapdoor_protocol.hpp"
+using std::invalid_argument;
+using std::pair;
+using std::runtime_error;
+using std::shared_ptr;
+using std::size_t;
+using std::string;
+using std::vector;
+
+/**
+ * A local query server for trapdoor sets.
+ *
+ * Services on one machine that query the same large trapdoor tables would
+ * each hold a copy. The server loads the tables once and answers the
+ * requests of trapdoor_protocol.hpp over Unix domain sockets.
+ *
+ * A table is a trapdoor file (trapdoor_io.hpp), mapped read-only and shared
+ * (MAP_SHARED), so its pages live once in the page cache however many
+ * servers map it. Each column c of a table loaded as NAME is a set, named
+ * NAME if the table has one column and NAME.c otherwise, whose elements are
+ * the column's trapdoors. A set's key hash is that of its first row; rows
+ * under another key are not elements. For each set, the catalog builds an
+ * index of (value hash, row) pairs sorted by value hash, which answers
+ * membership (OP_CONTAINS, OP_EVALUATE) and equality lookups (OP_LOOKUP) by
+ * binary search. Membership is exact, since the index holds the trapdoors
+ * themselves, up to the collisions of the value hash.
+ *
+ * Each connection is served by its own thread, which reads as many
+ * requests as have arrived, answers them in order into one buffer and sends
+ * it with one system call, so a client that pipelines requests pays one
+ * round trip per batch of requests. A frame that violates the protocol
+ * (e.g., a length over PROTOCOL_MAX_FRAME_BYTES) closes the connection; a
+ * request that fails (e.g., an unknown set or a key mismatch) is answered
+ * with STATUS_ERROR.
+ *
+ * connect_local() serves one end of a socket pair and returns the other,
+ * so a trapdoor_client (trapdoor_client.hpp) in the same process can test
+ * against the catalog without a socket path. tools/trapdoor_server.cpp is
+ * the standalone server.
+ */
+
+/**
+ * A trapdoor file mapped read-only.
+ */
+class mapped_trapdoor_file
+{
+public:
+    explicit mapped_trapdoor_file(string const & path)
+    {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw runtime_error("cannot open " + path);
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || (size_t)st.st_size < TRAPDOOR_FILE_HEADER_BYTES)
+        {
+            ::close(fd);
+            throw runtime_error(path + ": truncated trapdoor file header");
+        }
+
+        bytes = (size_t)st.st_size;
+        auto p = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            ::close(fd);
+            throw runtime_error("cannot map " + path);
+        }
+        base = (uint8_t const *)p;
+
+        auto h = decode_trapdoor_file_header(base);
+        auto const row_bytes = h ? (size_t)h->columns * TRAPDOOR_RECORD_BYTES : 0;
+        if (!h || (bytes - TRAPDOOR_FILE_HEADER_BYTES) % row_bytes != 0)
+        {
+            ::munmap(p, bytes);
+            ::close(fd);
+            throw runtime_error(path + ": not a trapdoor file");
+        }
+        header = *h;
+        row_count = (bytes - TRAPDOOR_FILE_HEADER_BYTES) / row_bytes;
+    }
+
+    mapped_trapdoor_file(mapped_trapdoor_file const &) = delete;
+    mapped_trapdoor_file & operator=(mapped_trapdoor_file const &) = delete;
+
+    ~mapped_trapdoor_file()
+    {
+        ::munmap((void *)base, bytes);
+        ::close(fd);
+    }
+
+    uint32_t columns() const { return header.columns; }
+    uint64_t rows() const { return row_count; }
+
+    uint8_t const * record(uint64_t row, uint32_t column) const
+    {
+        return base + TRAPDOOR_FILE_HEADER_BYTES +
+            (row * header.columns + column) * TRAPDOOR_RECORD_BYTES;
+    }
+
+    uint64_t value_hash(uint64_t row, uint32_t column) const
+    {
+        return load_le64(record(row, column));
+    }
+
+    uint64_t key_hash(uint64_t row, uint32_t column) const
+    {
+        return load_le64(record(row, column) + 8);
+    }
+
+private:
+    int fd;
+    uint8_t const * base;
+    size_t bytes;
+    trapdoor_file_header header;
+    uint64_t row_count;
+};
+
+/**
+ * A column of a mapped table, indexed by value hash.
+ */
+struct trapdoor_column_set
+{
+    uint32_t id;
+    string name;
+    shared_ptr<mapped_trapdoor_file> file;
+    uint32_t column;
+    uint64_t key_hash;
+    vector<pair<uint64_t,uint64_t>> index;      // (value hash, row)
+
+    void check_key(uint64_t k) const
+    {
+        if (!index.empty() && k != key_hash)
+            throw invalid_argument("secret key mismatch");
+    }
+
+    bool contains(uint64_t value_hash) const
+    {
+        auto it = std::lower_bound(index.begin(), index.end(),
+            pair<uint64_t,uint64_t>(value_hash, 0));
+        return it != index.end() && it->first == value_hash;
+    }
+
+    /**
+     * The index entries of the rows with the value hash.
+     */
+    auto rows(uint64_t value_hash) const
+    {
+        auto lo = std::lower_bound(index.begin(), index.end(),
+            pair<uint64_t,uint64_t>(value_hash, 0));
+        auto hi = lo;
+        while (hi != index.end() && hi->first == value_hash)
+            ++hi;
+        return std::make_pair(lo, hi);
+    }
+};
+
+class trapdoor_catalog
+{
+public:
+    /**
+     * Maps a trapdoor file, indexes its columns as sets and returns their
+     * ids. Tables are loaded before the catalog is served. A set name is
+     * listed with a 16-bit length, so a name longer than 65535 bytes is
+     * refused before anything is loaded.
+     */
+    vector<uint32_t> load(string const & path, string const & name)
+    {
+        auto file = std::make_shared<mapped_trapdoor_file>(path);
+        vector<string> names;
+        for (uint32_t c = 0; c < file->columns(); ++c)
+        {
+            names.push_back(file->columns() == 1 ? name : name + "." + std::to_string(c));
+            if (names.back().size() > UINT16_MAX)
+                throw invalid_argument("set name longer than 65535 bytes");
+        }
+
+        vector<uint32_t> ids;
+        for (uint32_t c = 0; c < file->columns(); ++c)
+        {
+            trapdoor_column_set s;
+            s.id = (uint32_t)column_sets.size();
+            s.name = std::move(names[c]);
+            s.file = file;
+            s.column = c;
+            s.key_hash = file->rows() > 0 ? file->key_hash(0, c) : 0;
+            s.index.reserve(file->rows());
+            for (uint64_t r = 0; r < file->rows(); ++r)
+                if (file->key_hash(r, c) == s.key_hash)
+                    s.index.emplace_back(file->value_hash(r, c), r);
+            std::sort(s.index.begin(), s.index.end());
+            ids.push_back(s.id);
+            column_sets.push_back(std::move(s));
+        }
+        return ids;
+    }
+
+    vector<trapdoor_column_set> const & sets() const { return column_sets; }
+
+    trapdoor_column_set const & set(uint32_t id) const
+    {
+        if (id >= column_sets.size())
+            throw runtime_error("no set " + std::to_string(id));
+        return column_sets[id];
+    }
+
+private:
+    vector<trapdoor_column_set> column_sets;
+};
+
+namespace detail
+{
+    /**
+     * The membership bitmap of n trapdoor records in a set.
+     */
+    inline vector<uint8_t> membership_bitmap(
+        trapdoor_column_set const & s,
+        uint8_t const * records,
+        size_t n)
+    {
+        vector<uint8_t> bits((n + 7) / 8, 0);
+        for (size_t i = 0; i < n; ++i, records += TRAPDOOR_RECORD_BYTES)
+        {
+            s.check_key(load_le64(records + 8));
+            bits[i / 8] |= (uint8_t)(s.contains(load_le64(records)) << (i % 8));
+        }
+        return bits;
+    }
+
+    /**
+     * Checks a set expression's code before it is evaluated: each entry of
+     * the evaluation stack is a bitmap of the whole batch, so a program
+     * deeper than PROTOCOL_MAX_EXPRESSION_DEPTH is refused up front.
+     */
+    inline void check_expression(frame_reader code)
+    {
+        size_t depth = 0;
+        while (code.remaining() > 0)
+        {
+            switch (code.get8())
+            {
+            case EXPR_SET:
+                code.get32();
+                if (++depth > PROTOCOL_MAX_EXPRESSION_DEPTH)
+                    throw runtime_error("set expression deeper than " +
+                        std::to_string(PROTOCOL_MAX_EXPRESSION_DEPTH));
+                break;
+            case EXPR_COMPLEMENT:
+                if (depth < 1)
+                    throw runtime_error("malformed set expression");
+                break;
+            case EXPR_UNION:
+            case EXPR_INTERSECTION:
+            case EXPR_DIFFERENCE:
+                if (depth < 2)
+                    throw runtime_error("malformed set expression");
+                --depth;
+                break;
+            default:
+                throw runtime_error("malformed set expression");
+            }
+        }
+        if (depth != 1)
+            throw runtime_error("malformed set expression");
+    }
+
+    inline vector<uint8_t> evaluate_expression(
+        trapdoor_catalog const & catalog,
+        frame_reader code,
+        uint8_t const * records,
+        size_t n)
+    {
+        check_expression(code);
+
+        vector<vector<uint8_t>> stack;
+        auto pop = [&]
+        {
+            if (stack.empty())
+                throw runtime_error("malformed set expression");
+            auto top = std::move(stack.back());
+            stack.pop_back();
+            return top;
+        };
+
+        while (code.remaining() > 0)
+        {
+            auto const op = code.get8();
+            if (op == EXPR_SET)
+            {
+                stack.push_back(membership_bitmap(catalog.set(code.get32()), records, n));
+                continue;
+            }
+            if (op == EXPR_COMPLEMENT)
+            {
+                auto a = pop();
+                for (auto & b : a)
+                    b = (uint8_t)~b;
+                stack.push_back(std::move(a));
+                continue;
+            }
+
+            auto b = pop();
+            auto a = pop();
+            for (size_t i = 0; i < a.size(); ++i)
+            {
+                switch (op)
+                {
+                case EXPR_UNION: a[i] |= b[i]; break;
+                case EXPR_INTERSECTION: a[i] &= b[i]; break;
+                case EXPR_DIFFERENCE: a[i] &= (uint8_t)~b[i]; break;
+                default: throw runtime_error("malformed set expression");
+                }
+            }
+            stack.push_back(std::move(a));
+        }
+
+        auto result = pop();
+        if (!stack.empty())
+            throw runtime_error("malformed set expression");
+        if (n % 8 != 0)
+            result.back() &= (uint8_t)((1u << (n % 8)) - 1);
+        return result;
+    }
+}
+
+/**
+ * Answers one request, appending the response frame to out.
+ */
+inline void handle_trapdoor_request(
+    trapdoor_catalog const & catalog,
+    uint32_t id,
+    uint8_t op,
+    frame_reader r,
+    vector<uint8_t> & out)
+{
+    auto const start = out.size();
+    try
+    {
+        frame_writer f(out, id, STATUS_OK);
+        switch (op)
+        {
+        case OP_LIST:
+            f.put32((uint32_t)catalog.sets().size());
+            for (auto const & s : catalog.sets())
+            {
+                f.put32(s.id);
+                f.put64(s.file->rows());
+                f.put16((uint16_t)s.name.size());
+                f.put(s.name.data(), s.name.size());
+            }
+            break;
+
+        case OP_CONTAINS:
+        {
+            auto const & s = catalog.set(r.get32());
+            auto const n = r.get32();
+            auto const bits = detail::membership_bitmap(s, r.take_trapdoors(n), n);
+            f.put32(n);
+            f.put(bits.data(), bits.size());
+            break;
+        }
+
+        case OP_EVALUATE:
+        {
+            auto const length = r.get32();
+            auto const code = r.take(length);
+            auto const n = r.get32();
+            auto const bits = detail::evaluate_expression(catalog,
+                frame_reader{code, code + length}, r.take_trapdoors(n), n);
+            f.put32(n);
+            f.put(bits.data(), bits.size());
+            break;
+        }
+
+        case OP_LOOKUP:
+        {
+            auto const & s = catalog.set(r.get32());
+            auto const n = r.get32();
+            auto records = r.take_trapdoors(n);
+            f.put32(n);
+            for (uint32_t i = 0; i < n; ++i, records += TRAPDOOR_RECORD_BYTES)
+            {
+                s.check_key(load_le64(records + 8));
+                auto const [lo, hi] = s.rows(load_le64(records));
+                f.put32((uint32_t)(hi - lo));
+                for (auto it = lo; it != hi; ++it)
+                    f.put64(it->second);
+            }
+            break;
+        }
+
+        default:
+            throw runtime_error("unknown operation " + std::to_string(op));
+        }
+        f.finish();
+    }
+    catch (std::exception const & e)
+    {
+        out.resize(start);
+        frame_writer f(out, id, STATUS_ERROR);
+        f.put(e.what(), std::strlen(e.what()));
+        f.finish();
+    }
+}
+
+class trapdoor_server
+{
+public:
+    explicit trapdoor_server(trapdoor_catalog const & catalog) : catalog(catalog) {}
+
+    trapdoor_server(trapdoor_server const &) = delete;
+    trapdoor_server & operator=(trapdoor_server const &) = delete;
+
+    ~trapdoor_server() { stop(); }
+
+    /**
+     * Listens on a Unix socket at path and serves its connections until
+     * stop(). A stale socket at path is replaced; any other file there is
+     * left alone, and the server fails to listen.
+     */
+    void serve(string const & path)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            throw runtime_error("socket path too long: " + path);
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        int const fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            throw runtime_error("cannot create socket");
+        unlink_socket(path);
+        if (::bind(fd, (sockaddr const *)&addr, sizeof(addr)) != 0 || ::listen(fd, 128) != 0)
+        {
+            ::close(fd);
+            throw runtime_error("cannot listen on " + path);
+        }
+
+        {
+            std::lock_guard<std::mutex> g(lock);
+            if (stopping)
+            {
+                ::close(fd);
+                unlink_socket(path);
+                return;
+            }
+            listen_fd = fd;
+        }
+
+        for (;;)
+        {
+            int const c = ::accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (c >= 0)
+            {
+                start_connection(c);
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> g(lock);
+            listen_fd = -1;
+        }
+        ::close(fd);
+        unlink_socket(path);
+    }
+
+    /**
+     * Serves one end of a socket pair and returns the other, for a client
+     * in the same process. The caller owns the returned descriptor.
+     */
+    int connect_local()
+    {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+            throw runtime_error("cannot create socket pair");
+        start_connection(fds[0]);
+        return fds[1];
+    }
+
+    /**
+     * Serves a connected socket on the calling thread until the peer closes
+     * it or stop(), then closes it.
+     */
+    void serve_socket(int fd)
+    {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            if (stopping)
+            {
+                ::close(fd);
+                return;
+            }
+            open_fds.push_back(fd);
+        }
+        serve_connection(fd);
+    }
+
+    /**
+     * Stops accepting, closes the connections and waits for their threads.
+     */
+    void stop()
+    {
+        std::unique_lock<std::mutex> g(lock);
+        stopping = true;
+        if (listen_fd >= 0)
+            ::shutdown(listen_fd, SHUT_RDWR);
+        for (auto fd : open_fds)
+            ::shutdown(fd, SHUT_RDWR);
+        drained.wait(g, [&] { return live == 0; });
+    }
+
+private:
+    /**
+     * Removes the file at path if it is a socket.
+     */
+    static void unlink_socket(string const & path)
+    {
+        struct stat st;
+        if (::lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            ::unlink(path.c_str());
+    }
+
+    /**
+     * Serves fd on a thread of its own. The thread is detached, so a
+     * long-running server does not accumulate finished threads; stop()
+     * waits for the live ones instead of joining them.
+     */
+    void start_connection(int fd)
+    {
+        std::lock_guard<std::mutex> g(lock);
+        if (stopping)
+        {
+            ::close(fd);
+            return;
+        }
+        std::thread t;
+        try
+        {
+            t = std::thread([this, fd]
+            {
+                serve_connection(fd);
+                std::lock_guard<std::mutex> g(lock);
+                if (--live == 0)
+                    drained.notify_all();
+            });
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        open_fds.push_back(fd);
+        ++live;
+        t.detach();
+    }
+
+    static bool send_all(int fd, vector<uint8_t> const & bytes)
+    {
+        size_t sent = 0;
+        while (sent < bytes.size())
+        {
+            auto const n = ::send(fd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            sent += (size_t)n;
+        }
+        return true;
+    }
+
+    void serve_connection(int fd)
+    {
+        constexpr size_t READ_BYTES = size_t(1) << 16;
+        vector<uint8_t> in, out;
+        size_t filled = 0;
+        for (bool open = true; open;)
+        {
+            if (in.size() < filled + READ_BYTES)
+                in.resize(filled + READ_BYTES);
+            auto const n = ::recv(fd, in.data() + filled, READ_BYTES, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            filled += (size_t)n;
+
+            size_t pos = 0;
+            while (filled - pos >= 4)
+            {
+                auto const length = load_le32(in.data() + pos);
+                if (length < PROTOCOL_FRAME_HEADER_BYTES - 4 || length > PROTOCOL_MAX_FRAME_BYTES)
+                {
+                    open = false;
+                    break;
+                }
+                if (filled - pos - 4 < length)
+                    break;
+
+                auto const frame = in.data() + pos;
+                handle_trapdoor_request(catalog, load_le32(frame + 4), frame[8],
+                    frame_reader{frame + PROTOCOL_FRAME_HEADER_BYTES, frame + 4 + length}, out);
+                pos += 4 + length;
+            }
+
+            std::memmove(in.data(), in.data() + pos, filled - pos);
+            filled -= pos;
+            if (!send_all(fd, out))
+                break;
+            out.clear();
+        }
+
+        std::lock_guard<std::mutex> g(lock);
+        open_fds.erase(std::find(open_fds.begin(), open_fds.end(), fd));
+        ::close(fd);
+    }
+
+    trapdoor_catalog const & catalog;
+    std::mutex lock;
+    std::condition_variable drained;
+    size_t live = 0;                    // connection threads not yet done
+    vector<int> open_fds;
+    int listen_fd = -1;
+    bool stopping = false;
+};
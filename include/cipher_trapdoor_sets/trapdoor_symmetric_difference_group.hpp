@@ -65,6 +65,9 @@
 * 
  */
 
+#include "memory_usage.hpp"
+#include "operation_metrics.hpp"
+
 template <typename X, size_t N>
 struct trapdoor_symmetric_difference_group
 {
@@ -85,6 +88,12 @@ struct trapdoor_symmetric_difference_group
     array<char,4> key_hash;
 };
 
+template <typename X, size_t N>
+memory_footprint memory_usage(trapdoor_symmetric_difference_group<X,N> const & xs)
+{
+    return memory_footprint{sizeof(xs), 0, CHAR_BIT * (N + 4)};
+}
+
 /**
  * This is the only function implicitly defined for the type.
  * Other functions of the type must use a cipher map.
@@ -94,6 +103,7 @@ approximate_bool operator==(
     trapdoor_symmetric_difference_group<X,N> const & lhs,
     trapdoor_symmetric_difference_group<X,N> const & rhs)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_SET_OP);
     return approximate_bool{lhs.value_hash == rhs.value_hash, .5};
 }
 
@@ -113,8 +123,12 @@ auto operator+(
     trapdoor_symmetric_difference_group<X,N> const & x,
     trapdoor_symmetric_difference_group<X,N> const & y)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_SET_OP);
     if (key_hash(x) != key_hash(y))
+    {
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
         throw invalid_argument("secret key mismatch");
+    }
 
     // since xor (^) is assocative and commutative,
     //     + : trapdoor_symmetric_difference_group<X> -> trapdoor_symmetric_difference_group<X> -> trapdoor_symmetric_difference_group<X>
@@ -127,8 +141,12 @@ auto operator+(
 template <typename X>
 auto operator+(trapdoor_symmetric_difference_group<X> const & xs, trapdoor<X> const & x)
 {
+    CIPHER_TRAPDOOR_SETS_TIMED(METRIC_SET_OP);
     if (key_hash(x) != key_hash(y))
+    {
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_KEY_MISMATCH);
         throw invalid_argument("secret key mismatch");
+    }
 
     return trapdoor_symmetric_difference_group<X>(
         hash(xs) ^ hash(x),
@@ -144,6 +162,9 @@ template <typename X>
 approximate_bool empty(trapdoor_symmetric_difference_group<X> const & xs)
 {
     // additive identity is the zero bit string.
-    return approximate_bool{xs.hash_value == 0,.5};
+    auto b = xs.hash_value == 0;
+    if (b)
+        CIPHER_TRAPDOOR_SETS_COUNT(METRIC_EMPTY_RESULT);
+    return approximate_bool{b,.5};
 }
 
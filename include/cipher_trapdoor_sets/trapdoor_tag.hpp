@@ -40,12 +40,17 @@
 
 
 #include <string>
+#include <string_view>
 #include <cmath>
+#include <cstddef>
+#include <type_traits>
 #include <utility>
+#include "type_fingerprint.hpp"
 using std::pair;
 using std::string;
 using std::size_t;
 using std::make_pair;
+using std::string_view;
 using std::strtoull;
 using std::to_string;
 
@@ -105,6 +110,54 @@ namespace alex::cipher
         }
     };        
 
+    /**
+     * The trapdoor tag of type T under the key hash, i.e., its keyed
+     * compile-time fingerprint (type_fingerprint.hpp).
+     */
+    template <typename T>
+    constexpr trapdoor_tag make_trapdoor_tag(size_t key_hash)
+    {
+        return trapdoor_tag{(size_t)keyed_fingerprint(key_hash, type_fingerprint_v<T>)};
+    }
+
+    /**
+     * The trapdoor tags of the types Ts under one key, computed once when
+     * the table is made (e.g., at startup, when the key is loaded):
+     *
+     *     trapdoor_tag_table<bool, int, cipher_string> tags(key_hash);
+     *     if (x.tag != tags.get<int>()) ...
+     *
+     * get<T>() is an array load at a compile-time index, so type-checked
+     * composition of cipher values does no hashing at run time.
+     */
+    template <typename... Ts>
+    class trapdoor_tag_table
+    {
+    public:
+        explicit trapdoor_tag_table(size_t key_hash) :
+            tags{make_trapdoor_tag<Ts>(key_hash)...} {}
+
+        template <typename T>
+        trapdoor_tag const & get() const
+        {
+            static_assert(INDEX<T> < sizeof...(Ts), "type not in the tag table");
+            return tags[INDEX<T>];
+        }
+
+    private:
+        template <typename T>
+        static constexpr size_t INDEX = []
+        {
+            bool const same[] = {std::is_same_v<T,Ts>...};
+            size_t i = 0;
+            while (i < sizeof...(Ts) && !same[i])
+                ++i;
+            return i;
+        }();
+
+        trapdoor_tag tags[sizeof...(Ts)];
+    };
+
     template <typename T>
     struct serialize {};
 
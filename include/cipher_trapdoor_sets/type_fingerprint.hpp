@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+using std::size_t;
+using std::string_view;
+using std::uint64_t;
+
+/**
+ * Compile-time fingerprints of types.
+ *
+ * Digests of cipher values (e.g., hash(trapdoor_boolean_algebra<X,N>) and
+ * nested set digests) mix in a fingerprint of the value type so that values
+ * of different types do not compare equal, and a trapdoor_tag is a keyed
+ * fingerprint. The fingerprint of X is the 64-bit FNV-1a hash of the
+ * canonical name of X,
+ *
+ *     type_fingerprint_v<X> = fnv1a(canonical_type_name<X>::value),
+ *
+ * a constant expression, so no type is hashed at run time. Unlike a hash
+ * of typeid(X), it is the same in every process built by the same compiler,
+ * so a digest written by one process is comparable in another.
+ *
+ * The canonical name defaults to the compiler's spelling of the type (from
+ * __PRETTY_FUNCTION__ or __FUNCSIG__), e.g., "int" or
+ * "std::vector<int>"; that spelling may differ between compilers and
+ * standard libraries. For a fingerprint that is stable across them,
+ * specialize canonical_type_name:
+ *
+ *     template <>
+ *     struct canonical_type_name<cipher_string>
+ *     {
+ *         static constexpr string_view value = "cipher_string";
+ *     };
+ *
+ * Keying a fingerprint (keyed_fingerprint) mixes in the hash of a secret,
+ * which trapdoor_tag_table (trapdoor_tag.hpp) does once per key and type.
+ */
+
+constexpr uint64_t FNV1A_64_OFFSET = 0xcbf29ce484222325ull;
+constexpr uint64_t FNV1A_64_PRIME = 0x100000001b3ull;
+
+constexpr uint64_t fnv1a_64(string_view s, uint64_t h = FNV1A_64_OFFSET)
+{
+    for (auto c : s)
+    {
+        h ^= (uint64_t)(unsigned char)c;
+        h *= FNV1A_64_PRIME;
+    }
+    return h;
+}
+
+namespace detail
+{
+    /**
+     * The compiler's spelling of X.
+     */
+    template <typename X>
+    constexpr string_view compiler_type_name()
+    {
+#if defined(__clang__) || defined(__GNUC__)
+        // "... compiler_type_name() [with X = int; string_view = ...]" (gcc)
+        // "... compiler_type_name() [X = int]" (clang)
+        string_view const p = __PRETTY_FUNCTION__;
+        auto const b = p.find("X = ") + 4;
+        auto e = p.find("; ", b);
+        if (e == string_view::npos)
+            e = p.rfind(']');
+        return p.substr(b, e - b);
+#elif defined(_MSC_VER)
+        // "... __cdecl detail::compiler_type_name<int>(void)"
+        string_view const p = __FUNCSIG__;
+        auto const b = p.find("compiler_type_name<") + 19;
+        auto const e = p.rfind(">(void)");
+        return p.substr(b, e - b);
+#else
+#error "type_fingerprint.hpp needs __PRETTY_FUNCTION__ or __FUNCSIG__"
+#endif
+    }
+}
+
+template <typename X>
+struct canonical_type_name
+{
+    static constexpr string_view value = detail::compiler_type_name<X>();
+};
+
+template <typename X>
+constexpr uint64_t type_fingerprint_v =
+    fnv1a_64(canonical_type_name<std::remove_cv_t<X>>::value);
+
+template <typename X>
+constexpr size_t type_fingerprint()
+{
+    return (size_t)type_fingerprint_v<X>;
+}
+
+/**
+ * The fingerprint keyed by the hash of a secret: a bijective mix (the
+ * fmix64 finalizer) of their combination, so distinct types under one key
+ * have distinct keyed fingerprints.
+ */
+constexpr uint64_t keyed_fingerprint(uint64_t key_hash, uint64_t fingerprint)
+{
+    auto x = fingerprint ^ (key_hash * 0x9e3779b97f4a7c15ull);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
@@ -0,0 +1,145 @@
+/**
+ * hot_swap_stress exercises the epoch-based reclamation of hot_swap.hpp:
+ *
+ *     readers     8 threads read two hot-swapped sets, one read nested in
+ *                 the other, and check that every version they see is
+ *                 whole (not freed or reused) and that the versions of
+ *                 each set they see never go back
+ *     writers     one thread per set publishes new versions, both at once
+ *     churn       reader threads exit and are replaced while the writers
+ *                 run, so thread records are returned and claimed again
+ *
+ * At the end every retired version must have been freed, exactly once.
+ * Build with -fsanitize=address as well to catch a version freed under a
+ * reader.
+ *
+ * Usage:
+ *     hot_swap_stress [ROUNDS]            (default: 20)
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tests/hot_swap_stress.cpp \
+ *         -o hot_swap_stress
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "cipher_trapdoor_sets/hot_swap.hpp"
+#include "stress_util.hpp"
+using std::size_t;
+using std::uint64_t;
+using std::vector;
+
+namespace
+{
+    std::atomic<long> live_versions{0};
+
+    /**
+     * A version of a set: words all equal to id, poisoned when freed.
+     */
+    struct version_set
+    {
+        explicit version_set(uint64_t id) : id(id), words(64, id) { ++live_versions; }
+
+        version_set(version_set const &) = delete;
+        version_set & operator=(version_set const &) = delete;
+
+        ~version_set()
+        {
+            for (auto & w : words)
+                w = ~uint64_t(0);
+            id = ~uint64_t(0);
+            --live_versions;
+        }
+
+        bool whole() const
+        {
+            for (auto w : words)
+                if (w != id)
+                    return false;
+            return true;
+        }
+
+        uint64_t id;
+        vector<uint64_t> words;
+    };
+
+    size_t const READERS = 8;
+    size_t const PUBLISHES = 20000;        // per set and round
+    size_t const READS_PER_THREAD = 5000;  // before a reader thread is replaced
+
+    void round_case()
+    {
+        {
+            hot_swap<version_set> a(std::make_unique<version_set>(1));
+            hot_swap<version_set> b(std::make_unique<version_set>(1));
+            std::atomic<bool> done{false};
+
+            auto reader = [&]
+            {
+                uint64_t last_a = 0, last_b = 0;
+                bool ok = true;
+                for (size_t i = 0; i < READS_PER_THREAD && !done; ++i)
+                {
+                    a.read([&](version_set const & va)
+                    {
+                        ok = ok && va.whole() && va.id >= last_a;
+                        last_a = va.id;
+                        b.read([&](version_set const & vb)
+                        {
+                            ok = ok && vb.whole() && vb.id >= last_b && va.whole();
+                            last_b = vb.id;
+                        });
+                    });
+                }
+                stress_check(ok, "readers see whole versions that never go back");
+            };
+
+            vector<std::thread> readers;
+            for (size_t r = 0; r < READERS; ++r)
+                readers.emplace_back([&]
+                {
+                    // each slot replaces its reader thread until the
+                    // writers are done.
+                    while (!done)
+                    {
+                        std::thread t(reader);
+                        t.join();
+                    }
+                });
+
+            // one writer per set, so each set's ids rise; the writers
+            // retire into the shared epoch domain at once.
+            vector<std::thread> writers;
+            for (auto * live : {&a, &b})
+                writers.emplace_back([live]
+                {
+                    for (uint64_t id = 2; id < 2 + PUBLISHES; ++id)
+                        live->publish(std::make_unique<version_set>(id));
+                });
+
+            for (auto & t : writers)
+                t.join();
+            done = true;
+            for (auto & t : readers)
+                t.join();
+
+            stress_check(a.version() == PUBLISHES && b.version() == PUBLISHES,
+                "every publish counts as a version");
+            global_epoch_domain().synchronize();
+            stress_check(live_versions.load() == 2, "every retired version is freed");
+        }
+        stress_check(live_versions.load() == 0, "the current versions are freed with their sets");
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    auto const rounds = stress_rounds(argc, argv, 20);
+    for (size_t r = 0; r < rounds && stress_failures == 0; ++r)
+        round_case();
+    return stress_exit("hot_swap_stress");
+}
@@ -0,0 +1,201 @@
+/**
+ * sharded_trapdoor_set_stress runs a sharded_trapdoor_set.hpp end to end,
+ * with shard workers spawned from a built tools/trapdoor_server:
+ *
+ *     membership  5 shards answer a batch of members and non-members, and
+ *                 a trapdoor under another key is refused
+ *     rebuild     shards are rebuilt while another thread allocates, so
+ *                 workers are started in a multithreaded process; the
+ *                 rebuilt shard answers for its new contents and the
+ *                 others are untouched
+ *     recovery    a worker killed between probes makes the next probe
+ *                 throw, and the probe after it is answered in full by a
+ *                 new worker
+ *
+ * Usage:
+ *     sharded_trapdoor_set_stress SERVER [ROUNDS]  (default: 5)
+ *
+ *     SERVER is the path of the trapdoor_server binary.
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tools/trapdoor_server.cpp \
+ *         -o trapdoor_server
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tests/sharded_trapdoor_set_stress.cpp \
+ *         -o sharded_trapdoor_set_stress
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+#include "cipher_trapdoor_sets/sharded_trapdoor_set.hpp"
+#include "stress_util.hpp"
+using std::invalid_argument;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+namespace
+{
+    uint32_t const SHARDS = 5;
+    size_t const ROWS = 50000;
+    uint64_t const KEY = 7;
+
+    /**
+     * Value hash i, spread over the shards.
+     */
+    trapdoor<uint64_t> row(uint64_t i)
+    {
+        return trapdoor<uint64_t>{(i + 1) * 0x9E3779B97F4A7C15ull, KEY};
+    }
+
+    /**
+     * True if s holds exactly the rows [lo,hi) of those below 2 * ROWS.
+     */
+    bool holds(sharded_trapdoor_set & s, uint64_t lo, uint64_t hi)
+    {
+        vector<trapdoor<uint64_t>> qs;
+        for (uint64_t i = 0; i < 2 * ROWS; ++i)
+            qs.push_back(row(i));
+        auto const member = s.contains(qs.begin(), qs.end());
+        if (member.size() != qs.size())
+            return false;
+        for (uint64_t i = 0; i < 2 * ROWS; ++i)
+            if (member[i] != (lo <= i && i < hi))
+                return false;
+        return true;
+    }
+
+    /**
+     * The rows [lo,hi) that fall in shard i.
+     */
+    vector<trapdoor<uint64_t>> shard_rows(uint32_t i, uint64_t lo, uint64_t hi)
+    {
+        vector<trapdoor<uint64_t>> xs;
+        for (auto j = lo; j < hi; ++j)
+            if (shard_of(row(j).value_hash, SHARDS) == i)
+                xs.push_back(row(j));
+        return xs;
+    }
+
+    void membership_case(sharded_trapdoor_set & s)
+    {
+        stress_check(holds(s, 0, ROWS), "the shards answer for members and non-members");
+
+        bool refused = false;
+        try
+        {
+            s.contains(trapdoor<uint64_t>{1, KEY + 1});
+        }
+        catch (invalid_argument const &)
+        {
+            refused = true;
+        }
+        stress_check(refused, "a trapdoor under another key is refused");
+    }
+
+    /**
+     * Moves every shard's rows from [0,ROWS) to [ROWS,2 ROWS) one shard at
+     * a time, then back, checking the whole set after each rebuild.
+     */
+    void rebuild_case(sharded_trapdoor_set & s)
+    {
+        std::atomic<bool> done{false};
+        std::thread churn([&]
+        {
+            while (!done)
+                std::make_unique<vector<uint64_t>>(1000).reset();
+        });
+
+        bool ok = true;
+        for (uint64_t from : {uint64_t(0), uint64_t(ROWS)})
+        {
+            auto const to = ROWS - from;
+            for (uint32_t i = 0; i < SHARDS; ++i)
+            {
+                auto const xs = shard_rows(i, to, to + ROWS);
+                s.rebuild_shard(i, xs.begin(), xs.end());
+
+                // shards [0,i] hold the new rows, the others the old ones.
+                vector<trapdoor<uint64_t>> qs;
+                for (uint64_t j = 0; j < 2 * ROWS; ++j)
+                    qs.push_back(row(j));
+                auto const member = s.contains(qs.begin(), qs.end());
+                for (uint64_t j = 0; ok && j < 2 * ROWS; ++j)
+                {
+                    auto const moved = shard_of(qs[j].value_hash, SHARDS) <= i;
+                    auto const lo = moved ? to : from;
+                    ok = member[j] == (lo <= j && j < lo + ROWS);
+                }
+            }
+        }
+        done = true;
+        churn.join();
+        stress_check(ok, "a rebuilt shard answers for its new rows, the others for their old");
+    }
+
+    void recovery_case(sharded_trapdoor_set & s)
+    {
+        auto const victim = s.shard_pid(1);
+        ::kill(victim, SIGKILL);
+
+        bool failed = false;
+        try
+        {
+            holds(s, 0, ROWS);
+        }
+        catch (runtime_error const &)
+        {
+            failed = true;
+        }
+        stress_check(failed, "a probe of a killed worker's shard throws");
+        stress_check(holds(s, 0, ROWS), "the next probe is answered in full");
+        stress_check(s.shard_pid(1) > 0 && s.shard_pid(1) != victim,
+            "the killed worker is replaced");
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc < 2)
+    {
+        std::fprintf(stderr, "usage: sharded_trapdoor_set_stress SERVER [ROUNDS]\n");
+        return 2;
+    }
+    string const server = argv[1];
+    auto const rounds = stress_rounds(argc - 1, argv + 1, 5);
+
+    char dir[] = "/tmp/sharded_trapdoor_set_stress.XXXXXX";
+    if (!::mkdtemp(dir))
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+
+    {
+        vector<trapdoor<uint64_t>> xs;
+        for (uint64_t i = 0; i < ROWS; ++i)
+            xs.push_back(row(i));
+        sharded_trapdoor_set s(dir, SHARDS, xs.begin(), xs.end(), server);
+        for (size_t r = 0; r < rounds && stress_failures == 0; ++r)
+        {
+            membership_case(s);
+            rebuild_case(s);
+            recovery_case(s);
+        }
+    }
+
+    for (uint32_t i = 0; i < SHARDS; ++i)
+        ::unlink((string(dir) + "/shard-" + std::to_string(i) + ".trapdoors").c_str());
+    ::rmdir(dir);
+    return stress_exit("sharded_trapdoor_set_stress");
+}
@@ -0,0 +1,250 @@
+/**
+ * shared_set_segment_stress exercises the cross-process reclamation of
+ * shared_set_segment.hpp on a segment with the minimum of 3 slots:
+ *
+ *     processes   4 forked reader processes, each with its own mapping,
+ *                 read while the writer publishes; every version they see
+ *                 must be whole (its slot not reused under them) and the
+ *                 versions must never go back
+ *     threads     the same with 4 reader threads of the writer's process
+ *     crash       a reader process killed in the middle of a read must not
+ *                 block the writer: its reader slot is reaped; the version
+ *                 then read as another type of the same size is refused
+ *
+ * A regression shows as a failed check or, for the crash case, a hang; run
+ * the test under a timeout. Linux only.
+ *
+ * Usage:
+ *     shared_set_segment_stress [ROUNDS]  (default: 5)
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tests/shared_set_segment_stress.cpp \
+ *         -o shared_set_segment_stress -lrt
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "cipher_trapdoor_sets/shared_set_segment.hpp"
+#include "stress_util.hpp"
+using std::invalid_argument;
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+namespace
+{
+    /**
+     * A version: words all equal to id. The last version has id DONE.
+     */
+    struct version_value
+    {
+        uint64_t id;
+        uint64_t words[63];
+    };
+
+    /**
+     * A type of the size of version_value.
+     */
+    struct other_value
+    {
+        uint64_t words[64];
+    };
+
+    uint64_t const DONE = ~uint64_t(0);
+    size_t const READERS = 4;
+    uint64_t const PUBLISHES = 2000;
+
+    void publish_version(shared_set_writer & w, uint64_t id)
+    {
+        version_value v;
+        v.id = id;
+        for (auto & x : v.words)
+            x = id;
+        w.publish(v);
+    }
+
+    /**
+     * Reads until the last version is published; false if a version was
+     * torn or went back.
+     */
+    bool read_until_done(shared_set_segment const & segment)
+    {
+        shared_set_reader reader(segment);
+        uint64_t last = 0;
+        bool ok = true;
+        while (ok && last != DONE)
+        {
+            reader.read_as<version_value>([&](version_value const & v)
+            {
+                auto const id = v.id;
+                for (auto x : v.words)
+                    ok = ok && x == id;
+                ok = ok && id >= last;
+                last = id;
+            });
+        }
+        return ok;
+    }
+
+    void publish_all(shared_set_segment & segment)
+    {
+        shared_set_writer w(segment);
+        for (uint64_t id = 2; id < 2 + PUBLISHES; ++id)
+            publish_version(w, id);
+        publish_version(w, DONE);
+    }
+
+    void processes_case(string const & name)
+    {
+        auto segment = shared_set_segment::create(name, sizeof(version_value), 3, 16);
+        {
+            shared_set_writer w(segment);
+            publish_version(w, 1);
+        }
+
+        vector<pid_t> children;
+        for (size_t r = 0; r < READERS; ++r)
+        {
+            auto const pid = ::fork();
+            if (pid == 0)
+            {
+                // a reader left behind by a killed test would spin forever.
+                ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+                int status = 1;
+                try
+                {
+                    auto mine = shared_set_segment::open(name);
+                    status = read_until_done(mine) ? 0 : 1;
+                }
+                catch (...)
+                {
+                }
+                ::_exit(status);
+            }
+            if (pid > 0)
+                children.push_back(pid);
+        }
+        stress_check(children.size() == READERS, "fork the reader processes");
+
+        publish_all(segment);
+
+        bool ok = true;
+        for (auto pid : children)
+        {
+            int status = 0;
+            ok = ::waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+                WEXITSTATUS(status) == 0 && ok;
+        }
+        stress_check(ok, "reader processes see whole versions that never go back");
+        shared_set_segment::remove(name);
+    }
+
+    void threads_case(string const & name)
+    {
+        auto segment = shared_set_segment::create(name, sizeof(version_value), 3, 16);
+        {
+            shared_set_writer w(segment);
+            publish_version(w, 1);
+        }
+
+        std::atomic<size_t> good{0};
+        vector<std::thread> readers;
+        for (size_t r = 0; r < READERS; ++r)
+            readers.emplace_back([&]
+            {
+                good += read_until_done(segment);
+            });
+        publish_all(segment);
+        for (auto & t : readers)
+            t.join();
+        stress_check(good == READERS, "reader threads see whole versions that never go back");
+        shared_set_segment::remove(name);
+    }
+
+    void crash_case(string const & name)
+    {
+        auto segment = shared_set_segment::create(name, sizeof(version_value), 3, 16);
+        shared_set_writer w(segment);
+        publish_version(w, 1);
+
+        int ready[2];
+        if (::pipe(ready) != 0)
+        {
+            stress_check(false, "create a pipe");
+            return;
+        }
+        auto const pid = ::fork();
+        if (pid == 0)
+        {
+            auto mine = shared_set_segment::open(name);
+            shared_set_reader reader(mine);
+            reader.read([&](shared_version const &)
+            {
+                char c = 1;
+                (void)!::write(ready[1], &c, 1);
+                for (;;)
+                    ::pause();
+                return 0;
+            });
+            ::_exit(0);
+        }
+
+        char c = 0;
+        bool const started = pid > 0 && ::read(ready[0], &c, 1) == 1;
+        ::close(ready[0]);
+        ::close(ready[1]);
+        if (pid > 0)
+        {
+            ::kill(pid, SIGKILL);
+            ::waitpid(pid, nullptr, 0);
+        }
+        stress_check(started, "a reader process is killed inside a read");
+
+        // the dead reader announces an epoch older than every version
+        // retired from here on; the writer must reap it to find a slot.
+        for (uint64_t id = 2; id < 100; ++id)
+            publish_version(w, id);
+        shared_set_reader reader(segment);
+        auto const last = reader.read_as<version_value>([](version_value const & v) { return v.id; });
+        stress_check(last == 99, "the writer publishes past a killed reader");
+
+        bool refused = false;
+        try
+        {
+            reader.read_as<other_value>([](other_value const & v) { return v.words[0]; });
+        }
+        catch (invalid_argument const &)
+        {
+            refused = true;
+        }
+        stress_check(refused, "a version read as another type of its size is refused");
+        shared_set_segment::remove(name);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    auto const rounds = stress_rounds(argc, argv, 5);
+    auto const name = "/shared_set_segment_stress." + std::to_string(::getpid());
+
+    // the reader processes are forked before this process starts threads.
+    for (size_t r = 0; r < rounds && stress_failures == 0; ++r)
+    {
+        crash_case(name);
+        processes_case(name);
+    }
+    for (size_t r = 0; r < rounds && stress_failures == 0; ++r)
+        threads_case(name);
+
+    return stress_exit("shared_set_segment_stress");
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+using std::size_t;
+
+/**
+ * Shared pieces of the stress tests.
+ *
+ * Each stress test is a program that runs its cases for a number of rounds
+ * (the first argument, if given) and exits with status 1 if any check
+ * failed, so it can gate a build. The tests are meant to be run under the
+ * sanitizers as well, e.g., with -fsanitize=thread or
+ * -fsanitize=address,undefined added to their build lines.
+ */
+
+inline std::atomic<size_t> stress_failures{0};
+
+/**
+ * Records a failed check; may be called from any thread.
+ */
+inline void stress_check(bool ok, char const * what)
+{
+    if (ok)
+        return;
+    ++stress_failures;
+    std::fprintf(stderr, "FAILED: %s\n", what);
+}
+
+inline size_t stress_rounds(int argc, char ** argv, size_t rounds)
+{
+    if (argc > 1)
+        rounds = std::strtoull(argv[1], nullptr, 10);
+    return rounds;
+}
+
+inline int stress_exit(char const * name)
+{
+    std::fprintf(stderr, "%s: %s\n", name, stress_failures ? "FAILED" : "ok");
+    return stress_failures ? 1 : 0;
+}
@@ -0,0 +1,179 @@
+/**
+ * task_scheduler_stress exercises the work-stealing scheduler of
+ * task_scheduler.hpp under contention:
+ *
+ *     nested      parallel_for inside parallel_for, so workers wait on
+ *                 stolen halves while running other tasks
+ *     reduce      parallel_reduce over several grains, checking the sum and
+ *                 that the partial results are combined in range order
+ *     exceptions  a throwing range (at the top level and inside a nested
+ *                 call) is rethrown once from parallel_for, and the
+ *                 scheduler keeps working afterwards
+ *     external    8 threads that are not workers call parallel_for and
+ *                 parallel_reduce at once, through the injection queue
+ *
+ * Every case runs on a scheduler with more workers than this machine may
+ * have cores, so that steals and sleeps interleave, and is repeated for a
+ * number of rounds.
+ *
+ * Usage:
+ *     task_scheduler_stress [ROUNDS]      (default: 200)
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tests/task_scheduler_stress.cpp \
+ *         -o task_scheduler_stress
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "cipher_trapdoor_sets/task_scheduler.hpp"
+#include "stress_util.hpp"
+using std::pair;
+using std::runtime_error;
+using std::size_t;
+using std::vector;
+
+namespace
+{
+    void nested_case()
+    {
+        size_t const outer = 64, inner = 500;
+        vector<std::atomic<size_t>> hits(outer * inner);
+        parallel_for(0, outer, 1, [&](size_t lo, size_t hi)
+        {
+            for (auto i = lo; i < hi; ++i)
+                parallel_for(0, inner, 7, [&](size_t l, size_t h)
+                {
+                    for (auto j = l; j < h; ++j)
+                        hits[i * inner + j].fetch_add(1, std::memory_order_relaxed);
+                });
+        });
+
+        bool ok = true;
+        for (auto & h : hits)
+            ok = ok && h.load() == 1;
+        stress_check(ok, "nested parallel_for runs every index once");
+    }
+
+    void reduce_case()
+    {
+        size_t const n = 100000;
+        for (size_t grain : {1, 3, 64, 1000, 0})
+        {
+            auto const sum = parallel_reduce(0, n, grain, size_t(0),
+                [](size_t lo, size_t hi)
+                {
+                    size_t s = 0;
+                    for (auto i = lo; i < hi; ++i)
+                        s += i;
+                    return s;
+                },
+                [](size_t a, size_t b) { return a + b; });
+            stress_check(sum == n * (n - 1) / 2, "parallel_reduce sum");
+
+            // combining the subranges in order yields [0,n) again.
+            using range = pair<size_t,size_t>;
+            auto const whole = parallel_reduce(0, n, grain, range{0, 0},
+                [](size_t lo, size_t hi) { return range{lo, hi}; },
+                [](range a, range b)
+                {
+                    if (a.second != b.first)
+                        return range{1, 0};
+                    return range{a.first, b.second};
+                });
+            stress_check(whole == range{0, n}, "parallel_reduce combines in range order");
+        }
+    }
+
+    void exceptions_case()
+    {
+        size_t caught = 0;
+        try
+        {
+            parallel_for(0, 10000, 1, [](size_t lo, size_t)
+            {
+                if (lo == 4321)
+                    throw runtime_error("top");
+            });
+        }
+        catch (runtime_error const & e)
+        {
+            caught += std::string(e.what()) == "top";
+        }
+
+        try
+        {
+            parallel_for(0, 32, 1, [](size_t lo, size_t)
+            {
+                parallel_for(0, 1000, 5, [lo](size_t l, size_t)
+                {
+                    if (lo == 17 && l == 500)
+                        throw runtime_error("nested");
+                });
+            });
+        }
+        catch (runtime_error const & e)
+        {
+            caught += std::string(e.what()) == "nested";
+        }
+        stress_check(caught == 2, "parallel_for rethrows the exception of a range");
+
+        std::atomic<size_t> count{0};
+        parallel_for(0, 1000, 1, [&](size_t lo, size_t hi)
+        {
+            count.fetch_add(hi - lo, std::memory_order_relaxed);
+        });
+        stress_check(count.load() == 1000, "the scheduler runs after an exception");
+    }
+
+    void external_case()
+    {
+        vector<std::thread> callers;
+        for (size_t t = 0; t < 8; ++t)
+            callers.emplace_back([t]
+            {
+                vector<size_t> xs(5000);
+                parallel_for(0, xs.size(), 16, [&](size_t lo, size_t hi)
+                {
+                    for (auto i = lo; i < hi; ++i)
+                        xs[i] = i * (t + 1);
+                });
+                auto const sum = parallel_reduce(0, xs.size(), 0, size_t(0),
+                    [&](size_t lo, size_t hi)
+                    {
+                        size_t s = 0;
+                        for (auto i = lo; i < hi; ++i)
+                            s += xs[i];
+                        return s;
+                    },
+                    [](size_t a, size_t b) { return a + b; });
+                stress_check(sum == (t + 1) * xs.size() * (xs.size() - 1) / 2,
+                    "parallel_reduce from an external thread");
+            });
+        for (auto & c : callers)
+            c.join();
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    auto const rounds = stress_rounds(argc, argv, 200);
+
+    work_stealing_scheduler scheduler(4);
+    set_executor(&scheduler);
+    for (size_t r = 0; r < rounds && stress_failures == 0; ++r)
+    {
+        nested_case();
+        reduce_case();
+        exceptions_case();
+        external_case();
+    }
+    set_executor(nullptr);
+
+    return stress_exit("task_scheduler_stress");
+}
@@ -0,0 +1,185 @@
+/**
+ * trapdoor_pipeline_stress runs morsel pipelines (trapdoor_pipeline.hpp)
+ * whose stages use the scheduler themselves:
+ *
+ *     nested      16 lanes and a window of 16 morsels on a scheduler of 16
+ *                 workers, one stage doing a nested parallel_for over its
+ *                 morsel; every row must reach the ordered sink once, in
+ *                 source order
+ *     unordered   the same with an unordered sink and a nested
+ *                 parallel_reduce
+ *     exceptions  a stage that throws inside its nested parallel_for ends
+ *                 the run with that exception
+ *     reuse       every run's lanes run on the same 16 threads
+ *
+ * A lane blocked on a full window must never hold up the nested call of
+ * another lane, so a regression shows as a hang; run the test under a
+ * timeout.
+ *
+ * Usage:
+ *     trapdoor_pipeline_stress [ROUNDS]   (default: 50)
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tests/trapdoor_pipeline_stress.cpp \
+ *         -o trapdoor_pipeline_stress
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "cipher_trapdoor_sets/task_scheduler.hpp"
+#include "cipher_trapdoor_sets/trapdoor_pipeline.hpp"
+#include "stress_util.hpp"
+using std::runtime_error;
+using std::size_t;
+using std::vector;
+
+namespace
+{
+    struct rows_morsel
+    {
+        size_t first = 0, count = 0;
+        vector<size_t> squares;
+    };
+
+    size_t const ROWS = 200000;
+    size_t const MORSEL_ROWS = 1000;
+    size_t const LANES = 16;
+
+    std::mutex lane_threads_lock;
+    std::set<long> lane_threads;
+
+    /**
+     * Notes the kernel thread id of the calling lane; ids are not reused
+     * soon after a thread exits, so new threads show as new ids.
+     */
+    void note_lane_thread()
+    {
+        std::lock_guard<std::mutex> g(lane_threads_lock);
+        lane_threads.insert(::syscall(SYS_gettid));
+    }
+
+    auto rows_source()
+    {
+        return range_source(ROWS, MORSEL_ROWS, [](rows_morsel & m, size_t lo, size_t hi)
+        {
+            m.first = lo;
+            m.count = hi - lo;
+        });
+    }
+
+    void nested_case()
+    {
+        pipeline_options opts;
+        opts.lanes = LANES;
+        opts.window = 16;
+
+        size_t next = 0;
+        bool in_order = true;
+        size_t sum = 0;
+        run_pipeline<rows_morsel>(opts, rows_source(),
+            [&](rows_morsel & m)
+            {
+                in_order = in_order && m.first == next;
+                next = m.first + m.count;
+                for (auto x : m.squares)
+                    sum += x;
+            },
+            [](rows_morsel & m)
+            {
+                note_lane_thread();
+                m.squares.resize(m.count);
+                parallel_for(0, m.count, 16, [&](size_t lo, size_t hi)
+                {
+                    // a slow upper half is stolen and waited for, and the
+                    // waiting worker looks for other tasks meanwhile.
+                    if (hi == m.count)
+                        std::this_thread::sleep_for(std::chrono::microseconds(200));
+                    for (auto i = lo; i < hi; ++i)
+                        m.squares[i] = (m.first + i) * (m.first + i);
+                });
+            });
+
+        size_t expected = 0;
+        for (size_t i = 0; i < ROWS; ++i)
+            expected += i * i;
+        stress_check(in_order && next == ROWS, "ordered sink sees every morsel in order");
+        stress_check(sum == expected, "nested parallel_for stage computes every row");
+    }
+
+    void unordered_case()
+    {
+        pipeline_options opts;
+        opts.lanes = LANES;
+        opts.window = 16;
+        opts.ordered = false;
+
+        lane_local<size_t> rows(pipeline_lanes(opts));
+        size_t sunk = 0;
+        run_pipeline<rows_morsel>(opts, rows_source(),
+            [&](rows_morsel & m) { sunk += m.count; },
+            [&](rows_morsel & m)
+            {
+                note_lane_thread();
+                rows.local() += parallel_reduce(0, m.count, 64, size_t(0),
+                    [](size_t lo, size_t hi) { return hi - lo; },
+                    [](size_t a, size_t b) { return a + b; });
+            });
+
+        stress_check(sunk == ROWS, "unordered sink sees every row");
+        stress_check(rows.combine(0, [](size_t a, size_t b) { return a + b; }) == ROWS,
+            "nested parallel_reduce stage counts every row");
+    }
+
+    void exceptions_case()
+    {
+        pipeline_options opts;
+        opts.lanes = LANES;
+        opts.window = 16;
+
+        bool caught = false;
+        try
+        {
+            run_pipeline<rows_morsel>(opts, rows_source(),
+                [](rows_morsel &) {},
+                [](rows_morsel & m)
+                {
+                    parallel_for(0, m.count, 16, [&](size_t lo, size_t hi)
+                    {
+                        if (m.first + lo <= 123456 && 123456 < m.first + hi)
+                            throw runtime_error("stage");
+                    });
+                });
+        }
+        catch (runtime_error const & e)
+        {
+            caught = std::string(e.what()) == "stage";
+        }
+        stress_check(caught, "run_pipeline rethrows the exception of a nested stage");
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    auto const rounds = stress_rounds(argc, argv, 50);
+
+    work_stealing_scheduler scheduler(16);
+    set_executor(&scheduler);
+    for (size_t r = 0; r < rounds && stress_failures == 0; ++r)
+    {
+        nested_case();
+        unordered_case();
+        exceptions_case();
+    }
+    stress_check(lane_threads.size() <= LANES, "every run reuses the same lane threads");
+    set_executor(nullptr);
+
+    return stress_exit("trapdoor_pipeline_stress");
+}
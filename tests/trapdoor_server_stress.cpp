@@ -0,0 +1,245 @@
+/**
+ * trapdoor_server_stress exercises the query server and client
+ * (trapdoor_server.hpp, trapdoor_client.hpp):
+ *
+ *     pipeline    200 OP_LOOKUP requests of 4096 rows each are queued and
+ *                 flushed at once over connect_local(), whose responses
+ *                 fill the socket buffers long before the last request is
+ *                 written; every response must arrive, in order
+ *     churn       1000 connections are opened, queried and closed, and the
+ *                 server's finished connection threads must not pile up
+ *     socket      a server listening on a path answers a client, and a
+ *                 regular file at the path is neither replaced nor removed
+ *     limits      an expression whose stack would exceed
+ *                 PROTOCOL_MAX_EXPRESSION_DEPTH is refused and one at the
+ *                 limit answered, and a set name over 65535 bytes is
+ *                 refused by the catalog
+ *
+ * Usage:
+ *     trapdoor_server_stress [ROUNDS]     (default: 5)
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tests/trapdoor_server_stress.cpp \
+ *         -o trapdoor_server_stress
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "cipher_trapdoor_sets/trapdoor_client.hpp"
+#include "cipher_trapdoor_sets/trapdoor_server.hpp"
+#include "stress_util.hpp"
+using std::invalid_argument;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+namespace
+{
+    size_t const ROWS = 100000;
+    uint64_t const KEY = 7;
+
+    /**
+     * Writes a one-column table whose row i holds the value hash 3i.
+     */
+    void write_table(string const & path)
+    {
+        vector<trapdoor<uint64_t>> rows(ROWS);
+        for (size_t i = 0; i < ROWS; ++i)
+            rows[i] = trapdoor<uint64_t>{3 * i, KEY};
+        vector<uint8_t> bytes(ROWS * TRAPDOOR_RECORD_BYTES);
+        encode_trapdoors(rows.begin(), rows.end(), bytes.data());
+
+        auto f = std::fopen(path.c_str(), "wb");
+        if (!f)
+            throw runtime_error("cannot create " + path);
+        write_trapdoor_file_header(f, 1);
+        std::fwrite(bytes.data(), 1, bytes.size(), f);
+        std::fclose(f);
+    }
+
+    size_t thread_count()
+    {
+        std::ifstream status("/proc/self/status");
+        for (string line; std::getline(status, line);)
+            if (line.compare(0, 8, "Threads:") == 0)
+                return std::strtoull(line.c_str() + 8, nullptr, 10);
+        return 0;
+    }
+
+    void pipeline_case(trapdoor_server & server)
+    {
+        trapdoor_client c(server.connect_local());
+        size_t const requests = 200, rows = 4096;
+        vector<trapdoor<uint64_t>> qs(rows);
+        vector<uint32_t> ids;
+        for (size_t r = 0; r < requests; ++r)
+        {
+            for (size_t i = 0; i < rows; ++i)
+                qs[i] = trapdoor<uint64_t>{(r * rows + i) % (3 * ROWS), KEY};
+            ids.push_back(c.send_lookup(0, qs.begin(), qs.end()));
+        }
+        c.flush();
+
+        bool ok = true;
+        for (size_t r = 0; r < requests; ++r)
+        {
+            auto const response = c.receive();
+            ok = ok && response.id == ids[r];
+            auto const hits = decode_lookup_response(response.reader());
+            ok = ok && hits.size() == rows;
+            for (size_t i = 0; ok && i < rows; ++i)
+            {
+                auto const v = (r * rows + i) % (3 * ROWS);
+                ok = v % 3 == 0 ? hits[i].size() == 1 && hits[i][0] == v / 3 : hits[i].empty();
+            }
+        }
+        stress_check(ok, "pipelined lookups are all answered, in order");
+    }
+
+    void churn_case(trapdoor_server & server)
+    {
+        auto const before = thread_count();
+        vector<trapdoor<uint64_t>> qs{{3, KEY}, {4, KEY}};
+        for (size_t i = 0; i < 1000; ++i)
+        {
+            trapdoor_client c(server.connect_local());
+            auto const member = c.contains(0, qs.begin(), qs.end());
+            stress_check(member.size() == 2 && member[0] && !member[1], "contains over a fresh connection");
+        }
+
+        // the connection threads exit shortly after their clients close.
+        auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (thread_count() > before && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        stress_check(thread_count() <= before, "finished connection threads do not accumulate");
+    }
+
+    void socket_case(trapdoor_catalog const & catalog, string const & dir)
+    {
+        auto const path = dir + "/server.sock";
+        {
+            trapdoor_server server(catalog);
+            std::thread t([&] { server.serve(path); });
+            bool ok = false;
+            for (size_t attempt = 0; !ok && attempt < 500; ++attempt)
+            {
+                try
+                {
+                    trapdoor_client c(path);
+                    ok = c.list().size() == 1;
+                }
+                catch (runtime_error const &)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+            }
+            server.stop();
+            t.join();
+            stress_check(ok, "a client reaches the server at its path");
+        }
+
+        auto const file = dir + "/not-a-socket";
+        std::ofstream(file) << "data";
+        trapdoor_server server(catalog);
+        bool refused = false;
+        try
+        {
+            server.serve(file);
+        }
+        catch (runtime_error const &)
+        {
+            refused = true;
+        }
+        stress_check(refused && ::access(file.c_str(), F_OK) == 0,
+            "serve leaves a regular file at its path in place");
+        ::unlink(file.c_str());
+    }
+
+    /**
+     * expr_set(0) | (expr_set(0) | (...)), whose stack grows to depth
+     * entries.
+     */
+    set_expression right_nested(size_t depth)
+    {
+        auto e = expr_set(0);
+        for (size_t d = 1; d < depth; ++d)
+            e = expr_set(0) | e;
+        return e;
+    }
+
+    void limits_case(trapdoor_server & server, string const & table)
+    {
+        trapdoor_client c(server.connect_local());
+        vector<trapdoor<uint64_t>> qs{{3, KEY}, {4, KEY}};
+
+        auto const member = c.evaluate(right_nested(PROTOCOL_MAX_EXPRESSION_DEPTH),
+            qs.begin(), qs.end());
+        stress_check(member.size() == 2 && member[0] && !member[1],
+            "an expression at the depth limit is answered");
+
+        bool refused = false;
+        try
+        {
+            c.evaluate(right_nested(PROTOCOL_MAX_EXPRESSION_DEPTH + 1), qs.begin(), qs.end());
+        }
+        catch (runtime_error const &)
+        {
+            refused = true;
+        }
+        stress_check(refused, "an expression over the depth limit is refused");
+        stress_check(c.list().size() == 1, "the connection serves on after a refusal");
+
+        trapdoor_catalog catalog;
+        refused = false;
+        try
+        {
+            catalog.load(table, string(65536, 'x'));
+        }
+        catch (invalid_argument const &)
+        {
+            refused = true;
+        }
+        stress_check(refused && catalog.sets().empty(), "a set name over 65535 bytes is refused");
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    auto const rounds = stress_rounds(argc, argv, 5);
+
+    char dir[] = "/tmp/trapdoor_server_stress.XXXXXX";
+    if (!::mkdtemp(dir))
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    auto const table = string(dir) + "/table.trapdoors";
+    write_table(table);
+
+    {
+        trapdoor_catalog catalog;
+        catalog.load(table, "table");
+        trapdoor_server server(catalog);
+        for (size_t r = 0; r < rounds && stress_failures == 0; ++r)
+        {
+            pipeline_case(server);
+            churn_case(server);
+            socket_case(catalog, dir);
+            limits_case(server, table);
+        }
+    }
+
+    ::unlink(table.c_str());
+    ::rmdir(dir);
+    return stress_exit("trapdoor_server_stress");
+}
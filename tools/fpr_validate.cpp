@@ -0,0 +1,307 @@
+/**
+ * fpr_validate estimates the false positive and false negative rates of the
+ * predicates on trapdoors and the sets built from them by Monte-Carlo
+ * probing, and flags every predicate whose advertised rates are not
+ * consistent with the estimates (see error_rate_validator.hpp).
+ *
+ * Usage:
+ *     fpr_validate [-n PROBES] [-c CONFIDENCE] [-s SEED] [-f FILTER]
+ *
+ *     -n PROBES      probes per case (default: 2^26)
+ *     -c CONFIDENCE  confidence level of the intervals (default: 0.999)
+ *     -s SEED        seed of the probes (default: 1)
+ *     -f FILTER      only run the cases whose name contains FILTER
+ *
+ * One JSON object is written per case to stdout, with the advertised rates,
+ * the estimated rates and their confidence intervals, and whether each
+ * advertised rate is consistent. A summary is written to stderr. The exit
+ * status is 1 if any case is flagged, so the tool can gate a nightly run;
+ * with billions of probes (-n 4000000000), the intervals resolve rates down
+ * to about 10^-9. The results are the same for a given seed whatever the
+ * number of scheduler workers.
+ *
+ * The cases are:
+ *
+ *     shs contains (r)        members and non-members of a singular hash
+ *                             set with r-bit singular hashes
+ *     dhs contains (k,r)      the same for a k-disjoint hash set
+ *     shared dhs contains     the same for a k-DHS probed in its flat shared
+ *                             form (shared_dhs_view, shared_set_segment.hpp)
+ *
+ * == on trapdoor<X> and trapdoor_tag and the predicates of
+ * trapdoor_symmetric_difference_group and trapdoor_boolean_algebra are not
+ * validated: their headers do not compile in this tree.
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tools/fpr_validate.cpp \
+ *         -o fpr_validate -lrt
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+#include "cipher_trapdoor_sets/error_rate_validator.hpp"
+#include "cipher_trapdoor_sets/shared_set_segment.hpp"
+#include "cipher_trapdoor_sets/singular_hash_set.hpp"
+#include "cipher_trapdoor_sets/trapdoor.hpp"
+#include "cipher_trapdoor_sets/trapdoor_key.hpp"
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace
+{
+    string const SECRET = "fpr_validate secret";
+
+    /**
+     * approximate_pos_neg<2,bool>{fpr, fnr, value}, as returned by contains
+     * on the hash sets.
+     */
+    template <auto K, typename T>
+    bool realized(approximate_pos_neg<K,T> const & b)
+    {
+        return (bool)b.value;
+    }
+
+    template <auto K, typename T>
+    error_rates advertised(approximate_pos_neg<K,T> const & b)
+    {
+        return error_rates{b.fpr, b.fnr};
+    }
+
+    /**
+     * m random trapdoors with distinct value hashes under the secret.
+     */
+    vector<trapdoor<size_t>> random_members(size_t m, probe_rng & g)
+    {
+        auto const key = make_trapdoor_key(SECRET);
+        vector<trapdoor<size_t>> xs;
+        while (xs.size() < m)
+        {
+            auto const x = make_trapdoor((size_t)g(), key);
+            if (std::none_of(xs.begin(), xs.end(), [&](auto const & y)
+                { return y.value_hash == x.value_hash; }))
+                xs.push_back(x);
+        }
+        return xs;
+    }
+
+    /**
+     * A probe of contains on a set of the trapdoors xs: with probability one
+     * half a random member, otherwise a random non-member.
+     */
+    template <typename S>
+    auto membership_probe(vector<trapdoor<size_t>> xs, S set)
+    {
+        return [xs = std::move(xs), set = std::move(set)](probe_rng & g)
+        {
+            auto x = xs[g() % xs.size()];
+            auto const truth = (g() & 1) != 0;
+            if (!truth)
+            {
+                do
+                    x.value_hash = (size_t)g();
+                while (std::any_of(xs.begin(), xs.end(), [&](auto const & y)
+                    { return y.value_hash == x.value_hash; }));
+            }
+            return probe_outcome{truth, realized(contains(x, set))};
+        };
+    }
+
+    /**
+     * Singular hash sets with r-bit hashes over as many elements as keep
+     * the expected construction cost near 2^20 trials.
+     */
+    error_rate_case shs_contains_case(unsigned r)
+    {
+        auto const name = "shs contains (r=" + std::to_string(r) + ")";
+        return error_rate_case{name, [=](validator_options const & opts)
+        {
+            auto const m = std::max<size_t>(2, 1 + 20 / r);
+            auto build = [=](probe_rng & g)
+            {
+                for (;;)
+                {
+                    auto xs = random_members(m, g);
+                    auto shs = make_singular_hash_set(xs.begin(), xs.end(), r,
+                        size_t(1) << 26);
+                    if (shs)
+                        return membership_probe(std::move(xs), *shs);
+                }
+            };
+
+            probe_rng g{opts.seed};
+            auto const xs = random_members(1, g);
+            auto const rates = advertised(contains(xs[0],
+                *make_singular_hash_set(xs.begin(), xs.end(), r, 1)));
+            return validate_error_rates(name, rates, build, opts);
+        }};
+    }
+
+    error_rate_case dhs_contains_case(size_t k, unsigned r, size_t m)
+    {
+        auto const name = "dhs contains (k=" + std::to_string(k) +
+            ",r=" + std::to_string(r) + ")";
+        return error_rate_case{name, [=](validator_options const & opts)
+        {
+            auto build = [=](probe_rng & g)
+            {
+                for (;;)
+                {
+                    auto xs = random_members(m, g);
+                    auto dhs = make_disjoint_hash_set(xs.begin(), xs.end(), k,
+                        r, size_t(1) << 26);
+                    if (dhs)
+                        return membership_probe(std::move(xs), std::move(*dhs));
+                }
+            };
+
+            probe_rng g{opts.seed};
+            auto const xs = random_members(1, g);
+            auto const rates = advertised(contains(xs[0],
+                *make_disjoint_hash_set(xs.begin(), xs.end(), k, r, 1)));
+            return validate_error_rates(name, rates, build, opts);
+        }};
+    }
+
+    /**
+     * A k-DHS in its flat shared form, probed through a shared_dhs_view of
+     * a private copy of the bytes a writer would publish.
+     */
+    struct flat_dhs
+    {
+        template <typename X, template <typename> typename H, typename A>
+        explicit flat_dhs(disjoint_hash_set<X,H,A> const & xs) :
+            words(encode_shared_dhs(xs)) {}
+
+        shared_dhs_view<> view() const
+        {
+            return shared_dhs_view<>(shared_version{1, SHARED_DHS_TAG,
+                words.size() * sizeof(uint64_t), words.data()});
+        }
+
+        vector<uint64_t> words;
+    };
+
+    error_rate_case shared_dhs_contains_case(size_t k, unsigned r, size_t m)
+    {
+        auto const name = "shared dhs contains (k=" + std::to_string(k) +
+            ",r=" + std::to_string(r) + ")";
+        return error_rate_case{name, [=](validator_options const & opts)
+        {
+            auto build = [=](probe_rng & g)
+            {
+                for (;;)
+                {
+                    auto xs = random_members(m, g);
+                    auto dhs = make_disjoint_hash_set(xs.begin(), xs.end(), k,
+                        r, size_t(1) << 26);
+                    if (!dhs)
+                        continue;
+                    // the probe keeps the bytes its view points into.
+                    auto flat = std::make_shared<flat_dhs const>(*dhs);
+                    auto probe = membership_probe(std::move(xs), flat->view());
+                    return [flat, probe](probe_rng & g) { return probe(g); };
+                }
+            };
+
+            probe_rng g{opts.seed};
+            auto const xs = random_members(1, g);
+            flat_dhs const flat(*make_disjoint_hash_set(xs.begin(), xs.end(), k, r, 1));
+            auto const rates = advertised(contains(xs[0], flat.view()));
+            return validate_error_rates(name, rates, build, opts);
+        }};
+    }
+
+    void print(validation_result const & v)
+    {
+        auto const estimate = [](char const * name, double advertised,
+            rate_estimate const & e, bool ok)
+        {
+            std::printf("\"%s\":{\"advertised\":%g,\"trials\":%zu,"
+                "\"errors\":%zu,\"rate\":%g,\"lower\":%g,\"upper\":%g,"
+                "\"consistent\":%s}",
+                name, advertised, e.trials, e.errors, e.rate, e.lower,
+                e.upper, ok ? "true" : "false");
+        };
+
+        std::printf("{\"case\":\"%s\",", v.name.c_str());
+        estimate("fpr", v.advertised.fpr, v.fpr, v.fpr_ok());
+        std::printf(",");
+        estimate("fnr", v.advertised.fnr, v.fnr, v.fnr_ok());
+        std::printf(",\"seconds\":%g,\"probes_per_second\":%g}\n",
+            v.seconds, (v.fpr.trials + v.fnr.trials) / v.seconds);
+        std::fflush(stdout);
+    }
+
+    [[noreturn]] void usage()
+    {
+        std::fprintf(stderr, "usage: fpr_validate [-n PROBES] "
+            "[-c CONFIDENCE] [-s SEED] [-f FILTER]\n");
+        std::exit(2);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    validator_options opts;
+    string filter;
+    for (int i = 1; i < argc; ++i)
+    {
+        string const arg = argv[i];
+        if (arg.size() != 2 || arg[0] != '-' || i + 1 == argc)
+            usage();
+        char const * value = argv[++i];
+        switch (arg[1])
+        {
+        case 'n': opts.probes = std::strtoull(value, nullptr, 10); break;
+        case 'c': opts.confidence = std::strtod(value, nullptr); break;
+        case 's': opts.seed = std::strtoull(value, nullptr, 10); break;
+        case 'f': filter = value; break;
+        default: usage();
+        }
+    }
+    if (!(opts.confidence > 0 && opts.confidence < 1))
+        usage();
+
+    vector<error_rate_case> cases;
+    for (unsigned r : {1u, 2u, 4u, 8u, 16u})
+        cases.push_back(shs_contains_case(r));
+    cases.push_back(dhs_contains_case(2, 2, 128));
+    cases.push_back(dhs_contains_case(4, 1, 128));
+    cases.push_back(shared_dhs_contains_case(2, 2, 128));
+
+    size_t flagged = 0, run = 0;
+    for (auto const & c : cases)
+    {
+        if (c.name.find(filter) == string::npos)
+            continue;
+        ++run;
+        try
+        {
+            auto const v = c.run(opts);
+            print(v);
+            if (!v.ok())
+            {
+                ++flagged;
+                std::fprintf(stderr, "FLAGGED %s: advertised fpr %g, fnr %g; "
+                    "estimated fpr %g [%g,%g], fnr %g [%g,%g]\n",
+                    v.name.c_str(), v.advertised.fpr, v.advertised.fnr,
+                    v.fpr.rate, v.fpr.lower, v.fpr.upper,
+                    v.fnr.rate, v.fnr.lower, v.fnr.upper);
+            }
+        }
+        catch (std::exception const & e)
+        {
+            ++flagged;
+            std::fprintf(stderr, "FAILED %s: %s\n", c.name.c_str(), e.what());
+        }
+    }
+
+    std::fprintf(stderr, "%zu of %zu cases flagged\n", flagged, run);
+    return flagged == 0 ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+/**
+ * plan_set recommends a set backend and its parameters for m elements from
+ * the cost models of parameter_planner.hpp.
+ *
+ * Usage:
+ *     plan_set -m ELEMENTS -e FPR [-f FNR] [-c CONSTRUCTION_MS]
+ *              [-q QUERY_NS] [-o space|query|construction] [-C] [-a]
+ *
+ *     -m ELEMENTS         number of elements of the set
+ *     -e FPR              the largest acceptable false positive rate
+ *     -f FNR              the largest acceptable false negative rate
+ *                         (default: 0)
+ *     -c CONSTRUCTION_MS  budget on the expected construction time
+ *                         (default: 1000)
+ *     -q QUERY_NS         budget on the time of one query (default: none)
+ *     -o OBJECTIVE        what the recommendation minimizes among the
+ *                         feasible plans (default: space)
+ *     -C                  calibrate the cost coefficients on this machine
+ *                         first, rather than using the defaults
+ *     -a                  also list every candidate plan
+ *
+ * The recommendation (and, with -a, each candidate) is written to stdout as
+ * one JSON object per line; an expectation past the range of a double is
+ * written as null, and log2_expected_trials holds its log2. The exit status is 1 if no plan meets the
+ * request.
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -Iinclude tools/plan_set.cpp -o plan_set
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "cipher_trapdoor_sets/parameter_planner.hpp"
+using std::size_t;
+using std::string;
+
+namespace
+{
+    /**
+     * A JSON number, or null for a value past the range of a double, which
+     * JSON cannot represent.
+     */
+    string json_number(double x)
+    {
+        if (!std::isfinite(x))
+            return "null";
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%g", x);
+        return buf;
+    }
+
+    void print(char const * kind, set_plan const & s, plan_request const & req)
+    {
+        std::printf("{\"%s\":\"%s\",\"r\":%u,\"k\":%zu,\"N\":%zu,"
+            "\"fpr\":%g,\"fnr\":%g,\"expected_trials\":%s,\"log2_expected_trials\":%g,"
+            "\"construction_ms\":%s,\"query_ns\":%g,\"bits\":%g,"
+            "\"bits_per_element\":%g,\"bits_per_element_bound\":%g,"
+            "\"memory_bytes\":%g,\"feasible\":%s}\n",
+            kind, backend_name(s.backend), s.r, s.k, s.n_bytes,
+            s.fpr, s.fnr, json_number(s.expected_trials).c_str(), s.log2_expected_trials,
+            json_number(s.construction_ns / 1e6).c_str(), s.query_ns, s.bits,
+            s.bits_per_element, -std::log2(req.max_fpr),
+            s.memory_bytes, meets(s, req) ? "true" : "false");
+    }
+
+    [[noreturn]] void usage()
+    {
+        std::fprintf(stderr, "usage: plan_set -m ELEMENTS -e FPR [-f FNR] "
+            "[-c CONSTRUCTION_MS] [-q QUERY_NS] "
+            "[-o space|query|construction] [-C] [-a]\n");
+        std::exit(2);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    plan_request req{0, 0};
+    bool calibrate = false, all = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        string const arg = argv[i];
+        if (arg == "-C") { calibrate = true; continue; }
+        if (arg == "-a") { all = true; continue; }
+        if (arg.size() != 2 || arg[0] != '-' || i + 1 == argc)
+            usage();
+        string const value = argv[++i];
+        switch (arg[1])
+        {
+        case 'm': req.m = std::strtoull(value.c_str(), nullptr, 10); break;
+        case 'e': req.max_fpr = std::strtod(value.c_str(), nullptr); break;
+        case 'f': req.max_fnr = std::strtod(value.c_str(), nullptr); break;
+        case 'c': req.construction_ns = 1e6 * std::strtod(value.c_str(), nullptr); break;
+        case 'q': req.query_ns = std::strtod(value.c_str(), nullptr); break;
+        case 'o':
+            if (value == "space") req.objective = PLAN_MIN_SPACE;
+            else if (value == "query") req.objective = PLAN_MIN_QUERY_TIME;
+            else if (value == "construction") req.objective = PLAN_MIN_CONSTRUCTION_TIME;
+            else usage();
+            break;
+        default: usage();
+        }
+    }
+    if (req.m == 0 || !(req.max_fpr > 0 && req.max_fpr < 1))
+        usage();
+
+    cost_coefficients c;
+    if (calibrate)
+    {
+        c = calibrate_cost_coefficients();
+        std::fprintf(stderr, "calibrated: hash %.3g ns, bin %.3g ns, byte %.3g ns\n",
+            c.hash_ns, c.bin_ns, c.byte_ns);
+    }
+
+    auto const start = std::chrono::steady_clock::now();
+    auto const best = recommend_set_plan(req, c);
+    auto const us = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - start).count();
+
+    if (all)
+        for (auto const & s : candidate_plans(req, c))
+            print("candidate", s, req);
+    if (best)
+        print("recommended", *best, req);
+    std::fprintf(stderr, "planned in %.3g us\n", us);
+    if (!best)
+    {
+        std::fprintf(stderr, "no plan meets the request\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+/**
+ * trapdoor_server loads trapdoor files once and answers set queries from
+ * local processes over a Unix domain socket (see trapdoor_server.hpp for
+ * the sets and trapdoor_protocol.hpp for the protocol).
+ *
+ * Usage:
+ *     trapdoor_server [-q] -S SOCKET [NAME=]FILE...
+ *     trapdoor_server [-q] -F FD [NAME=]FILE...
+ *
+ *     -S SOCKET    path of the socket to listen on; a stale socket file at
+ *                  the path is replaced
+ *     -F FD        serve the connected socket FD, inherited from the parent
+ *                  process (e.g., a shard worker of sharded_trapdoor_set.hpp),
+ *                  until the peer closes it
+ *     -q           do not list the sets
+ *     NAME=FILE    a trapdoor file to load as the table NAME; without NAME,
+ *                  the table is named after the file, without directory and
+ *                  extension
+ *
+ * The sets are listed on stderr with their ids once loaded. The server runs
+ * until SIGINT or SIGTERM (or, with -F, until its peer closes the socket),
+ * then removes the socket file.
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tools/trapdoor_server.cpp \
+ *         -o trapdoor_server
+ */
+
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include "cipher_trapdoor_sets/trapdoor_server.hpp"
+using std::size_t;
+using std::string;
+using std::string_view;
+using std::vector;
+
+namespace
+{
+    struct table
+    {
+        string name;
+        string path;
+    };
+
+    struct options
+    {
+        string socket;
+        int fd = -1;
+        bool quiet = false;
+        vector<table> tables;
+    };
+
+    [[noreturn]] void usage(char const * msg)
+    {
+        std::fprintf(stderr, "trapdoor_server: %s\n"
+            "usage: trapdoor_server [-q] -S SOCKET [NAME=]FILE...\n"
+            "       trapdoor_server [-q] -F FD [NAME=]FILE...\n", msg);
+        std::exit(2);
+    }
+
+    string default_name(string const & path)
+    {
+        auto name = path.substr(path.find_last_of('/') + 1);
+        auto const dot = name.find('.');
+        return dot == string::npos || dot == 0 ? name : name.substr(0, dot);
+    }
+
+    options parse_options(int argc, char ** argv)
+    {
+        options opts;
+        for (int i = 1; i < argc; ++i)
+        {
+            string_view arg = argv[i];
+            if (arg == "-S")
+            {
+                if (++i == argc)
+                    usage("missing option value");
+                opts.socket = argv[i];
+            }
+            else if (arg == "-F")
+            {
+                if (++i == argc)
+                    usage("missing option value");
+                char * end;
+                auto const fd = std::strtol(argv[i], &end, 10);
+                if (*argv[i] == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX)
+                    usage("bad socket descriptor");
+                opts.fd = (int)fd;
+            }
+            else if (arg == "-q")
+                opts.quiet = true;
+            else if (arg.size() > 1 && arg[0] == '-')
+                usage("unknown option");
+            else
+            {
+                string const s(arg);
+                auto const eq = s.find('=');
+                if (eq == string::npos)
+                    opts.tables.push_back(table{default_name(s), s});
+                else
+                    opts.tables.push_back(table{s.substr(0, eq), s.substr(eq + 1)});
+            }
+        }
+
+        if (opts.socket.empty() == (opts.fd < 0))
+            usage("give one of a socket path and a socket descriptor");
+        if (opts.tables.empty())
+            usage("no trapdoor files");
+        return opts;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    auto const opts = parse_options(argc, argv);
+
+    // the signals are taken by a waiting thread, so they are blocked in
+    // every thread before any is started.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try
+    {
+        trapdoor_catalog catalog;
+        for (auto const & t : opts.tables)
+            catalog.load(t.path, t.name);
+        if (!opts.quiet)
+            for (auto const & s : catalog.sets())
+                std::fprintf(stderr, "trapdoor_server: set %u %s (%zu rows)\n",
+                    s.id, s.name.c_str(), s.index.size());
+
+        trapdoor_server server(catalog);
+        std::thread waiter([&]
+        {
+            int sig;
+            sigwait(&signals, &sig);
+            server.stop();
+        });
+
+        std::exception_ptr error;
+        try
+        {
+            if (opts.fd >= 0)
+                server.serve_socket(opts.fd);
+            else
+            {
+                if (!opts.quiet)
+                    std::fprintf(stderr, "trapdoor_server: listening on %s\n",
+                        opts.socket.c_str());
+                server.serve(opts.socket);
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        // wakes the waiter if the server stopped on its own.
+        pthread_kill(waiter.native_handle(), SIGTERM);
+        waiter.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+    catch (std::exception const & e)
+    {
+        std::fprintf(stderr, "trapdoor_server: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
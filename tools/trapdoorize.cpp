@@ -0,0 +1,551 @@
+/**
+ * trapdoorize maps selected plaintext columns of a CSV stream to trapdoors
+ * and writes them in the binary trapdoor format (see trapdoor_io.hpp).
+ *
+ * Usage:
+ *     trapdoorize -c COLUMNS [-k KEYFILE] [-t THREADS] [-b CHUNK_MIB]
+ *                 [-d DELIM] [-H] [-o OUTPUT] [INPUT...]
+ *
+ *     -c COLUMNS   comma-separated list of columns to trapdoor, either
+ *                  zero-based indices or, with -H, header names
+ *     -k KEYFILE   file holding the secret; if omitted, the secret is read
+ *                  from the TRAPDOOR_SECRET environment variable
+ *     -t THREADS   number of hashing threads (default: hardware threads)
+ *     -b CHUNK_MIB size of the chunks read from the input (default: 16)
+ *     -d DELIM     field delimiter (default: ,)
+ *     -H           each input starts with a header row; the named columns
+ *                  must be at the same positions in every input
+ *     -o OUTPUT    output file (default: stdout)
+ *     INPUT...     input files, or - for stdin (default: stdin)
+ *
+ * Each output row holds one trapdoor per selected column, in the order the
+ * columns were given. The value of a field is its unquoted text, and the
+ * secret is expanded once (make_trapdoor_key), so the trapdoor of a field
+ * equals make_trapdoor(string(field), make_trapdoor_key(secret)), which is
+ * also make_trapdoor(string(field), secret).
+ *
+ * The tool is a three stage pipeline:
+ *
+ *     read -> (parse, hash, encode) x THREADS -> write
+ *
+ * The reader cuts the input into chunks at row boundaries, the hashing
+ * threads parse a chunk into columns and run each column through the
+ * single-key batch path, and the writer emits encoded chunks in input order.
+ * The stages are connected by bounded queues, so a slow stage applies
+ * backpressure rather than buffering the whole input. Throughput in rows per
+ * second is reported on stderr.
+ *
+ * Only CSV is supported. Arrow IPC and Parquet inputs are detected by their
+ * magic bytes and rejected with a diagnostic.
+ *
+ * When compiled with -DCIPHER_TRAPDOOR_SETS_PERF_COUNTERS, the per-kernel
+ * counter report of perf_counters.hpp is written to stderr at exit.
+ *
+ * Build:
+ *     c++ -std=c++17 -O2 -pthread -Iinclude tools/trapdoorize.cpp -o trapdoorize
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "cipher_trapdoor_sets/trapdoor_batch.hpp"
+#include "cipher_trapdoor_sets/trapdoor_io.hpp"
+using std::condition_variable;
+using std::deque;
+using std::exception_ptr;
+using std::map;
+using std::mutex;
+using std::optional;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::string_view;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace
+{
+    template <typename T>
+    struct bounded_queue
+    {
+        explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+
+        void push(T x)
+        {
+            unique_lock<mutex> lock(m);
+            not_full.wait(lock, [&] { return q.size() < capacity || closed; });
+            if (closed)
+                return;
+            q.push_back(std::move(x));
+            not_empty.notify_one();
+        }
+
+        optional<T> pop()
+        {
+            unique_lock<mutex> lock(m);
+            not_empty.wait(lock, [&] { return !q.empty() || closed; });
+            if (q.empty())
+                return std::nullopt;
+            auto x = std::move(q.front());
+            q.pop_front();
+            not_full.notify_one();
+            return x;
+        }
+
+        void close()
+        {
+            unique_lock<mutex> lock(m);
+            closed = true;
+            not_empty.notify_all();
+            not_full.notify_all();
+        }
+
+        size_t capacity;
+        deque<T> q;
+        bool closed = false;
+        mutex m;
+        condition_variable not_empty;
+        condition_variable not_full;
+    };
+
+    struct options
+    {
+        vector<string> columns;
+        string key_file;
+        size_t threads = 0;
+        size_t chunk_bytes = size_t(16) << 20;
+        char delim = ',';
+        bool header = false;
+        string output;
+        vector<string> inputs;
+    };
+
+    struct raw_chunk
+    {
+        size_t seq;
+        string text;
+    };
+
+    struct encoded_chunk
+    {
+        size_t seq;
+        size_t rows;
+        vector<uint8_t> bytes;
+    };
+
+    [[noreturn]] void usage(char const * msg)
+    {
+        std::fprintf(stderr, "trapdoorize: %s\n"
+            "usage: trapdoorize -c COLUMNS [-k KEYFILE] [-t THREADS] "
+            "[-b CHUNK_MIB] [-d DELIM] [-H] [-o OUTPUT] [INPUT...]\n", msg);
+        std::exit(2);
+    }
+
+    vector<string> split(string_view s, char delim)
+    {
+        vector<string> parts;
+        size_t begin = 0;
+        for (size_t i = 0; i <= s.size(); ++i)
+        {
+            if (i == s.size() || s[i] == delim)
+            {
+                parts.emplace_back(s.substr(begin, i - begin));
+                begin = i + 1;
+            }
+        }
+        return parts;
+    }
+
+    options parse_options(int argc, char ** argv)
+    {
+        options opts;
+        for (int i = 1; i < argc; ++i)
+        {
+            string_view arg = argv[i];
+            auto value = [&]() -> char const *
+            {
+                if (++i == argc)
+                    usage("missing option value");
+                return argv[i];
+            };
+
+            if (arg == "-c")
+                opts.columns = split(value(), ',');
+            else if (arg == "-k")
+                opts.key_file = value();
+            else if (arg == "-t")
+                opts.threads = std::strtoul(value(), nullptr, 10);
+            else if (arg == "-b")
+                opts.chunk_bytes = std::strtoul(value(), nullptr, 10) << 20;
+            else if (arg == "-d")
+            {
+                string_view d = value();
+                if (d.size() != 1)
+                    usage("delimiter must be a single character");
+                opts.delim = d[0];
+            }
+            else if (arg == "-H")
+                opts.header = true;
+            else if (arg == "-o")
+                opts.output = value();
+            else if (arg.size() > 1 && arg[0] == '-')
+                usage("unknown option");
+            else
+                opts.inputs.emplace_back(arg);
+        }
+
+        if (opts.columns.empty())
+            usage("no columns selected");
+        if (opts.chunk_bytes == 0)
+            usage("chunk size must be positive");
+        if (opts.threads == 0)
+            opts.threads = std::max(1u, thread::hardware_concurrency());
+        if (opts.inputs.empty())
+            opts.inputs.emplace_back("-");
+        return opts;
+    }
+
+    string read_secret(options const & opts)
+    {
+        if (opts.key_file.empty())
+        {
+            auto s = std::getenv("TRAPDOOR_SECRET");
+            if (!s)
+                usage("no secret: pass -k KEYFILE or set TRAPDOOR_SECRET");
+            return s;
+        }
+
+        auto f = std::fopen(opts.key_file.c_str(), "rb");
+        if (!f)
+            throw runtime_error("cannot open key file " + opts.key_file);
+        string secret;
+        char buf[4096];
+        size_t n;
+        while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0)
+            secret.append(buf, n);
+        std::fclose(f);
+        while (!secret.empty() && (secret.back() == '\n' || secret.back() == '\r'))
+            secret.pop_back();
+        return secret;
+    }
+
+    /**
+     * Splits one CSV row starting at text[pos] into fields, unquoting quoted
+     * fields ("" is an escaped quote). Returns the position after the row.
+     */
+    size_t parse_row(
+        string_view text,
+        size_t pos,
+        char delim,
+        vector<string> & fields)
+    {
+        fields.clear();
+        fields.emplace_back();
+        bool quoted = false;
+        for (; pos < text.size(); ++pos)
+        {
+            auto c = text[pos];
+            if (quoted)
+            {
+                if (c != '"')
+                    fields.back() += c;
+                else if (pos + 1 < text.size() && text[pos+1] == '"')
+                    fields.back() += text[++pos];
+                else
+                    quoted = false;
+            }
+            else if (c == '"')
+                quoted = true;
+            else if (c == delim)
+                fields.emplace_back();
+            else if (c == '\n')
+                return pos + 1;
+            else if (c == '\r' && pos + 1 < text.size() && text[pos+1] == '\n')
+                continue;
+            else
+                fields.back() += c;
+        }
+        return pos;
+    }
+
+    /**
+     * Returns the offset just past the last row terminator in text that is
+     * not inside a quoted field, or 0 if there is none.
+     */
+    size_t last_row_boundary(string_view text)
+    {
+        size_t cut = 0;
+        bool quoted = false;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            if (text[i] == '"')
+                quoted = !quoted;
+            else if (text[i] == '\n' && !quoted)
+                cut = i + 1;
+        }
+        return cut;
+    }
+
+    vector<size_t> resolve_columns(
+        options const & opts,
+        vector<string> const & header)
+    {
+        vector<size_t> columns;
+        for (auto const & c : opts.columns)
+        {
+            if (opts.header)
+            {
+                auto it = std::find(header.begin(), header.end(), c);
+                if (it == header.end())
+                    throw runtime_error("no column named " + c);
+                columns.push_back((size_t)(it - header.begin()));
+            }
+            else
+            {
+                char * end;
+                auto j = std::strtoul(c.c_str(), &end, 10);
+                if (c.empty() || *end != '\0')
+                    throw runtime_error("bad column index " + c);
+                columns.push_back(j);
+            }
+        }
+        return columns;
+    }
+
+    void reject_columnar_formats(string_view head, string const & name)
+    {
+        if (head.substr(0, 6) == "ARROW1")
+            throw runtime_error(name + ": Arrow IPC input is not supported");
+        if (head.substr(0, 4) == "PAR1")
+            throw runtime_error(name + ": Parquet input is not supported");
+    }
+
+    encoded_chunk hash_chunk(
+        raw_chunk const & chunk,
+        vector<size_t> const & columns,
+        char delim,
+        trapdoor_key<> const & key)
+    {
+        vector<vector<string>> values(columns.size());
+        vector<string> fields;
+        string_view text = chunk.text;
+        size_t pos = 0;
+        while (pos < text.size())
+        {
+            pos = parse_row(text, pos, delim, fields);
+            if (fields.size() == 1 && fields[0].empty())
+                continue;
+            for (size_t c = 0; c < columns.size(); ++c)
+            {
+                if (columns[c] >= fields.size())
+                    throw runtime_error("row has too few fields");
+                values[c].push_back(std::move(fields[columns[c]]));
+            }
+        }
+
+        auto const rows = values.empty() ? 0 : values[0].size();
+        vector<trapdoor<string>> trapdoors(rows * columns.size());
+        vector<trapdoor<string>> column(rows);
+        for (size_t c = 0; c < columns.size(); ++c)
+        {
+            make_trapdoors(values[c].begin(), values[c].end(), key, column.begin());
+            for (size_t r = 0; r < rows; ++r)
+                trapdoors[r * columns.size() + c] = column[r];
+        }
+
+        encoded_chunk out{chunk.seq, rows, {}};
+        out.bytes.resize(trapdoors.size() * TRAPDOOR_RECORD_BYTES);
+        encode_trapdoors(trapdoors.begin(), trapdoors.end(), out.bytes.data());
+        return out;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    auto const opts = parse_options(argc, argv);
+
+    try
+    {
+        auto const secret = read_secret(opts);
+        auto const key = make_trapdoor_key(secret);
+
+        FILE * out = opts.output.empty() ? stdout :
+            std::fopen(opts.output.c_str(), "wb");
+        if (!out)
+            throw runtime_error("cannot open " + opts.output);
+        write_trapdoor_file_header(out, (uint32_t)opts.columns.size());
+
+        bounded_queue<raw_chunk> raw(2 * opts.threads);
+        bounded_queue<encoded_chunk> encoded(2 * opts.threads);
+
+        mutex error_mutex;
+        exception_ptr error;
+        auto fail = [&](exception_ptr e)
+        {
+            {
+                unique_lock<mutex> lock(error_mutex);
+                if (!error)
+                    error = e;
+            }
+            raw.close();
+            encoded.close();
+        };
+
+        // columns are resolved by the reader from the first header row, and
+        // published to the hashing threads before the first chunk; a later
+        // header must resolve them to the same positions.
+        vector<size_t> columns;
+        if (!opts.header)
+            columns = resolve_columns(opts, {});
+
+        auto const start = std::chrono::steady_clock::now();
+
+        thread reader([&]
+        {
+            try
+            {
+                size_t seq = 0;
+                vector<char> buf(opts.chunk_bytes);
+                for (auto const & name : opts.inputs)
+                {
+                    FILE * in = name == "-" ? stdin : std::fopen(name.c_str(), "rb");
+                    if (!in)
+                        throw runtime_error("cannot open " + name);
+
+                    string carry;
+                    bool first = true;
+                    bool need_header = opts.header;
+                    size_t n;
+                    while ((n = std::fread(buf.data(), 1, buf.size(), in)) > 0)
+                    {
+                        carry.append(buf.data(), n);
+                        if (first)
+                        {
+                            reject_columnar_formats(carry, name);
+                            first = false;
+                        }
+
+                        if (need_header)
+                        {
+                            auto eol = carry.find('\n');
+                            if (eol == string::npos)
+                                continue;
+                            vector<string> header;
+                            parse_row(carry, 0, opts.delim, header);
+                            auto resolved = resolve_columns(opts, header);
+                            if (columns.empty())
+                                columns = std::move(resolved);
+                            else if (resolved != columns)
+                                throw runtime_error(name +
+                                    ": the columns are not where the first input has them");
+                            carry.erase(0, eol + 1);
+                            need_header = false;
+                        }
+
+                        auto cut = last_row_boundary(carry);
+                        if (cut == 0)
+                            continue;
+                        raw.push(raw_chunk{seq++, carry.substr(0, cut)});
+                        carry.erase(0, cut);
+                    }
+
+                    if (in != stdin)
+                        std::fclose(in);
+                    if (!carry.empty())
+                        raw.push(raw_chunk{seq++, std::move(carry)});
+                }
+            }
+            catch (...)
+            {
+                fail(std::current_exception());
+            }
+            raw.close();
+        });
+
+        vector<thread> hashers;
+        for (size_t t = 0; t < opts.threads; ++t)
+        {
+            hashers.emplace_back([&]
+            {
+                try
+                {
+                    while (auto chunk = raw.pop())
+                        encoded.push(hash_chunk(*chunk, columns, opts.delim, key));
+                }
+                catch (...)
+                {
+                    fail(std::current_exception());
+                }
+            });
+        }
+
+        size_t rows = 0;
+        thread writer([&]
+        {
+            try
+            {
+                size_t next = 0;
+                map<size_t,encoded_chunk> pending;
+                while (auto chunk = encoded.pop())
+                {
+                    auto seq = chunk->seq;
+                    pending.emplace(seq, std::move(*chunk));
+                    for (auto it = pending.find(next); it != pending.end();
+                         it = pending.find(++next))
+                    {
+                        auto const & bytes = it->second.bytes;
+                        if (std::fwrite(bytes.data(), 1, bytes.size(), out) != bytes.size())
+                            throw runtime_error("write failed");
+                        rows += it->second.rows;
+                        pending.erase(it);
+                    }
+                }
+            }
+            catch (...)
+            {
+                fail(std::current_exception());
+            }
+        });
+
+        reader.join();
+        for (auto & h : hashers)
+            h.join();
+        encoded.close();
+        writer.join();
+
+        if (std::fflush(out) != 0)
+            throw runtime_error("write failed");
+        if (out != stdout)
+            std::fclose(out);
+        if (error)
+            std::rethrow_exception(error);
+
+        auto const seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        std::fprintf(stderr, "trapdoorize: %zu rows in %.3f s (%.0f rows/s)\n",
+            rows, seconds, seconds > 0 ? rows / seconds : 0.);
+#if defined(CIPHER_TRAPDOOR_SETS_PERF_COUNTERS)
+        print_perf_kernel_report(stderr);
+#endif
+    }
+    catch (std::exception const & e)
+    {
+        std::fprintf(stderr, "trapdoorize: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}